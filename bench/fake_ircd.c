@@ -0,0 +1,593 @@
+// fake_ircd.c - Loopback IRC server stand-in for load-testing the bot
+//
+// Accepts the bot's connections (-k, for a bot sharding channels over several),
+// answers the NICK/USER/JOIN handshake, PING and NAMES, then replays
+// synthetic channel traffic, each channel on the connection that joined it, at a fixed rate
+// with a configurable mix of trigger hits, misses, channel mentions and
+// admin commands. With -C it also offers IRCv3 capabilities: acked
+// server-time tags every line, multi-prefix and userhost-in-names change the
+// NAMES entries and batch adds a netsplit and a netjoin of a few users at
+// the start of the traffic. Every bot PRIVMSG is matched against the oldest pending
+// expectation for the same target to measure reply latency. Results are
+// appended to a JSON-lines report.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SERVER_NAME "fake.irc"
+#define MAX_BENCH_CHANNELS 64
+#define MAX_CONNS 16
+#define MAX_TARGETS 128
+#define LINE_MAX_LEN 512
+#define ALL_CAPS "server-time message-tags multi-prefix userhost-in-names extended-join batch"
+#define SPLIT_USERS 20
+
+enum { KIND_HIT, KIND_MISS, KIND_MENTION, KIND_ADMIN, KIND_COUNT };
+
+typedef struct {
+    int port;
+    int connections;        // bot connections to accept
+    char channels[MAX_BENCH_CHANNELS][64];
+    int channel_count;
+    double rate;            // messages per second
+    double duration;        // seconds of traffic
+    double drain;           // seconds to wait for late replies
+    int mix[KIND_COUNT];    // relative weights
+    char trigger[64];       // trigger word that the bench catalogue answers
+    char admin_nick[64];
+    char admin_pass[64];
+    const char *report_path;
+    const char *label;
+    char caps[256];         // offered to CAP LS; "" = CAP is an unknown command
+} BenchOptions;
+
+// FIFO of send timestamps for replies we expect on one target
+typedef struct {
+    char name[64];
+    double *sent;
+    size_t head, tail, cap;
+} TargetQueue;
+
+typedef struct {
+    int fd;
+    char inbuf[8192];
+    size_t inlen;
+    char nick[64];
+    int got_user;
+    int registered;
+    int joined_count;
+    int negotiating;        // between CAP LS and CAP END
+    char acked[256];        // capabilities the bot requested, " "-separated
+} BotConn;
+
+static BotConn conns[MAX_CONNS];
+static int conn_count = 0;
+static int channel_conn[MAX_BENCH_CHANNELS]; // connection that joined each channel, -1 = none
+static int joined_total = 0;
+
+static TargetQueue targets[MAX_TARGETS];
+static int target_count = 0;
+static double *latencies = NULL;
+static size_t latency_count = 0, latency_cap = 0;
+static unsigned long sent_by_kind[KIND_COUNT];
+static unsigned long expected_replies = 0;
+static unsigned long replies_total = 0, replies_unmatched = 0;
+static unsigned long pings_answered = 0, names_answered = 0;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static TargetQueue *get_target(const char *name) {
+    for (int i = 0; i < target_count; ++i) {
+        if (strcasecmp(targets[i].name, name) == 0) return &targets[i];
+    }
+    if (target_count >= MAX_TARGETS) return NULL;
+    TargetQueue *t = &targets[target_count++];
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    t->head = t->tail = 0;
+    t->cap = 0;
+    t->sent = NULL;
+    return t;
+}
+
+static void expect_reply(const char *target, double t_sent) {
+    TargetQueue *t = get_target(target);
+    if (!t) return;
+    if (t->tail == t->cap) {
+        size_t ncap = t->cap ? t->cap * 2 : 256;
+        t->sent = realloc(t->sent, ncap * sizeof(double));
+        t->cap = ncap;
+    }
+    t->sent[t->tail++] = t_sent;
+    expected_replies++;
+}
+
+static void record_reply(const char *target, double t_recv) {
+    replies_total++;
+    TargetQueue *t = get_target(target);
+    if (!t || t->head == t->tail) { replies_unmatched++; return; }
+    double lat = t_recv - t->sent[t->head++];
+    if (latency_count == latency_cap) {
+        latency_cap = latency_cap ? latency_cap * 2 : 1024;
+        latencies = realloc(latencies, latency_cap * sizeof(double));
+    }
+    latencies[latency_count++] = lat;
+}
+
+static int has_cap(const char *list, const char *cap) {
+    size_t len = strlen(cap);
+    for (const char *p = strstr(list, cap); p; p = strstr(p + 1, cap)) {
+        if ((p == list || p[-1] == ' ') && (p[len] == 0 || p[len] == ' ')) return 1;
+    }
+    return 0;
+}
+
+static void send_line(BotConn *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void send_line(BotConn *c, const char *fmt, ...) {
+    char line[LINE_MAX_LEN + 64];
+    int tags = 0;
+    if (has_cap(c->acked, "server-time")) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        struct tm tm;
+        gmtime_r(&ts.tv_sec, &tm);
+        tags = (int)strftime(line, sizeof(line), "@time=%Y-%m-%dT%H:%M:%S", &tm);
+        tags += snprintf(line + tags, sizeof(line) - tags, ".%03ldZ ", ts.tv_nsec / 1000000);
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line + tags, LINE_MAX_LEN, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n > LINE_MAX_LEN - 2) n = LINE_MAX_LEN - 2;
+    // "@time=... @batch=x :..." becomes one tag block, "@time=...;batch=x :..."
+    if (tags && line[tags] == '@') {
+        line[tags - 1] = ';';
+        memmove(line + tags, line + tags + 1, n - 1);
+        n--;
+    }
+    n += tags;
+    line[n++] = '\r';
+    line[n++] = '\n';
+    size_t off = 0;
+    while (off < (size_t)n) {
+        ssize_t w = send(c->fd, line + off, n - off, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd p = { c->fd, POLLOUT, 0 };
+                poll(&p, 1, 100);
+                continue;
+            }
+            return;
+        }
+        off += w;
+    }
+}
+
+static int channel_index(const BenchOptions *o, const char *name) {
+    for (int i = 0; i < o->channel_count; ++i) {
+        if (strcasecmp(o->channels[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static void send_names(BotConn *c, const char *chan) {
+    if (has_cap(c->acked, "userhost-in-names")) {
+        send_line(c, ":%s 353 %s = %s :%s%s!bot@localhost user001!u@bench %suser002!u@bench ABCD1234!u@bench", SERVER_NAME, c->nick, chan,
+                  has_cap(c->acked, "multi-prefix") ? "@+" : "@", c->nick, has_cap(c->acked, "multi-prefix") ? "@+" : "+");
+    } else if (has_cap(c->acked, "multi-prefix")) {
+        send_line(c, ":%s 353 %s = %s :@+%s user001 @+user002 ABCD1234", SERVER_NAME, c->nick, chan, c->nick);
+    } else {
+        send_line(c, ":%s 353 %s = %s :%s user001 user002 ABCD1234", SERVER_NAME, c->nick, chan, c->nick);
+    }
+    send_line(c, ":%s 366 %s %s :End of /NAMES list.", SERVER_NAME, c->nick, chan);
+}
+
+// CAP LS, REQ and END; a REQ is acked whole or not at all
+static void handle_cap(BotConn *c, const BenchOptions *o, const char *line) {
+    const char *nick = c->nick[0] ? c->nick : "*";
+    if (!o->caps[0]) {
+        send_line(c, ":%s 421 %s CAP :Unknown command", SERVER_NAME, nick);
+    } else if (strncmp(line, "CAP LS", 6) == 0) {
+        c->negotiating = 1;
+        send_line(c, ":%s CAP %s LS :%s", SERVER_NAME, nick, o->caps);
+    } else if (strncmp(line, "CAP REQ ", 8) == 0) {
+        const char *list = line + 8;
+        if (*list == ':') ++list;
+        char copy[256];
+        snprintf(copy, sizeof(copy), "%s", list);
+        int ok = 1;
+        char *save = NULL;
+        for (char *cap = strtok_r(copy, " ", &save); cap; cap = strtok_r(NULL, " ", &save)) {
+            if (!has_cap(o->caps, cap)) ok = 0;
+        }
+        send_line(c, ":%s CAP %s %s :%s", SERVER_NAME, nick, ok ? "ACK" : "NAK", list);
+        if (ok) snprintf(c->acked, sizeof(c->acked), "%s", list);
+    } else if (strncmp(line, "CAP END", 7) == 0) {
+        c->negotiating = 0;
+    }
+}
+
+// A netsplit and the netjoin that heals it, each as one batch
+static void send_netsplit(BotConn *c, const BenchOptions *o) {
+    send_line(c, ":%s BATCH +split netsplit %s leaf.irc", SERVER_NAME, SERVER_NAME);
+    for (int i = 0; i < SPLIT_USERS; ++i) {
+        send_line(c, "@batch=split :split%03d!u@leaf QUIT :%s leaf.irc", i, SERVER_NAME);
+    }
+    send_line(c, ":%s BATCH -split", SERVER_NAME);
+    send_line(c, ":%s BATCH +join netjoin %s leaf.irc", SERVER_NAME, SERVER_NAME);
+    for (int i = 0; i < SPLIT_USERS; ++i) {
+        if (has_cap(c->acked, "extended-join")) {
+            send_line(c, "@batch=join :split%03d!u@leaf JOIN %s * :Split User", i, o->channels[i % o->channel_count]);
+        } else {
+            send_line(c, "@batch=join :split%03d!u@leaf JOIN %s", i, o->channels[i % o->channel_count]);
+        }
+    }
+    send_line(c, ":%s BATCH -join", SERVER_NAME);
+}
+
+// Handles one line sent by the bot
+static void handle_bot_line(BotConn *c, const BenchOptions *o, char *line, double t) {
+    if (strncmp(line, "CAP ", 4) == 0) {
+        handle_cap(c, o, line);
+    } else if (strncmp(line, "NICK ", 5) == 0) {
+        snprintf(c->nick, sizeof(c->nick), "%s", line + 5);
+    } else if (strncmp(line, "USER ", 5) == 0) {
+        c->got_user = 1;
+    } else if (strncmp(line, "PING", 4) == 0) {
+        const char *arg = line + 4;
+        while (*arg == ' ') ++arg;
+        if (*arg == ':') ++arg;
+        send_line(c, ":%s PONG %s :%s", SERVER_NAME, SERVER_NAME, arg);
+        pings_answered++;
+    } else if (strncmp(line, "JOIN ", 5) == 0) {
+        char list[LINE_MAX_LEN];
+        snprintf(list, sizeof(list), "%s", line + 5);
+        char *save = NULL;
+        for (char *chan = strtok_r(list, ", ", &save); chan; chan = strtok_r(NULL, ", ", &save)) {
+            send_line(c, ":%s!bot@localhost JOIN %s", c->nick, chan);
+            send_names(c, chan);
+            int idx = channel_index(o, chan);
+            if (idx >= 0 && channel_conn[idx] < 0) {
+                channel_conn[idx] = (int)(c - conns);
+                c->joined_count++;
+                joined_total++;
+            }
+        }
+    } else if (strncmp(line, "NAMES ", 6) == 0) {
+        send_names(c, line + 6);
+        names_answered++;
+    } else if (strncmp(line, "PRIVMSG ", 8) == 0) {
+        char target[64];
+        const char *sp = strchr(line + 8, ' ');
+        size_t len = sp ? (size_t)(sp - (line + 8)) : strlen(line + 8);
+        if (len >= sizeof(target)) len = sizeof(target) - 1;
+        memcpy(target, line + 8, len);
+        target[len] = 0;
+        record_reply(target, t);
+    }
+    if (!c->registered && c->nick[0] && c->got_user && !c->negotiating) {
+        c->registered = 1;
+        send_line(c, ":%s 001 %s :Welcome to the fake IRC network %s", SERVER_NAME, c->nick, c->nick);
+        send_line(c, ":%s 376 %s :End of /MOTD command.", SERVER_NAME, c->nick);
+    }
+}
+
+// Reads and processes everything currently available on one connection
+static int read_bot(BotConn *c, const BenchOptions *o) {
+    ssize_t n = recv(c->fd, c->inbuf + c->inlen, sizeof(c->inbuf) - c->inlen - 1, 0);
+    if (n <= 0) return -1;
+    double t = now_sec();
+    c->inlen += n;
+    c->inbuf[c->inlen] = 0;
+    char *line = c->inbuf;
+    char *eol;
+    while ((eol = strstr(line, "\r\n")) != NULL) {
+        *eol = 0;
+        handle_bot_line(c, o, line, t);
+        line = eol + 2;
+    }
+    c->inlen -= line - c->inbuf;
+    memmove(c->inbuf, line, c->inlen);
+    if (c->inlen == sizeof(c->inbuf) - 1) c->inlen = 0; // overlong garbage
+    return 0;
+}
+
+// Waits up to timeout_ms for the bot, then reads every connection with input.
+// Returns -1 if any connection was closed.
+static int pump_bot(const BenchOptions *o, int timeout_ms) {
+    struct pollfd p[MAX_CONNS];
+    for (int i = 0; i < conn_count; ++i) p[i] = (struct pollfd){ conns[i].fd, POLLIN, 0 };
+    if (poll(p, conn_count, timeout_ms) <= 0) return 0;
+    int rc = 0;
+    for (int i = 0; i < conn_count; ++i) {
+        if (p[i].revents && read_bot(&conns[i], o) < 0) rc = -1;
+    }
+    return rc;
+}
+
+// Connection that joined channel (the first one if none did)
+static BotConn *channel_owner(const BenchOptions *o, const char *channel) {
+    int idx = channel_index(o, channel);
+    return idx >= 0 && channel_conn[idx] >= 0 ? &conns[channel_conn[idx]] : &conns[0];
+}
+
+static int pick_kind(const BenchOptions *o, unsigned long seq) {
+    int total = 0;
+    for (int k = 0; k < KIND_COUNT; ++k) total += o->mix[k];
+    if (total <= 0) return KIND_MISS;
+    // Deterministic interleaving so every run sees the same sequence
+    int slot = (int)((seq * 7919UL) % (unsigned long)total);
+    for (int k = 0; k < KIND_COUNT; ++k) {
+        if (slot < o->mix[k]) return k;
+        slot -= o->mix[k];
+    }
+    return KIND_MISS;
+}
+
+// Sends one synthetic message and records the replies it should produce
+static void send_traffic(const BenchOptions *o, unsigned long seq, int admin_idx) {
+    int kind = pick_kind(o, seq);
+    int chan = (int)(seq % o->channel_count);
+    if (chan == admin_idx && o->channel_count > 1) chan = (chan + 1) % o->channel_count;
+    const char *channel = o->channels[chan];
+    BotConn *c = channel_owner(o, channel);
+    char user[16];
+    snprintf(user, sizeof(user), "user%03lu", seq % 500);
+    double t = now_sec();
+    switch (kind) {
+    case KIND_HIT:
+        send_line(c, ":%s!u@bench PRIVMSG %s :%s number %lu", user, channel, o->trigger, seq);
+        expect_reply(channel, t);
+        break;
+    case KIND_MISS:
+        send_line(c, ":%s!u@bench PRIVMSG %s :just chatting %lu", user, channel, seq);
+        break;
+    case KIND_MENTION: {
+        if (o->channel_count < 2) {
+            send_line(c, ":%s!u@bench PRIVMSG %s :just chatting %lu", user, channel, seq);
+            break;
+        }
+        const char *other = o->channels[(chan + 1) % o->channel_count];
+        if (admin_idx >= 0 && strcasecmp(other, o->channels[admin_idx]) == 0 && o->channel_count > 2)
+            other = o->channels[(chan + 2) % o->channel_count];
+        if (strcasecmp(other, channel) == 0) {
+            send_line(c, ":%s!u@bench PRIVMSG %s :just chatting %lu", user, channel, seq);
+            break;
+        }
+        send_line(c, ":%s!u@bench PRIVMSG %s :see %s for more %lu", user, channel, other, seq);
+        expect_reply(other, t);
+        break;
+    }
+    case KIND_ADMIN:
+        if (admin_idx < 0) {
+            send_line(c, ":%s!u@bench PRIVMSG %s :just chatting %lu", user, channel, seq);
+            break;
+        }
+        send_line(channel_owner(o, o->channels[admin_idx]), ":%s!u@bench PRIVMSG %s :!clearignore %lu", o->admin_nick, o->channels[admin_idx], seq);
+        expect_reply(o->channels[admin_idx], t);
+        break;
+    }
+    sent_by_kind[kind]++;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double p) {
+    if (latency_count == 0) return 0;
+    size_t idx = (size_t)(p / 100.0 * (latency_count - 1) + 0.5);
+    if (idx >= latency_count) idx = latency_count - 1;
+    return latencies[idx];
+}
+
+static void write_report(const BenchOptions *o, double traffic_secs, double handshake_secs) {
+    qsort(latencies, latency_count, sizeof(double), cmp_double);
+    double sum = 0;
+    for (size_t i = 0; i < latency_count; ++i) sum += latencies[i];
+    char json[2048];
+    int n = snprintf(json, sizeof(json),
+        "{\"label\":\"%s\",\"timestamp\":%ld,\"channels\":%d,\"connections\":%d,\"rate\":%.1f,\"duration_s\":%.2f,"
+        "\"handshake_ms\":%.3f,"
+        "\"sent\":{\"hit\":%lu,\"miss\":%lu,\"mention\":%lu,\"admin\":%lu},"
+        "\"expected_replies\":%lu,\"replies\":%lu,\"unmatched_replies\":%lu,"
+        "\"reply_throughput_per_s\":%.2f,"
+        "\"latency_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+        "\"pings\":%lu,\"names\":%lu,\"caps\":\"%s\"}",
+        o->label, (long)time(NULL), o->channel_count, conn_count, o->rate, traffic_secs,
+        handshake_secs * 1000.0,
+        sent_by_kind[KIND_HIT], sent_by_kind[KIND_MISS], sent_by_kind[KIND_MENTION], sent_by_kind[KIND_ADMIN],
+        expected_replies, replies_total, replies_unmatched,
+        traffic_secs > 0 ? latency_count / traffic_secs : 0.0,
+        latency_count ? sum / latency_count * 1000.0 : 0.0,
+        percentile(50) * 1000.0, percentile(90) * 1000.0, percentile(99) * 1000.0,
+        latency_count ? latencies[latency_count - 1] * 1000.0 : 0.0,
+        pings_answered, names_answered, conns[0].acked);
+    printf("%.*s\n", n, json);
+    if (o->report_path) {
+        FILE *f = fopen(o->report_path, "a");
+        if (f) {
+            fprintf(f, "%s\n", json);
+            fclose(f);
+        } else {
+            perror("[BENCH] report");
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -p port          listen port (default 6667)\n"
+        "  -k connections   bot connections to accept (default 1)\n"
+        "  -c #a,#b,...     channels the bot is expected to join (default #unix,#admin,#random)\n"
+        "  -r rate          synthetic messages per second (default 20)\n"
+        "  -d seconds       traffic duration (default 10)\n"
+        "  -D seconds       drain time for late replies (default 3)\n"
+        "  -m h:m:c:a       mix weights hit:miss:mention:admin (default 6:2:1:1)\n"
+        "  -t trigger       trigger word answered by the catalogue (default hello)\n"
+        "  -a nick:pass     admin credentials used for admin traffic\n"
+        "  -o report.jsonl  append a JSON result line to this file\n"
+        "  -l label         label stored in the report\n"
+        "  -C caps|all      IRCv3 capabilities to offer, \" \"-separated (default: no CAP support)\n", prog);
+}
+
+static int parse_options(int argc, char **argv, BenchOptions *o) {
+    memset(o, 0, sizeof(*o));
+    o->port = 6667;
+    o->connections = 1;
+    o->rate = 20;
+    o->duration = 10;
+    o->drain = 3;
+    o->mix[KIND_HIT] = 6; o->mix[KIND_MISS] = 2; o->mix[KIND_MENTION] = 1; o->mix[KIND_ADMIN] = 1;
+    snprintf(o->trigger, sizeof(o->trigger), "hello");
+    o->label = "default";
+    const char *chans = "#unix,#admin,#random";
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || !arg[1] || arg[2] || i + 1 >= argc) { usage(argv[0]); return -1; }
+        const char *val = argv[++i];
+        switch (arg[1]) {
+        case 'p': o->port = atoi(val); break;
+        case 'k': o->connections = atoi(val); break;
+        case 'c': chans = val; break;
+        case 'r': o->rate = atof(val); break;
+        case 'd': o->duration = atof(val); break;
+        case 'D': o->drain = atof(val); break;
+        case 'm':
+            if (sscanf(val, "%d:%d:%d:%d", &o->mix[0], &o->mix[1], &o->mix[2], &o->mix[3]) != 4) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 't': snprintf(o->trigger, sizeof(o->trigger), "%s", val); break;
+        case 'a': {
+            const char *sep = strchr(val, ':');
+            if (!sep) { usage(argv[0]); return -1; }
+            snprintf(o->admin_nick, sizeof(o->admin_nick), "%.*s", (int)(sep - val), val);
+            snprintf(o->admin_pass, sizeof(o->admin_pass), "%s", sep + 1);
+            break;
+        }
+        case 'o': o->report_path = val; break;
+        case 'l': o->label = val; break;
+        case 'C': snprintf(o->caps, sizeof(o->caps), "%s", strcmp(val, "all") == 0 ? ALL_CAPS : val); break;
+        default: usage(argv[0]); return -1;
+        }
+    }
+    char list[1024];
+    snprintf(list, sizeof(list), "%s", chans);
+    char *save = NULL;
+    for (char *tok = strtok_r(list, ",", &save); tok && o->channel_count < MAX_BENCH_CHANNELS; tok = strtok_r(NULL, ",", &save)) {
+        snprintf(o->channels[o->channel_count++], sizeof(o->channels[0]), "%s", tok);
+    }
+    if (o->channel_count == 0 || o->rate <= 0 || o->connections < 1 || o->connections > MAX_CONNS) { usage(argv[0]); return -1; }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchOptions o;
+    if (parse_options(argc, argv, &o) != 0) return 1;
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0) { perror("socket"); return 1; }
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(o.port);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
+    if (listen(lfd, MAX_CONNS) < 0) { perror("listen"); return 1; }
+    printf("[BENCH] Listening on 127.0.0.1:%d\n", o.port);
+    fflush(stdout);
+
+    for (int i = 0; i < o.channel_count; ++i) channel_conn[i] = -1;
+    double t_connect = 0;
+    for (conn_count = 0; conn_count < o.connections; ++conn_count) {
+        BotConn *c = &conns[conn_count];
+        c->fd = accept(lfd, NULL, NULL);
+        if (c->fd < 0) { perror("accept"); return 1; }
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        if (conn_count == 0) t_connect = now_sec();
+    }
+
+    // Handshake: wait until every expected channel is joined
+    while (joined_total < o.channel_count) {
+        if (pump_bot(&o, 100) < 0) { fprintf(stderr, "[BENCH] Bot disconnected during handshake\n"); return 1; }
+        if (now_sec() - t_connect > 30) { fprintf(stderr, "[BENCH] Timed out waiting for JOINs\n"); return 1; }
+    }
+    double handshake = now_sec() - t_connect;
+    for (int i = 0; i < conn_count; ++i) {
+        printf("[BENCH] Bot %s joined %d channels in %.1f ms\n", conns[i].nick, conns[i].joined_count, handshake * 1000.0);
+    }
+    fflush(stdout);
+
+    int admin_idx = channel_index(&o, "#admin");
+    if (admin_idx >= 0 && o.admin_nick[0]) {
+        // The bot answers a successful !auth on the private query and in #admin
+        BotConn *c = channel_owner(&o, "#admin");
+        send_line(c, ":%s!u@bench PRIVMSG %s :!auth %s", o.admin_nick, c->nick, o.admin_pass);
+        expect_reply(o.admin_nick, now_sec());
+        expect_reply(o.channels[admin_idx], now_sec());
+        double until = now_sec() + 1.0;
+        while (now_sec() < until) {
+            if (pump_bot(&o, 50) < 0) break;
+        }
+    } else {
+        admin_idx = -1;
+        o.mix[KIND_ADMIN] = 0;
+    }
+
+    for (int i = 0; i < conn_count; ++i) {
+        if (has_cap(conns[i].acked, "batch")) send_netsplit(&conns[i], &o);
+    }
+
+    // Replay synthetic traffic at the requested rate
+    double interval = 1.0 / o.rate;
+    double t_start = now_sec();
+    double t_next = t_start;
+    unsigned long seq = 0;
+    int alive = 1;
+    while (alive && now_sec() - t_start < o.duration) {
+        double t = now_sec();
+        while (t_next <= t && t - t_start < o.duration) {
+            send_traffic(&o, seq++, admin_idx);
+            t_next += interval;
+        }
+        int wait_ms = (int)((t_next - now_sec()) * 1000.0);
+        if (wait_ms < 0) wait_ms = 0;
+        if (pump_bot(&o, wait_ms) < 0) alive = 0;
+    }
+    double traffic_secs = now_sec() - t_start;
+    // Drain replies that are still in flight
+    double drain_until = now_sec() + o.drain;
+    while (alive && now_sec() < drain_until) {
+        if (pump_bot(&o, 50) < 0) alive = 0;
+    }
+    write_report(&o, traffic_secs, handshake);
+    for (int i = 0; i < conn_count; ++i) {
+        if (alive) send_line(&conns[i], "ERROR :Closing link (benchmark finished)");
+        close(conns[i].fd);
+    }
+    close(lfd);
+    return 0;
+}
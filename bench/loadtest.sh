@@ -0,0 +1,63 @@
+#!/bin/sh
+# loadtest.sh - Run the bot against bench/fake_ircd and append a JSON report line
+#
+# Tunables (environment): BENCH_PORT, BENCH_RATE, BENCH_DURATION, BENCH_MIX,
+# BENCH_CHANNELS (number of non-admin channels), BENCH_WORKERS (bot 'workers'
+# setting), BENCH_CONNECTIONS (bot 'connections' setting), BENCH_CAPS (IRCv3
+# capabilities the server offers, "all" or a " "-separated list), BENCH_LABEL,
+# BENCH_REPORT.
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=${BENCH_PORT:-16667}
+RATE=${BENCH_RATE:-20}
+DURATION=${BENCH_DURATION:-10}
+MIX=${BENCH_MIX:-6:2:1:1}
+NCHAN=${BENCH_CHANNELS:-3}
+WORKERS=${BENCH_WORKERS:-0}
+CONNECTIONS=${BENCH_CONNECTIONS:-1}
+CAPS=${BENCH_CAPS:-}
+LABEL=${BENCH_LABEL:-$(git rev-parse --short HEAD 2>/dev/null || echo local)}
+REPORT=${BENCH_REPORT:-bench/results.jsonl}
+
+WORK=$(mktemp -d)
+BOT_PID=
+SRV_PID=
+cleanup() {
+    kill $BOT_PID $SRV_PID 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+CHANNELS="#admin"
+: > "$WORK/narratives.txt"
+i=1
+while [ $i -le "$NCHAN" ]; do
+    CHANNELS="$CHANNELS,#bench$i"
+    echo "#bench$i|hello|Hello from bench channel $i!" >> "$WORK/narratives.txt"
+    i=$((i + 1))
+done
+
+cat > "$WORK/bot.conf" <<CONF
+channels = $CHANNELS
+admins = benchadmin:benchpass
+nickname = bbench001
+server = 127.0.0.1
+port = $PORT
+narratives = $WORK/narratives.txt
+logfile = $WORK/bot.log
+workers = $WORKERS
+connections = $CONNECTIONS
+CONF
+
+./bench/fake_ircd -p "$PORT" -k "$CONNECTIONS" -c "$CHANNELS" -r "$RATE" -d "$DURATION" -m "$MIX" \
+    -a benchadmin:benchpass -o "$REPORT" -l "$LABEL" ${CAPS:+-C} ${CAPS:+"$CAPS"} &
+SRV_PID=$!
+sleep 0.3
+./irc_bot -c "$WORK/bot.conf" > "$WORK/bot.out" 2>&1 &
+BOT_PID=$!
+wait $SRV_PID
+sleep 0.5
+kill $BOT_PID 2>/dev/null || true
+wait $BOT_PID 2>/dev/null || true
+echo "Report appended to $REPORT"
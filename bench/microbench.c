@@ -0,0 +1,433 @@
+// microbench.c - Microbenchmarks for the per-message hot functions
+//
+// Links the bot sources (minus main.c) and times the functions every
+// incoming line goes through. Each benchmark is calibrated to run for a
+// minimum time, warmed up, then repeated; the median repetition is reported
+// as ns/op and cycles/op. Results can be saved and compared to a baseline:
+//
+//   bench/microbench --save bench/baseline.txt
+//   bench/microbench --baseline bench/baseline.txt
+#include "../src/config.h"
+#include "../src/irc_client.h"
+#include "../src/narrative.h"
+#include "../src/mention.h"
+#include "../src/utils.h"
+#include "../src/shared_mem.h"
+#include "../src/history.h"
+#include "../src/seen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+// Normally defined in main.c
+volatile sig_atomic_t terminate_flag = 0;
+void handle_termination(int sig) { terminate_flag = 1; }
+
+#define MAX_RESULTS 128
+#define MIN_REP_NS 20000000.0 // each repetition runs for at least 20 ms
+
+typedef void (*bench_fn)(void *arg);
+
+typedef struct {
+    char name[96];
+    double ns_per_op;
+    double cycles_per_op;
+} BenchResult;
+
+static BenchResult results[MAX_RESULTS];
+static int result_count = 0;
+static int repetitions = 5;
+static const char *filter = NULL;
+static FILE *out = NULL;
+static volatile size_t sink; // defeats dead-code elimination
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int cmp_result(const void *a, const void *b) {
+    double x = ((const BenchResult *)a)->ns_per_op, y = ((const BenchResult *)b)->ns_per_op;
+    return (x > y) - (x < y);
+}
+
+static void run_bench(const char *name, bench_fn fn, void *arg) {
+    if (filter && !strstr(name, filter)) return;
+    if (result_count >= MAX_RESULTS) return;
+    // Warmup and calibration: grow the iteration count until a rep is long enough
+    unsigned long iters = 1;
+    for (;;) {
+        double t0 = now_ns();
+        for (unsigned long i = 0; i < iters; ++i) fn(arg);
+        double dt = now_ns() - t0;
+        if (dt >= MIN_REP_NS || iters >= (1UL << 30)) break;
+        iters *= dt < MIN_REP_NS / 100 ? 10 : 2;
+    }
+    BenchResult reps[32];
+    int nrep = repetitions > 32 ? 32 : repetitions;
+    for (int r = 0; r < nrep; ++r) {
+        unsigned long long c0 = cycles();
+        double t0 = now_ns();
+        for (unsigned long i = 0; i < iters; ++i) fn(arg);
+        double dt = now_ns() - t0;
+        unsigned long long dc = cycles() - c0;
+        reps[r].ns_per_op = dt / iters;
+        reps[r].cycles_per_op = (double)dc / iters;
+    }
+    qsort(reps, nrep, sizeof(reps[0]), cmp_result);
+    BenchResult *res = &results[result_count++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->ns_per_op = reps[nrep / 2].ns_per_op;
+    res->cycles_per_op = reps[nrep / 2].cycles_per_op;
+    fprintf(out, "%-48s %12.1f ns/op %12.1f cycles/op\n", res->name, res->ns_per_op, res->cycles_per_op);
+    fflush(out);
+}
+
+// ---- Benchmarked operations ----
+
+static void stub_send(int sockfd, const char *msg) {
+    sink += strlen(msg);
+}
+
+typedef struct {
+    const char *channel;
+    const char *msg;
+} NarrativeArgs;
+
+static void bench_narrative(void *arg) {
+    NarrativeArgs *a = arg;
+    sink += (size_t)get_narrative_response(a->channel, a->msg);
+}
+
+static NarrativeCache bench_cache;
+
+static void bench_narrative_cached(void *arg) {
+    NarrativeArgs *a = arg;
+    const NarrativeEntry *match;
+    sink += find_narrative_cached(&bench_cache, a->channel, a->msg, &match);
+    sink += (size_t)match;
+}
+
+typedef struct {
+    const char *haystack;
+    const char *needle;
+} SearchArgs;
+
+static void bench_strcasestr(void *arg) {
+    SearchArgs *a = arg;
+    sink += (size_t)strcasestr(a->haystack, a->needle);
+}
+
+static void bench_trim(void *arg) {
+    char buf[256];
+    strcpy(buf, (const char *)arg);
+    trim_whitespace(buf);
+    sink += buf[0];
+}
+
+typedef struct {
+    const BotConfig *config;
+    const char *msg;
+} MentionArgs;
+
+static void bench_user_mentions(void *arg) {
+    MentionArgs *a = arg;
+    static TimerWheel timers;
+    static struct MentionRequest pending;
+    if (!pending.expiry.fire) {
+        tw_init(&timers, bot_clock_ms());
+        mention_request_init(&pending);
+    }
+    handle_user_mentions(a->config, 0, -1, a->msg, "someone", &pending, &timers);
+}
+
+static void bench_channel_mentions(void *arg) {
+    MentionArgs *a = arg;
+    handle_channel_mentions(a->config, 0, -1, a->msg, "someone");
+}
+
+static void bench_parse_privmsg(void *arg) {
+    IrcPrivmsg pm;
+    if (parse_privmsg((const char *)arg, &pm) == 0) sink += is_bot_nick(pm.sender) + pm.text[0];
+}
+
+typedef struct {
+    const NarrativeEntry *entry;
+    TemplateVars vars;
+} RenderArgs;
+
+static void bench_render(void *arg) {
+    RenderArgs *a = arg;
+    char out[512];
+    sink += render_response(a->entry, &a->vars, out, sizeof(out));
+}
+
+typedef struct {
+    const NarrativeEntry *match;
+    NarrativeRecent *recent;
+} PickArgs;
+
+static void bench_pick(void *arg) {
+    PickArgs *a = arg;
+    sink += (size_t)pick_narrative(a->match, a->recent);
+}
+
+typedef struct {
+    int channel;
+    const char *words;
+} HistoryArgs;
+
+static void bench_history_search(void *arg) {
+    HistoryArgs *a = arg;
+    HistoryMatch matches[3];
+    sink += history_search(a->channel, a->words, matches, 3);
+}
+
+static void bench_history_last(void *arg) {
+    HistoryArgs *a = arg;
+    HistoryMatch match;
+    sink += history_last(a->channel, a->words, &match);
+}
+
+static void bench_history_record(void *arg) {
+    static unsigned long n;
+    char text[128];
+    snprintf(text, sizeof(text), "message %lu about pipes, signals and shared memory", n++);
+    history_record(*(int *)arg, "someone", text, 0);
+}
+
+static void bench_seen_lookup(void *arg) {
+    SeenInfo info;
+    sink += seen_lookup((const char *)arg, &info);
+}
+
+static void bench_seen_update(void *arg) {
+    static unsigned long n;
+    char nick[32];
+    (void)arg;
+    // Cycles through more nicks than the table holds, so most updates evict
+    snprintf(nick, sizeof(nick), "churn%lu", n++ % 20000);
+    seen_update(nick, SEEN_MESSAGE, "#linux", 0);
+}
+
+static void bench_load(void *arg) {
+    sink += load_narratives((const char *)arg);
+}
+
+// Writes a catalogue of n entries spread over 4 channels, each with a unique trigger
+static void write_catalogue(const char *path, int n) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror("catalogue"); exit(1); }
+    for (int i = 0; i < n; ++i) {
+        fprintf(f, "#chan%d|trigger%06d|Response number %d for a generated catalogue entry.\n", i % 4, i, i);
+    }
+    fclose(f);
+}
+
+// ---- Baseline handling ----
+
+static void save_results(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror("save"); return; }
+    for (int i = 0; i < result_count; ++i) {
+        fprintf(f, "%s %.3f %.3f\n", results[i].name, results[i].ns_per_op, results[i].cycles_per_op);
+    }
+    fclose(f);
+    fprintf(out, "Saved %d results to %s\n", result_count, path);
+}
+
+static void compare_baseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror("baseline"); return; }
+    fprintf(out, "\n%-48s %12s %12s %9s\n", "benchmark", "baseline", "current", "change");
+    char name[96];
+    double ns, cyc;
+    while (fscanf(f, "%95s %lf %lf", name, &ns, &cyc) == 3) {
+        for (int i = 0; i < result_count; ++i) {
+            if (strcmp(results[i].name, name) == 0) {
+                double change = ns > 0 ? (results[i].ns_per_op - ns) / ns * 100.0 : 0;
+                fprintf(out, "%-48s %9.1f ns %9.1f ns %+8.1f%%\n", name, ns, results[i].ns_per_op, change);
+                break;
+            }
+        }
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    const char *save_path = NULL, *baseline_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) save_path = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) baseline_path = argv[++i];
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) filter = argv[++i];
+        else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) repetitions = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [--save file] [--baseline file] [--filter substr] [--reps n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (repetitions < 1) repetitions = 1;
+    // The functions under test print debug output; keep it off the results
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) dup2(devnull, STDOUT_FILENO);
+    set_logfile_path("/dev/null");
+    set_irc_send_hook(stub_send);
+    enable_virtual_clock(0); // send pacing advances the virtual clock instead of sleeping
+#ifndef HAVE_RDTSC
+    fprintf(out, "(cycles/op unavailable on this architecture)\n");
+#endif
+
+    char name[96];
+    char path[] = "/tmp/microbench_catalogue_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { perror("mkstemp"); return 1; }
+    close(fd);
+    // Rows are named by the entries actually loaded; sizes past MAX_NARRATIVES
+    // would all measure the same capped catalogue, so the loop stops there
+    for (int n = 100; n <= 100000; n *= 10) {
+        write_catalogue(path, n);
+        load_narratives(path);
+        int loaded = narrative_count;
+        if (loaded < n) {
+            fprintf(out, "(catalogue capped: %d of %d entries loaded, larger sizes skipped)\n", loaded, n);
+        }
+        snprintf(name, sizeof(name), "load_narratives/%d", loaded);
+        run_bench(name, bench_load, path);
+        // Hit on the last loaded trigger of #chan0 and a miss that scans everything
+        char hit_msg[64];
+        int last = (narrative_count - 1) / 4 * 4;
+        snprintf(hit_msg, sizeof(hit_msg), "please show trigger%06d now", last);
+        NarrativeArgs hit = { "#chan0", hit_msg };
+        NarrativeArgs miss = { "#chan0", "a message that matches no trigger at all" };
+        snprintf(name, sizeof(name), "get_narrative_response/hit/%d", loaded);
+        run_bench(name, bench_narrative, &hit);
+        snprintf(name, sizeof(name), "get_narrative_response/miss/%d", loaded);
+        run_bench(name, bench_narrative, &miss);
+        // The same messages again through a channel's cache (after the first call)
+        narrative_cache_init(&bench_cache, NARRATIVE_CACHE_MAX);
+        snprintf(name, sizeof(name), "find_narrative_cached/hit/%d", loaded);
+        run_bench(name, bench_narrative_cached, &hit);
+        snprintf(name, sizeof(name), "find_narrative_cached/miss/%d", loaded);
+        run_bench(name, bench_narrative_cached, &miss);
+        if (loaded < n) break;
+    }
+    unlink(path);
+
+    // Templates: a plain response and one with every variable
+    FILE *tf = fopen(path, "w");
+    if (!tf) { perror("catalogue"); return 1; }
+    fprintf(tf, "#chan0|plain|Response number 1 for a generated catalogue entry.\n");
+    fprintf(tf, "#chan0|vars|Hi $nick, welcome to $channel! Today's topic is $topic, it is $time.\n");
+    fclose(tf);
+    load_narratives(path);
+    unlink(path);
+    RenderArgs plain_tpl = { &narratives[0], { "someone", "#chan0", "pipes and signals" } };
+    RenderArgs vars_tpl = { &narratives[1], { "someone", "#chan0", "pipes and signals" } };
+    run_bench("render_response/plain", bench_render, &plain_tpl);
+    run_bench("render_response/vars", bench_render, &vars_tpl);
+
+    // Weighted alternatives of one trigger, picked through the alias table
+    tf = fopen(path, "w");
+    if (!tf) { perror("catalogue"); return 1; }
+    for (int i = 0; i < 16; ++i) fprintf(tf, "#chan0|weighted|w=%d|Alternative response %d.\n", i + 1, i);
+    fclose(tf);
+    load_narratives(path);
+    unlink(path);
+    NarrativeRecent recent;
+    narrative_recent_init(&recent, 4, 0);
+    PickArgs pick_plain = { &narratives[0], NULL };
+    PickArgs pick_window = { &narratives[0], &recent };
+    run_bench("pick_narrative/16", bench_pick, &pick_plain);
+    run_bench("pick_narrative/16/no_repeat_4", bench_pick, &pick_window);
+
+    SearchArgs search_hit = { "Does anybody here know how the ls command handles Hidden files?", "hidden" };
+    SearchArgs search_miss = { "Does anybody here know how the ls command handles Hidden files?", "trigger" };
+    run_bench("strcasestr/hit", bench_strcasestr, &search_hit);
+    run_bench("strcasestr/miss", bench_strcasestr, &search_miss);
+    run_bench("trim_whitespace", bench_trim, "  \t some message with surrounding blanks \r\n");
+
+    BotConfig config;
+    memset(&config, 0, sizeof(config));
+    // Mentions look channels up in the shared channel table
+    if (init_shared_resources() != 0) {
+        fprintf(stderr, "Failed to initialize shared resources\n");
+        return 1;
+    }
+    const char *chans[] = { "#unix", "#admin", "#random", "#linux", "#c" };
+    for (int i = 0; i < 5; ++i) shared_channel_add(chans[i]);
+    snprintf(config.nickname, MAX_STR, "bbench001");
+    MentionArgs plain = { &config, "just a regular message without anything special in it" };
+    MentionArgs user = { &config, "hey ABCD1234 are you there?" };
+    MentionArgs chan = { &config, "ask about that in #random please" };
+    run_bench("handle_user_mentions/none", bench_user_mentions, &plain);
+    run_bench("handle_user_mentions/one", bench_user_mentions, &user);
+    run_bench("handle_channel_mentions/none", bench_channel_mentions, &plain);
+    run_bench("handle_channel_mentions/one", bench_channel_mentions, &chan);
+
+    // History: a full 100000-line ring in #linux; "needle" is in only the oldest line
+    if (history_init(100000) != 0) {
+        fprintf(stderr, "Failed to set up history\n");
+        return 1;
+    }
+    int hist_chan = shared_channel_find("#linux");
+    char text[128];
+    history_record(hist_chan, "oldnick", "the needle sits in the oldest line", 0);
+    for (int i = 1; i < 100000; ++i) {
+        snprintf(text, sizeof(text), "line %d talks about word%d and pipes", i, i % 5000);
+        history_record(hist_chan, i % 100 == 0 ? "rarenick" : "chatty", text, 0);
+    }
+    HistoryArgs rare = { hist_chan, "needle" };
+    HistoryArgs two = { hist_chan, "word42 pipes" };
+    HistoryArgs common = { hist_chan, "pipes" };
+    HistoryArgs absent = { hist_chan, "nothing" };
+    HistoryArgs nick = { hist_chan, "oldnick" };
+    run_bench("history_search/rare/100000", bench_history_search, &rare);
+    run_bench("history_search/two_words/100000", bench_history_search, &two);
+    run_bench("history_search/common/100000", bench_history_search, &common);
+    run_bench("history_search/absent/100000", bench_history_search, &absent);
+    run_bench("history_last/100000", bench_history_last, &nick);
+    int record_chan = shared_channel_find("#c");
+    run_bench("history_record", bench_history_record, &record_chan);
+
+    // Seen: a full 4096-nick table
+    if (seen_init(4096) != 0) {
+        fprintf(stderr, "Failed to set up the seen table\n");
+        return 1;
+    }
+    for (int i = 0; i < 4096; ++i) {
+        char nick[32];
+        snprintf(nick, sizeof(nick), "nick%d", i);
+        seen_update(nick, SEEN_MESSAGE, "#linux", 0);
+    }
+    run_bench("seen_lookup/hit", bench_seen_lookup, "NICK2048");
+    run_bench("seen_lookup/miss", bench_seen_lookup, "stranger");
+    run_bench("seen_update/evicting", bench_seen_update, NULL);
+
+    run_bench("parse_privmsg/channel", bench_parse_privmsg, ":someone!user@host.example PRIVMSG #unix :hello there, how does ls work?");
+    run_bench("parse_privmsg/not_privmsg", bench_parse_privmsg, ":server.example 353 bnick = #unix :bnick someone other");
+
+    if (save_path) save_results(save_path);
+    if (baseline_path) compare_baseline(baseline_path);
+    seen_cleanup();
+    history_cleanup();
+    cleanup_shared_resources();
+    return 0;
+}
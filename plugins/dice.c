@@ -0,0 +1,47 @@
+// dice.c - Example response-handler plugin: !roll [N]d<M>
+//
+// Build with `make plugins` and set plugin_dir = plugins in bot.conf.
+#include "../src/plugin_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static unsigned int seed;
+
+static int dice_init(void) {
+    seed = (unsigned int)time(NULL);
+    return 0;
+}
+
+static int dice_handle(const BotMessage *msg, BotReply *reply) {
+    char args[32], text[256];
+    int count = 1, sides = 6;
+    // Views are not NUL-terminated; copy what is parsed
+    snprintf(args, sizeof(args), "%.*s", (int)msg->args.len, msg->args.ptr);
+    if (args[0] && sscanf(args, "%dd%d", &count, &sides) != 2 && sscanf(args, "d%d", &sides) != 1) {
+        int len = snprintf(text, sizeof(text), "Usage: !roll [N]d<M>, e.g. !roll 2d6");
+        reply->say(reply, text, len);
+        return 1;
+    }
+    if (count < 1 || count > 20 || sides < 2 || sides > 1000) {
+        int len = snprintf(text, sizeof(text), "Up to 20 dice of 2 to 1000 sides.");
+        reply->say(reply, text, len);
+        return 1;
+    }
+    int len = snprintf(text, sizeof(text), "%.*s rolls", (int)msg->sender.len, msg->sender.ptr);
+    int total = 0;
+    for (int i = 0; i < count; ++i) {
+        int roll = rand_r(&seed) % sides + 1;
+        total += roll;
+        len += snprintf(text + len, sizeof(text) - len, " %d", roll);
+    }
+    if (count > 1) len += snprintf(text + len, sizeof(text) - len, " = %d", total);
+    reply->say(reply, text, len);
+    return 1;
+}
+
+static const char *const dice_commands[] = { "!roll", NULL };
+
+const BotPlugin bot_plugin = {
+    BOT_PLUGIN_ABI, "dice", dice_commands, dice_init, NULL, dice_handle,
+};
@@ -2,44 +2,287 @@
 #include "irc_client.h"
 #include "shared_mem.h"
 #include "utils.h"
+#include "timer_wheel.h"
+#include "shard.h"
+#include "pacing.h"
+#include "plugin.h"
+#include "rehash.h"
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <stdio.h>
 
+#define MIN_EVERY_SECONDS 10
+#define MAX_SCHEDULE_SECONDS (30 * 24 * 3600)
+
 typedef struct {
     char authed_admins[10][64];
     int authed_count;
+    time_t authed_until[10];
 } SharedAdminAuth;
 
+// Session expiry timers, kept by the process that handles !auth (the dispatcher)
+typedef struct {
+    Timer timer;
+    char nick[64]; // "" = unused
+} SessionTimer;
+
 static SharedAdminAuth *shared_auth = NULL;
+static TimerWheel *session_wheel = NULL;
+static int session_sockfd = -1;
+static SessionTimer session_timers[10];
 
 void set_shared_admin_auth_ptr(void *ptr) {
     shared_auth = (SharedAdminAuth *)ptr;
 }
 
+static int find_authed_admin(const char *nick) {
+    if (!shared_auth) return -1;
+    for (int i = 0; i < shared_auth->authed_count; ++i) {
+        if (strcasecmp(shared_auth->authed_admins[i], nick) == 0) return i;
+    }
+    return -1;
+}
+
+// A session past its end no longer counts, even before its timer has fired
 int is_authed_admin(const char *nick) {
-    if (!shared_auth) return 0;
+    int i = find_authed_admin(nick);
+    if (i == -1) return 0;
+    return shared_auth->authed_until[i] == 0 || bot_time() < shared_auth->authed_until[i];
+}
+
+static void drop_authed_admin(int i) {
+    int last = shared_auth->authed_count - 1;
+    memcpy(shared_auth->authed_admins[i], shared_auth->authed_admins[last], 64);
+    shared_auth->authed_until[i] = shared_auth->authed_until[last];
+    shared_auth->authed_count--;
+}
+
+static void expire_session(Timer *timer, void *arg) {
+    SessionTimer *st = arg;
+    int i = find_authed_admin(st->nick);
+    if (i != -1) {
+        drop_authed_admin(i);
+        printf("[AUTH] Admin session for %s expired.\n", st->nick);
+        fflush(stdout);
+        log_message("[AUTH] Admin session for %s expired.", st->nick);
+        char adminmsg[256];
+        snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Admin session for %s expired.\r\n", st->nick);
+        send_irc_message(session_sockfd, adminmsg);
+    }
+    st->nick[0] = 0;
+}
+
+// (Re)arms the expiry timer of nick's session for its authed_until
+static void arm_session_timer(const char *nick, time_t until) {
+    if (!session_wheel || until == 0) return;
+    SessionTimer *st = NULL;
+    for (int i = 0; i < 10; ++i) {
+        if (strcasecmp(session_timers[i].nick, nick) == 0) { st = &session_timers[i]; break; }
+        if (!st && !session_timers[i].nick[0]) st = &session_timers[i];
+    }
+    if (!st) return;
+    if (!st->nick[0]) {
+        timer_init(&st->timer, expire_session, st);
+        snprintf(st->nick, sizeof(st->nick), "%s", nick);
+    }
+    long long left = (long long)(until - bot_time()) * 1000LL;
+    tw_add(session_wheel, &st->timer, bot_clock_ms() + (left > 0 ? left : 0));
+}
+
+void set_admin_session_timers(TimerWheel *timers, int sockfd) {
+    session_wheel = timers;
+    session_sockfd = sockfd;
+    if (!shared_auth) return;
+    // Sessions restored from a snapshot keep their original end
     for (int i = 0; i < shared_auth->authed_count; ++i) {
-        if (strcasecmp(shared_auth->authed_admins[i], nick) == 0) return 1;
+        arm_session_timer(shared_auth->authed_admins[i], shared_auth->authed_until[i]);
     }
-    return 0;
 }
 
-void add_authed_admin(const char *nick) {
+void add_authed_admin(const char *nick, int session_seconds) {
     if (!shared_auth) return;
-    if (!is_authed_admin(nick) && shared_auth->authed_count < 10) {
-        strncpy(shared_auth->authed_admins[shared_auth->authed_count], nick, 63);
-        shared_auth->authed_admins[shared_auth->authed_count][63] = 0;
+    int i = find_authed_admin(nick);
+    if (i == -1 && shared_auth->authed_count < 10) {
+        i = shared_auth->authed_count;
+        strncpy(shared_auth->authed_admins[i], nick, 63);
+        shared_auth->authed_admins[i][63] = 0;
         shared_auth->authed_count++;
         printf("[ADMIN DEBUG] add_authed_admin: added '%s', authed_count=%d\n", nick, shared_auth->authed_count);
     }
+    if (i == -1) return;
+    // Authenticating again renews the session
+    shared_auth->authed_until[i] = session_seconds > 0 ? bot_time() + session_seconds : 0;
+    arm_session_timer(nick, shared_auth->authed_until[i]);
+}
+
+// Its expiry timer, if any, finds the session gone and does nothing
+void end_admin_session(const char *nick) {
+    int i = find_authed_admin(nick);
+    if (i == -1) return;
+    drop_authed_admin(i);
+    printf("[AUTH] Admin session for %s ended.\n", nick);
+    log_message("[AUTH] Admin session for %s ended.", nick);
 }
 
 void clear_authed_admins(void) {
     if (!shared_auth) return;
     shared_auth->authed_count = 0;
+    for (int i = 0; i < 10; ++i) {
+        if (session_wheel) tw_cancel(session_wheel, &session_timers[i].timer);
+        session_timers[i].nick[0] = 0;
+    }
+}
+
+// Appends one stats entry, sending the line first when it would get too long
+static void append_stats(int sockfd, char *line, size_t *len, const char *entry) {
+    size_t entry_len = strlen(entry);
+    if (*len > 0 && *len + entry_len + 3 > 400) {
+        memcpy(line + *len, "\r\n", 3);
+        send_irc_message(sockfd, line);
+        *len = 0;
+    }
+    if (*len == 0) *len = snprintf(line, 512, "PRIVMSG #admin :Stats:");
+    *len += snprintf(line + *len, 512 - *len, " %s", entry);
+}
+
+// Reports the per-channel forwarding counters on as few lines as possible
+static void send_stats(int sockfd) {
+    char line[512], entry[MAX_STR + 96];
+    size_t len = 0;
+    unsigned long forwarded = 0, dropped = 0, coalesced = 0, crashes = 0, hits = 0, lookups = 0;
+    int channels = 0;
+    for (int i = 0; i < shared_channel_count(); ++i) {
+        SharedChannel *slot = shared_channel(i);
+        if (!slot || !slot->active) continue;
+        channels++;
+        forwarded += slot->forwarded;
+        dropped += slot->dropped;
+        coalesced += slot->coalesced;
+        crashes += slot->crashes;
+        hits += slot->cache_hits;
+        lookups += slot->cache_hits + slot->cache_misses;
+    }
+    unsigned long unsent = 0;
+    for (int i = 0; i < shard_count(); ++i) unsent += pacing_unsent(i);
+    int n = snprintf(entry, sizeof(entry), "%d channels, forwarded %lu, dropped %lu, coalesced %lu, crashes %lu, unsent %lu", channels, forwarded, dropped, coalesced, crashes, unsent);
+    if (lookups) n += snprintf(entry + n, sizeof(entry) - n, ", cache hits %lu%% of %lu", hits * 100 / lookups, lookups);
+    snprintf(entry + n, sizeof(entry) - n, ";");
+    append_stats(sockfd, line, &len, entry);
+    for (int i = 0; i < shared_channel_count(); ++i) {
+        SharedChannel *slot = shared_channel(i);
+        if (!slot || !slot->active) continue;
+        int n = snprintf(entry, sizeof(entry), "%s", slot->name);
+        if (shard_count() > 1) n += snprintf(entry + n, sizeof(entry) - n, " conn=%d", shard_of(slot->name));
+        n += snprintf(entry + n, sizeof(entry) - n, " fwd=%lu drop=%lu coal=%lu peak=%d", slot->forwarded, slot->dropped, slot->coalesced, slot->queue_peak);
+        if (slot->crashes) n += snprintf(entry + n, sizeof(entry) - n, " crash=%lu", slot->crashes);
+        unsigned long channel_lookups = slot->cache_hits + slot->cache_misses;
+        if (channel_lookups) snprintf(entry + n, sizeof(entry) - n, " cache=%lu%%", slot->cache_hits * 100 / channel_lookups);
+        append_stats(sockfd, line, &len, entry);
+    }
+    memcpy(line + len, "\r\n", 3);
+    send_irc_message(sockfd, line);
+}
+
+// Sends up to max lines of text to #admin, each after prefix
+static int send_lines(int sockfd, const char *prefix, const char *text, int max) {
+    int sent = 0;
+    while (*text && sent < max) {
+        size_t len = strcspn(text, "\n");
+        char adminmsg[512];
+        snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :%s%.*s\r\n", prefix, (int)len, text);
+        send_irc_message(sockfd, adminmsg);
+        sent++;
+        text += len + (text[len] == '\n');
+    }
+    // Lines left unsent
+    int left = *text != 0;
+    for (; *text; ++text) left += *text == '\n';
+    return left;
+}
+
+// !rehash
+static void rehash_command(int sockfd, const char *sender) {
+    char report[4096], adminmsg[256];
+    int restart;
+    int changes = rehash_request(report, sizeof(report), &restart);
+    if (changes < 0) {
+        log_message("[ADMIN] %s issued !rehash, rejected: %s", sender, report);
+        snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Rehash failed, nothing was changed:\r\n");
+        send_irc_message(sockfd, adminmsg);
+        int left = send_lines(sockfd, "  ", report, 5);
+        if (left > 0) {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :  ... and %d more problems\r\n", left);
+            send_irc_message(sockfd, adminmsg);
+        }
+        return;
+    }
+    log_message("[ADMIN] %s issued !rehash: %d changes", sender, changes);
+    if (changes == 0) {
+        snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Rehashed %s: no changes.\r\n", rehash_path());
+        send_irc_message(sockfd, adminmsg);
+        return;
+    }
+    snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Rehashed %s: %d changes%s, live from each channel's next message:\r\n",
+             rehash_path(), changes, restart ? " (some need a restart)" : "");
+    send_irc_message(sockfd, adminmsg);
+    int left = send_lines(sockfd, "  ", report, 12);
+    if (left > 0) {
+        snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :  ... and %d more\r\n", left);
+        send_irc_message(sockfd, adminmsg);
+    }
+}
+
+// !schedule/!every <seconds> <channel> <text>
+static void schedule_command(int sockfd, const char *sender, const char *args, int repeat) {
+    const char *cmd = repeat ? "!every" : "!schedule";
+    int seconds = 0, offset = 0;
+    char chan[MAX_STR];
+    char adminmsg[256];
+    if (sscanf(args, "%d %127s %n", &seconds, chan, &offset) != 2 || !args[offset]) {
+        snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Usage: %s <seconds> <channel> <text>\r\n", cmd);
+    } else if (seconds < (repeat ? MIN_EVERY_SECONDS : 1) || seconds > MAX_SCHEDULE_SECONDS) {
+        snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: Interval must be %d to %d seconds.\r\n",
+                 repeat ? MIN_EVERY_SECONDS : 1, MAX_SCHEDULE_SECONDS);
+    } else if (shared_channel_find(chan) == -1) {
+        snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: Bot has not joined channel %s.\r\n", chan);
+    } else {
+        unsigned int id = shared_schedule_add(seconds, repeat, chan, args + offset);
+        if (id == 0) {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: All %d schedules are in use.\r\n", MAX_SCHEDULES);
+        } else {
+            printf("[ADMIN] Schedule #%u: %s %ds %s\n", id, cmd, seconds, chan);
+            log_message("[ADMIN] %s issued %s #%u for %s, %d s", sender, cmd, id, chan, seconds);
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Scheduled #%u for %s %s %d seconds.\r\n",
+                     id, chan, repeat ? "every" : "in", seconds);
+        }
+    }
+    send_irc_message(sockfd, adminmsg);
+}
+
+// Lists the schedules, several per line
+static void send_schedules(int sockfd) {
+    char line[512], entry[MAX_STR + 64];
+    size_t len = 0;
+    int count = 0;
+    for (int i = 0; i < MAX_SCHEDULES; ++i) {
+        const SharedSchedule *s = &shared_data->schedules[i];
+        if (!s->id) continue;
+        snprintf(entry, sizeof(entry), "#%u %s %ds %s;", s->id, s->repeat ? "every" : "once", s->interval, s->channel);
+        if (len > 0 && len + strlen(entry) + 3 > 400) {
+            memcpy(line + len, "\r\n", 3);
+            send_irc_message(sockfd, line);
+            len = 0;
+        }
+        if (len == 0) len = snprintf(line, sizeof(line), "PRIVMSG #admin :Schedules:");
+        len += snprintf(line + len, sizeof(line) - len, " %s", entry);
+        count++;
+    }
+    if (count == 0) len = snprintf(line, sizeof(line), "PRIVMSG #admin :No schedules.");
+    memcpy(line + len, "\r\n", 3);
+    send_irc_message(sockfd, line);
 }
 
 // Returns 1 if a command was handled and should continue, 0 otherwise
@@ -58,17 +301,16 @@ int handle_admin_command(const char *sender, const char *msg, const BotConfig *c
     if (strncmp(msg, "!stop ", 6) == 0) {
         char *chan = (char*)msg + 6;
         int found = 0;
-        for (int i = 0; i < config->channel_count; ++i) {
-            if (strcasecmp(chan, config->channels[i]) == 0) {
-                shared_data->stop_talking[i] = 1;
-                printf("[ADMIN] Stop talking activated for channel: %s\n", chan);
-                log_message("[ADMIN] %s issued !stop for %s", sender, chan);
-                char adminmsg[256];
-                snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Bot will stop talking in %s.\r\n", chan);
-                send_irc_message(sockfd, adminmsg);
-                found = 1;
-                break;
-            }
+        int i = shared_channel_find(chan);
+        SharedChannel *slot = shared_channel(i);
+        if (slot) {
+            slot->stop_talking = 1;
+            printf("[ADMIN] Stop talking activated for channel: %s\n", chan);
+            log_message("[ADMIN] %s issued !stop for %s", sender, chan);
+            char adminmsg[256];
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Bot will stop talking in %s.\r\n", chan);
+            send_irc_message(sockfd, adminmsg);
+            found = 1;
         }
         if (!found) {
             char errmsg[256];
@@ -80,17 +322,16 @@ int handle_admin_command(const char *sender, const char *msg, const BotConfig *c
     } else if (strncmp(msg, "!start ", 7) == 0) {
         char *chan = (char*)msg + 7;
         int found = 0;
-        for (int i = 0; i < config->channel_count; ++i) {
-            if (strcasecmp(chan, config->channels[i]) == 0) {
-                shared_data->stop_talking[i] = 0;
-                printf("[ADMIN] Stop talking deactivated for channel: %s\n", chan);
-                log_message("[ADMIN] %s issued !start for %s", sender, chan);
-                char adminmsg[256];
-                snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Bot will resume talking in %s.\r\n", chan);
-                send_irc_message(sockfd, adminmsg);
-                found = 1;
-                break;
-            }
+        int i = shared_channel_find(chan);
+        SharedChannel *slot = shared_channel(i);
+        if (slot) {
+            slot->stop_talking = 0;
+            printf("[ADMIN] Stop talking deactivated for channel: %s\n", chan);
+            log_message("[ADMIN] %s issued !start for %s", sender, chan);
+            char adminmsg[256];
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Bot will resume talking in %s.\r\n", chan);
+            send_irc_message(sockfd, adminmsg);
+            found = 1;
         }
         if (!found) {
             char errmsg[256];
@@ -99,6 +340,38 @@ int handle_admin_command(const char *sender, const char *msg, const BotConfig *c
             log_message("[ADMIN] %s tried !start for unknown channel %s", sender, chan);
         }
         return 1;
+    } else if (strncmp(msg, "!join ", 6) == 0) {
+        const char *chan = msg + 6;
+        char adminmsg[256];
+        if ((chan[0] != '#' && chan[0] != '&') || strlen(chan) < 2 || strlen(chan) >= MAX_STR || strpbrk(chan, " ,\a")) {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: Invalid channel name %s.\r\n", chan);
+        } else if (shared_channel_find(chan) != -1) {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: Bot is already in channel %s.\r\n", chan);
+        } else if (shared_channel_add(chan) == -1) {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: Could not join channel %s.\r\n", chan);
+        } else {
+            printf("[ADMIN] Joining channel: %s\n", chan);
+            log_message("[ADMIN] %s issued !join for %s", sender, chan);
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Joining channel %s.\r\n", chan);
+        }
+        send_irc_message(sockfd, adminmsg);
+        return 1;
+    } else if (strncmp(msg, "!part ", 6) == 0) {
+        const char *chan = msg + 6;
+        char adminmsg[256];
+        int i = shared_channel_find(chan);
+        if (i == -1) {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: Bot has not joined channel %s.\r\n", chan);
+        } else if (strcasecmp(chan, "#admin") == 0) {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: The admin channel cannot be parted.\r\n");
+        } else {
+            shared_channel_remove(i);
+            printf("[ADMIN] Parting channel: %s\n", chan);
+            log_message("[ADMIN] %s issued !part for %s", sender, chan);
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Leaving channel %s.\r\n", chan);
+        }
+        send_irc_message(sockfd, adminmsg);
+        return 1;
     } else if (strncmp(msg, "!ignore ", 8) == 0) {
         add_ignored_user(msg+8);
         printf("[ADMIN] Now ignoring: %s\n", msg+8);
@@ -123,6 +396,66 @@ int handle_admin_command(const char *sender, const char *msg, const BotConfig *c
         snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :All ignores cleared.\r\n");
         send_irc_message(sockfd, adminmsg);
         return 1;
+    } else if (strncmp(msg, "!stats", 6) == 0) {
+        log_message("[ADMIN] %s issued !stats", sender);
+        send_stats(sockfd);
+        return 1;
+    } else if (strncmp(msg, "!lag", 4) == 0) {
+        log_message("[ADMIN] %s issued !lag", sender);
+        for (int i = 0; i < shard_count(); ++i) {
+            char state[160], adminmsg[256];
+            pacing_describe(i, state, sizeof(state));
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Connection %d: %s (target %d ms)\r\n", i, state, config->target_lag);
+            send_irc_message(sockfd, adminmsg);
+        }
+        return 1;
+    } else if (strncmp(msg, "!plugins reload", 15) == 0) {
+        char adminmsg[256];
+        int count = plugin_request_reload();
+        if (count < 0) {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :No plugin_dir is configured.\r\n");
+        } else {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Reloaded %d plugins; every channel switches over on its next message.\r\n", count);
+        }
+        log_message("[ADMIN] %s issued !plugins reload", sender);
+        send_irc_message(sockfd, adminmsg);
+        return 1;
+    } else if (strncmp(msg, "!plugins", 8) == 0) {
+        log_message("[ADMIN] %s issued !plugins", sender);
+        if (plugin_stats_count() == 0) {
+            send_irc_message(sockfd, "PRIVMSG #admin :No plugins loaded.\r\n");
+        }
+        for (int i = 0; i < plugin_stats_count(); ++i) {
+            char state[160], adminmsg[256];
+            plugin_describe(i, state, sizeof(state));
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Plugin %s (budget %d ms)\r\n", state, config->plugin_budget_ms);
+            send_irc_message(sockfd, adminmsg);
+        }
+        return 1;
+    } else if (strncmp(msg, "!schedules", 10) == 0) {
+        log_message("[ADMIN] %s issued !schedules", sender);
+        send_schedules(sockfd);
+        return 1;
+    } else if (strncmp(msg, "!schedule ", 10) == 0) {
+        schedule_command(sockfd, sender, msg + 10, 0);
+        return 1;
+    } else if (strncmp(msg, "!every ", 7) == 0) {
+        schedule_command(sockfd, sender, msg + 7, 1);
+        return 1;
+    } else if (strncmp(msg, "!unschedule ", 12) == 0) {
+        unsigned int id = (unsigned int)strtoul(msg + 12 + (msg[12] == '#'), NULL, 10);
+        char adminmsg[256];
+        if (shared_schedule_remove(id) == 0) {
+            log_message("[ADMIN] %s issued !unschedule #%u", sender, id);
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Schedule #%u removed.\r\n", id);
+        } else {
+            snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG #admin :Error: No schedule #%u.\r\n", id);
+        }
+        send_irc_message(sockfd, adminmsg);
+        return 1;
+    } else if (strncmp(msg, "!rehash", 7) == 0) {
+        rehash_command(sockfd, sender);
+        return 1;
     } else if (strncmp(msg, "!shutdown", 9) == 0) {
         log_message("[ADMIN] %s issued !shutdown", sender);
         char adminmsg[256];
@@ -146,7 +479,7 @@ int try_admin_auth(const char *sender, const char *password, const BotConfig *co
     for (int i = 0; i < config->admin_count; ++i) {
         if (strcasecmp(config->admins[i].name, sender) == 0 &&
             strcmp(config->admins[i].password, password) == 0) {
-            add_authed_admin(sender);
+            add_authed_admin(sender, config->admin_session);
             found = 1;
             break;
         }
@@ -175,6 +508,6 @@ int try_admin_auth(const char *sender, const char *password, const BotConfig *co
         send_irc_message(sockfd, failmsg);
     }
     fflush(stdout);
-    usleep(200000);
+    bot_sleep_us(200000);
     return found;
 }
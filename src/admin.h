@@ -4,16 +4,21 @@
 
 #include "config.h"
 #include "shared_mem.h"
+#include "timer_wheel.h"
 
 // Returns 1 if nick is authenticated
 int is_authed_admin(const char *nick);
-// Add nick to authenticated list
-void add_authed_admin(const char *nick);
+// Add nick to authenticated list, or renew its session; session_seconds 0 = no expiry
+void add_authed_admin(const char *nick, int session_seconds);
+// Ends nick's session now (the admin was dropped from the config)
+void end_admin_session(const char *nick);
 // Optionally, clear all authed admins (for testing or reload)
 void clear_authed_admins(void);
 // Returns 1 if a command was handled and should continue, 0 otherwise
 int handle_admin_command(const char *sender, const char *msg, const BotConfig *config, int sockfd, SharedData *shared_data);
 void set_shared_admin_auth_ptr(void *ptr);
+// Expires admin sessions on timers (the dispatcher's) and announces it on sockfd
+void set_admin_session_timers(TimerWheel *timers, int sockfd);
 int try_admin_auth(const char *sender, const char *password, const BotConfig *config, int sockfd);
 
 #endif
@@ -1,69 +1,444 @@
+// config.c - Configuration parsing
+//
+// bot.conf holds one "key = value" per line; lines starting with '#' are
+// comments. Lines may be of any length, and every "channels =" or "admins ="
+// line adds to its list, so long lists can be split over several lines or
+// kept in their own files: "include = file" reads another file in place,
+// relative to the one including it. Each problem is reported with its file
+// and line, and a file with any problem is rejected as a whole.
+#define _GNU_SOURCE
 #include "config.h"
+#include "shard.h"
+#include "narrative.h"
 #include "utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-int load_config(const char *path, BotConfig *config) {
-    FILE *f = fopen(path, "r");
-    if (!f) return -1;
-    char line[256];
-    config->channel_count = 0;
-    config->admin_count = 0;
-    while (fgets(line, sizeof(line), f)) {
-        if (strncmp(line, "channels =", 10) == 0) {
-            char *p = strchr(line, '=') + 1;
-            // Remove whitespace and split by comma
-            char *tok = strtok(p, ",#\n");
-            while (tok && config->channel_count < MAX_CHANNELS) {
-                trim_whitespace(tok);
-                if (*tok) {
-                    snprintf(config->channels[config->channel_count++], MAX_STR, "#%s", tok);
-                }
-                tok = strtok(NULL, ",#\n");
+#define MAX_INCLUDE_DEPTH 8
+#define DIFF_LINE 360 // longest change line, list changes are cut short to fit
+
+typedef enum { OPT_INT, OPT_STR, OPT_CHOICE, OPT_WORKERS, OPT_CHANNELS, OPT_ADMINS } OptionType;
+
+typedef struct {
+    const char *key;
+    OptionType type;
+    size_t offset;
+    int min, max;
+    int live;                   // applied by !rehash, the rest needs a restart
+    const char *const *choices; // names of an OPT_CHOICE's values, in order
+} ConfigOption;
+
+static const char *const queue_policies[] = { "drop_oldest", "drop_newest", "coalesce", NULL };
+static const char *const log_levels[] = { "error", "warn", "info", "debug", NULL };
+
+#define INT_OPT(key, field, min, max, live) { key, OPT_INT, offsetof(BotConfig, field), min, max, live, NULL }
+#define STR_OPT(key, field, live) { key, OPT_STR, offsetof(BotConfig, field), 0, 0, live, NULL }
+
+static const ConfigOption options[] = {
+    { "channels", OPT_CHANNELS, 0, 0, 0, 1, NULL },
+    { "admins", OPT_ADMINS, 0, 0, 0, 1, NULL },
+    STR_OPT("nickname", nickname, 0),
+    STR_OPT("server", server, 0),
+    INT_OPT("port", port, 1, 65535, 0),
+    STR_OPT("narratives", narratives_path, 1),
+    STR_OPT("logfile", logfile, 1),
+    { "log_level", OPT_CHOICE, offsetof(BotConfig, log_level), 0, 0, 1, log_levels },
+    { "workers", OPT_WORKERS, offsetof(BotConfig, workers), 0, 1024, 0, NULL },
+    INT_OPT("connections", connections, 1, MAX_SHARDS, 0),
+    INT_OPT("target_lag", target_lag, 50, INT_MAX, 1),
+    INT_OPT("connect_timeout", connect_timeout, 1, INT_MAX, 1),
+    INT_OPT("join_batch", join_batch, 0, INT_MAX, 1),
+    INT_OPT("reconnect_max", reconnect_max, 0, INT_MAX, 1),
+    STR_OPT("state_file", state_file, 0),
+    INT_OPT("state_sync", state_sync, 1, INT_MAX, 1),
+    INT_OPT("queue_limit", queue_limit, 1, INT_MAX, 0),
+    { "queue_policy", OPT_CHOICE, offsetof(BotConfig, queue_policy), 0, 0, 1, queue_policies },
+    INT_OPT("admin_session", admin_session, 0, INT_MAX, 1),
+    INT_OPT("history_lines", history_lines, 0, 1000000, 0),
+    INT_OPT("seen_capacity", seen_capacity, 0, INT_MAX, 0),
+    STR_OPT("plugin_dir", plugin_dir, 0),
+    INT_OPT("plugin_budget_ms", plugin_budget_ms, 1, INT_MAX, 0),
+    INT_OPT("narrative_no_repeat", narrative_no_repeat, 0, MAX_NO_REPEAT, 0),
+    INT_OPT("narrative_cache", narrative_cache, 0, NARRATIVE_CACHE_MAX, 0),
+    STR_OPT("dispatcher_cpus", dispatcher_cpus, 0),
+    STR_OPT("handler_cpus", handler_cpus, 0),
+    INT_OPT("handler_spread", handler_spread, 0, 1, 0),
+    INT_OPT("dispatcher_fifo", dispatcher_fifo, 0, 99, 0),
+    INT_OPT("dispatcher_nice", dispatcher_nice, -20, 19, 0),
+};
+#define OPTION_COUNT (sizeof(options) / sizeof(options[0]))
+
+typedef struct {
+    BotConfig *config;
+    int channel_capacity, admin_capacity;
+    char *errors;      // NULL: problems go to stderr
+    size_t errors_len, errors_used;
+    int error_count;
+} ConfigParse;
+
+static void config_error(ConfigParse *p, const char *file, int line, const char *fmt, ...) {
+    char msg[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    char where[PATH_MAX + 16];
+    if (line > 0) snprintf(where, sizeof(where), "%s:%d", file, line);
+    else snprintf(where, sizeof(where), "%s", file);
+    p->error_count++;
+    if (!p->errors) {
+        fprintf(stderr, "%s: %s\n", where, msg);
+    } else if (p->errors_used < p->errors_len) {
+        p->errors_used += snprintf(p->errors + p->errors_used, p->errors_len - p->errors_used, "%s%s: %s",
+                                   p->errors_used ? "\n" : "", where, msg);
+    }
+}
+
+static void set_defaults(BotConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->port = 6667;
+    config->connections = 1;
+    config->target_lag = 1000;
+    config->connect_timeout = 10;
+    config->reconnect_max = 60;
+    config->state_sync = 30;
+    config->queue_limit = 256;
+    config->queue_policy = QUEUE_DROP_OLDEST;
+    config->admin_session = 3600;
+    config->history_lines = 1000;
+    config->seen_capacity = 4096;
+    config->plugin_budget_ms = 20;
+    config->narrative_cache = 128;
+    config->log_level = LOG_DEBUG;
+}
+
+static void add_channel(ConfigParse *p, const char *file, int line, const char *name) {
+    BotConfig *config = p->config;
+    char channel[MAX_STR];
+    // A bare name gets the usual '#'
+    int len = snprintf(channel, sizeof(channel), "%s%s", name[0] == '#' || name[0] == '&' ? "" : "#", name);
+    if (len >= MAX_STR) {
+        config_error(p, file, line, "channel name %.20s... is longer than %d characters", name, MAX_STR - 1);
+        return;
+    }
+    if (len < 2 || strpbrk(channel, " \t\a")) {
+        config_error(p, file, line, "invalid channel name '%s'", name);
+        return;
+    }
+    for (int i = 0; i < config->channel_count; ++i) {
+        if (strcasecmp(config->channels[i], channel) == 0) return;
+    }
+    if (config->channel_count == p->channel_capacity) {
+        int capacity = p->channel_capacity ? p->channel_capacity * 2 : 8;
+        void *grown = realloc(config->channels, capacity * sizeof(*config->channels));
+        if (!grown) {
+            config_error(p, file, line, "out of memory");
+            return;
+        }
+        config->channels = grown;
+        p->channel_capacity = capacity;
+    }
+    memcpy(config->channels[config->channel_count++], channel, MAX_STR);
+}
+
+static void add_admin(ConfigParse *p, const char *file, int line, char *entry) {
+    BotConfig *config = p->config;
+    char *sep = strchr(entry, ':');
+    if (!sep) {
+        config_error(p, file, line, "admin '%s' is not name:password", entry);
+        return;
+    }
+    *sep = 0;
+    char *name = entry, *pass = sep + 1;
+    trim_whitespace(name);
+    trim_whitespace(pass);
+    if (!*name || !*pass) {
+        config_error(p, file, line, "admin '%s' needs both a name and a password", name);
+        return;
+    }
+    if (strlen(name) >= MAX_STR || strlen(pass) >= MAX_STR) {
+        config_error(p, file, line, "admin name and password must be under %d characters", MAX_STR);
+        return;
+    }
+    for (int i = 0; i < config->admin_count; ++i) {
+        if (strcasecmp(config->admins[i].name, name) == 0) {
+            config_error(p, file, line, "admin %s is listed twice", name);
+            return;
+        }
+    }
+    if (config->admin_count == p->admin_capacity) {
+        int capacity = p->admin_capacity ? p->admin_capacity * 2 : 8;
+        void *grown = realloc(config->admins, capacity * sizeof(*config->admins));
+        if (!grown) {
+            config_error(p, file, line, "out of memory");
+            return;
+        }
+        config->admins = grown;
+        p->admin_capacity = capacity;
+    }
+    AdminUser *admin = &config->admins[config->admin_count++];
+    snprintf(admin->name, sizeof(admin->name), "%s", name);
+    snprintf(admin->password, sizeof(admin->password), "%s", pass);
+}
+
+static void set_option(ConfigParse *p, const char *file, int line, const ConfigOption *opt, char *value) {
+    char *field = (char *)p->config + opt->offset;
+    switch (opt->type) {
+    case OPT_WORKERS:
+        if (strcmp(value, "auto") == 0) {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            *(int *)field = cores > 0 ? (int)cores : 1;
+            break;
+        }
+        // fall through
+    case OPT_INT: {
+        char *end;
+        errno = 0;
+        long n = strtol(value, &end, 10);
+        if (end == value || *end || errno) {
+            config_error(p, file, line, "%s expects a number, not '%s'", opt->key, value);
+        } else if (n < opt->min || n > opt->max) {
+            if (opt->max == INT_MAX) config_error(p, file, line, "%s must be at least %d", opt->key, opt->min);
+            else config_error(p, file, line, "%s must be between %d and %d", opt->key, opt->min, opt->max);
+        } else {
+            *(int *)field = (int)n;
+        }
+        break;
+    }
+    case OPT_STR:
+        if (strlen(value) >= MAX_STR) config_error(p, file, line, "%s is longer than %d characters", opt->key, MAX_STR - 1);
+        else snprintf(field, MAX_STR, "%s", value);
+        break;
+    case OPT_CHOICE: {
+        for (int i = 0; opt->choices[i]; ++i) {
+            if (strcmp(value, opt->choices[i]) == 0) {
+                *(int *)field = i;
+                return;
             }
-        } else if (strncmp(line, "admins =", 8) == 0) {
-            char *p = strchr(line, '=') + 1;
-            char *tok = strtok(p, ",\n");
-            while (tok && config->admin_count < MAX_ADMINS) {
-                char *sep = strchr(tok, ':');
-                if (sep) {
-                    *sep = 0;
-                    char *name = tok;
-                    trim_whitespace(name);
-                    char *pass = sep + 1;
-                    trim_whitespace(pass);
-                    snprintf(config->admins[config->admin_count].name, MAX_STR, "%s", name);
-                    snprintf(config->admins[config->admin_count].password, MAX_STR, "%s", pass);
-                    config->admin_count++;
-                }
-                tok = strtok(NULL, ",\n");
+        }
+        char names[64] = "";
+        size_t used = 0;
+        for (int i = 0; opt->choices[i] && used < sizeof(names); ++i) {
+            used += snprintf(names + used, sizeof(names) - used, "%s%s", i ? ", " : "", opt->choices[i]);
+        }
+        config_error(p, file, line, "%s must be one of %s, not '%s'", opt->key, names, value);
+        break;
+    }
+    case OPT_CHANNELS:
+    case OPT_ADMINS:
+        for (char *save = NULL, *tok = strtok_r(value, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+            trim_whitespace(tok);
+            if (!*tok) continue;
+            if (opt->type == OPT_CHANNELS) add_channel(p, file, line, tok);
+            else add_admin(p, file, line, tok);
+        }
+        break;
+    }
+}
+
+static void parse_file(ConfigParse *p, const char *path, const char *included_from, int included_at, int depth) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        if (included_from) config_error(p, included_from, included_at, "cannot read %s: %s", path, strerror(errno));
+        else config_error(p, path, 0, "cannot read: %s", strerror(errno));
+        return;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    while (getline(&line, &cap, f) != -1) {
+        ++lineno;
+        trim_whitespace(line);
+        if (!line[0] || line[0] == '#') continue;
+        char *eq = strchr(line, '=');
+        if (!eq) {
+            config_error(p, path, lineno, "expected 'key = value'");
+            continue;
+        }
+        *eq = 0;
+        char *key = line, *value = eq + 1;
+        trim_whitespace(key);
+        trim_whitespace(value);
+        if (strcmp(key, "include") == 0) {
+            if (depth + 1 >= MAX_INCLUDE_DEPTH) {
+                config_error(p, path, lineno, "includes nested more than %d deep", MAX_INCLUDE_DEPTH);
+                continue;
             }
-        } else if (strncmp(line, "nickname =", 9) == 0) {
-            char *p = strchr(line, '=') + 1;
-            trim_whitespace(p);
-            snprintf(config->nickname, MAX_STR, "%s", p);
-        } else if (strncmp(line, "server =", 7) == 0) {
-            char *p = strchr(line, '=') + 1;
-            trim_whitespace(p);
-            snprintf(config->server, MAX_STR, "%s", p);
-            config->server[strcspn(config->server, "\n")] = 0;
-        } else if (strncmp(line, "port =", 6) == 0) {
-            char *p = strchr(line, '=') + 1;
-            trim_whitespace(p);
-            config->port = atoi(p);
-        } else if (strncmp(line, "narratives =", 11) == 0) {
-            char *p = strchr(line, '=') + 1;
-            trim_whitespace(p);
-            snprintf(config->narratives_path, MAX_STR, "%s", p);
-            config->narratives_path[strcspn(config->narratives_path, "\n")] = 0;
-        } else if (strncmp(line, "logfile =", 8) == 0) {
-            char *p = strchr(line, '=') + 1;
-            trim_whitespace(p);
-            snprintf(config->logfile, MAX_STR, "%s", p);
-            config->logfile[strcspn(config->logfile, "\n")] = 0;
+            char target[PATH_MAX];
+            const char *slash = strrchr(path, '/');
+            if (value[0] == '/' || !slash) snprintf(target, sizeof(target), "%s", value);
+            else snprintf(target, sizeof(target), "%.*s/%s", (int)(slash - path), path, value);
+            parse_file(p, target, path, lineno, depth + 1);
+            continue;
         }
+        const ConfigOption *opt = NULL;
+        for (size_t i = 0; i < OPTION_COUNT && !opt; ++i) {
+            if (strcmp(options[i].key, key) == 0) opt = &options[i];
+        }
+        if (!opt) config_error(p, path, lineno, "unknown setting '%s'", key);
+        else set_option(p, path, lineno, opt, value);
     }
+    free(line);
     fclose(f);
+}
+
+int parse_config(const char *path, BotConfig *config, char *errors, size_t errors_len) {
+    set_defaults(config);
+    ConfigParse p = { config, 0, 0, errors, errors_len, 0, 0 };
+    if (errors && errors_len) errors[0] = 0;
+    parse_file(&p, path, NULL, 0, 0);
+    if (p.error_count == 0 && !config->nickname[0]) config_error(&p, path, 0, "nickname is not set");
+    if (p.error_count == 0 && !config->server[0]) config_error(&p, path, 0, "server is not set");
+    return p.error_count;
+}
+
+int load_config(const char *path, BotConfig *config) {
+    if (parse_config(path, config, NULL, 0) == 0) return 0;
+    free_config(config);
+    return -1;
+}
+
+void free_config(BotConfig *config) {
+    free(config->channels);
+    free(config->admins);
+    config->channels = NULL;
+    config->admins = NULL;
+    config->channel_count = config->admin_count = 0;
+}
+
+static void format_value(const ConfigOption *opt, const BotConfig *config, char *buf, size_t len) {
+    const char *field = (const char *)config + opt->offset;
+    if (opt->type == OPT_STR) snprintf(buf, len, "%s", *field ? field : "(none)");
+    else if (opt->type == OPT_CHOICE) snprintf(buf, len, "%s", opt->choices[*(const int *)field]);
+    else snprintf(buf, len, "%d", *(const int *)field);
+}
+
+int config_has_channel(const BotConfig *config, const char *name) {
+    for (int i = 0; i < config->channel_count; ++i) {
+        if (strcasecmp(config->channels[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+const AdminUser *config_find_admin(const BotConfig *config, const char *name) {
+    for (int i = 0; i < config->admin_count; ++i) {
+        if (strcasecmp(config->admins[i].name, name) == 0) return &config->admins[i];
+    }
+    return NULL;
+}
+
+typedef struct {
+    char text[DIFF_LINE];
+    size_t used;
+    int items, left_out;
+} ListChange;
+
+// Adds " <mark><name>" to a list change line, or counts it once the line is full
+static void list_item(ListChange *c, char mark, const char *name) {
+    c->items++;
+    if (c->left_out || c->used + strlen(name) + 18 >= DIFF_LINE) {
+        c->left_out++;
+        return;
+    }
+    c->used += snprintf(c->text + c->used, DIFF_LINE - c->used, " %c%s", mark, name);
+}
+
+static int list_end(ListChange *c, char *line, size_t len) {
+    if (c->left_out) snprintf(c->text + c->used, DIFF_LINE - c->used, " and %d more", c->left_out);
+    snprintf(line, len, "%s", c->text);
+    return c->items;
+}
+
+// Appends one change line to buf; lines are separated by '\n'
+static void diff_line(char *buf, size_t len, size_t *used, const char *line) {
+    if (*used >= len) return;
+    *used += snprintf(buf + *used, len - *used, "%s%s", *used ? "\n" : "", line);
+}
+
+static int diff_channels(const BotConfig *prev, const BotConfig *next, char *line, size_t len) {
+    ListChange c = { "channels:", 9, 0, 0 };
+    for (int i = 0; i < next->channel_count; ++i) {
+        if (!config_has_channel(prev, next->channels[i])) list_item(&c, '+', next->channels[i]);
+    }
+    for (int i = 0; i < prev->channel_count; ++i) {
+        if (!config_has_channel(next, prev->channels[i])) list_item(&c, '-', prev->channels[i]);
+    }
+    return list_end(&c, line, len);
+}
+
+// Passwords are never shown; a changed one is marked with '~'
+static int diff_admins(const BotConfig *prev, const BotConfig *next, char *line, size_t len) {
+    ListChange c = { "admins:", 7, 0, 0 };
+    for (int i = 0; i < next->admin_count; ++i) {
+        const AdminUser *old = config_find_admin(prev, next->admins[i].name);
+        if (!old) list_item(&c, '+', next->admins[i].name);
+        else if (strcmp(old->password, next->admins[i].password) != 0) list_item(&c, '~', next->admins[i].name);
+    }
+    for (int i = 0; i < prev->admin_count; ++i) {
+        if (!config_find_admin(next, prev->admins[i].name)) list_item(&c, '-', prev->admins[i].name);
+    }
+    return list_end(&c, line, len);
+}
+
+int config_diff(const BotConfig *prev, const BotConfig *next, char *buf, size_t len, int *restart) {
+    size_t used = 0;
+    int changes = 0;
+    *restart = 0;
+    if (len) buf[0] = 0;
+    for (size_t i = 0; i < OPTION_COUNT; ++i) {
+        const ConfigOption *opt = &options[i];
+        char line[DIFF_LINE + 32];
+        if (opt->type == OPT_CHANNELS || opt->type == OPT_ADMINS) {
+            int items = opt->type == OPT_CHANNELS ? diff_channels(prev, next, line, sizeof(line))
+                                                   : diff_admins(prev, next, line, sizeof(line));
+            if (items == 0) continue;
+        } else {
+            char before[MAX_STR], after[MAX_STR];
+            format_value(opt, prev, before, sizeof(before));
+            format_value(opt, next, after, sizeof(after));
+            if (strcmp(before, after) == 0) continue;
+            snprintf(line, sizeof(line), "%s: %s -> %s%s", opt->key, before, after, opt->live ? "" : " (restart needed)");
+            if (!opt->live) (*restart)++;
+        }
+        diff_line(buf, len, &used, line);
+        changes++;
+    }
+    return changes;
+}
+
+static void *copy_list(const void *list, int count, size_t size) {
+    if (count == 0) return NULL;
+    void *copy = malloc(count * size);
+    if (copy) memcpy(copy, list, count * size);
+    return copy;
+}
+
+int config_apply_live(BotConfig *running, const BotConfig *next) {
+    void *channels = copy_list(next->channels, next->channel_count, sizeof(*next->channels));
+    void *admins = copy_list(next->admins, next->admin_count, sizeof(*next->admins));
+    if ((next->channel_count && !channels) || (next->admin_count && !admins)) {
+        free(channels);
+        free(admins);
+        return -1;
+    }
+    free(running->channels);
+    free(running->admins);
+    running->channels = channels;
+    running->channel_count = next->channel_count;
+    running->admins = admins;
+    running->admin_count = next->admin_count;
+    for (size_t i = 0; i < OPTION_COUNT; ++i) {
+        const ConfigOption *opt = &options[i];
+        if (!opt->live || opt->type == OPT_CHANNELS || opt->type == OPT_ADMINS) continue;
+        if (opt->type == OPT_STR) memcpy((char *)running + opt->offset, (const char *)next + opt->offset, MAX_STR);
+        else *(int *)((char *)running + opt->offset) = *(const int *)((const char *)next + opt->offset);
+    }
     return 0;
 }
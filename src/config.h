@@ -1,8 +1,9 @@
 // config.h - Configuration parsing
 #ifndef CONFIG_H
 #define CONFIG_H
-#define MAX_CHANNELS 10
-#define MAX_ADMINS 10
+
+#include <stddef.h>
+
 #define MAX_STR 128
 
 typedef struct {
@@ -10,18 +11,64 @@ typedef struct {
     char password[MAX_STR];
 } AdminUser;
 
+// What happens to a line for a handler whose queue is full
+typedef enum {
+    QUEUE_DROP_OLDEST,
+    QUEUE_DROP_NEWEST,
+    QUEUE_COALESCE, // replace the newest queued line from the same sender
+} QueuePolicy;
+
 typedef struct {
-    char channels[MAX_CHANNELS][MAX_STR];
+    char (*channels)[MAX_STR]; // channels joined at startup, grown as needed
     int channel_count;
-    AdminUser admins[MAX_ADMINS];
+    AdminUser *admins;         // grown as needed
     int admin_count;
     char nickname[MAX_STR];
     char server[MAX_STR];
     int port;
     char narratives_path[MAX_STR];
     char logfile[MAX_STR];
+    int workers; // 0: one process per channel, >0: size of the handler thread pool
+    int connections; // server connections, channels sharded across them by hash
+    int target_lag;  // ms of server lag the send rate is adapted to stay under
+    int connect_timeout; // seconds allowed for DNS, connect and registration each
+    int join_batch;      // max channels per JOIN line, 0 = as many as fit
+    int reconnect_max;   // longest reconnect backoff in seconds, 0 = exit on disconnect
+    char state_file[MAX_STR]; // snapshot of shared state for warm restarts, "" = off
+    int state_sync;      // seconds between snapshots
+    int queue_limit;     // lines buffered per channel handler that is behind
+    QueuePolicy queue_policy;
+    int admin_session;   // seconds an !auth stays valid, 0 = until restart
+    int history_lines;   // messages kept per channel for !search/!last, 0 = none
+    int seen_capacity;   // nicks tracked for !seen, least recently active evicted first
+    char plugin_dir[MAX_STR]; // response-handler plugins (*.so) loaded at startup, "" = none
+    int plugin_budget_ms;     // a plugin call taking longer is counted as over budget
+    int narrative_no_repeat; // a channel's last N responses are not picked again while a trigger has other alternatives
+    int narrative_cache;     // catalogue lookups of recent messages remembered per channel, 0 = off
+    char dispatcher_cpus[MAX_STR]; // CPU list ("0-1,4") dispatchers are pinned to, "" = any
+    char handler_cpus[MAX_STR];    // CPU list for channel handlers and pool workers, "" = any
+    int handler_spread;  // 1 = each handler pinned to one CPU of handler_cpus, round robin
+    int dispatcher_fifo; // SCHED_FIFO priority of the dispatcher (1-99), 0 = normal scheduling
+    int dispatcher_nice; // nice value of the dispatcher when not under SCHED_FIFO
+    int log_level;       // LOG_ERROR..LOG_DEBUG (utils.h): least important message written to logfile
 } BotConfig;
 
+// Reads path, and the files it includes, into config. Problems are printed
+// to stderr as "file:line: message"; returns -1 if there were any.
 int load_config(const char *path, BotConfig *config);
+// Same, with the problems put into errors instead, one per line. Returns the
+// number of problems; config must be freed either way.
+int parse_config(const char *path, BotConfig *config, char *errors, size_t errors_len);
+void free_config(BotConfig *config);
+// Case-insensitive lookups in the channel and admin lists
+int config_has_channel(const BotConfig *config, const char *name);
+const AdminUser *config_find_admin(const BotConfig *config, const char *name);
+// Describes how next differs from prev, one change per line, such as
+// "target_lag: 1000 -> 500" or "channels: +#new -#old". Changes !rehash
+// cannot apply end in " (restart needed)" and are counted in *restart.
+// Returns the number of changes.
+int config_diff(const BotConfig *prev, const BotConfig *next, char *buf, size_t len, int *restart);
+// Copies the settings !rehash applies from next into running
+int config_apply_live(BotConfig *running, const BotConfig *next);
 
 #endif
@@ -0,0 +1,258 @@
+// connection.c - Server connection setup: resolve, connect, register, join
+#define _GNU_SOURCE
+#include "connection.h"
+#include "irc_client.h"
+#include "shared_mem.h"
+#include "shard.h"
+#include "utils.h"
+#include "ircv3.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define MAX_ATTEMPTS 16
+#define ATTEMPT_DELAY_MS 250 // connection attempt delay from RFC 8305
+#define NICK_ALTERNATES "_^`-" // last characters tried when the server refuses our nick
+
+// Asynchronous getaddrinfo so a dead resolver can't hang startup
+static struct addrinfo *resolve(const char *host, int port, int timeout_ms) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    struct gaicb request = { host, service, &hints, NULL };
+    struct gaicb *list[1] = { &request };
+    int rc = getaddrinfo_a(GAI_NOWAIT, list, 1, NULL);
+    if (rc == 0) {
+        struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        const struct gaicb *wait[1] = { &request };
+        while ((rc = gai_error(&request)) == EAI_INPROGRESS) {
+            int s = gai_suspend(wait, 1, &timeout);
+            if (s == EAI_AGAIN) {
+                gai_cancel(&request);
+                fprintf(stderr, "ERROR, DNS lookup for %s timed out\n", host);
+                return NULL;
+            }
+            if (s != 0 && s != EAI_ALLDONE && s != EAI_INTR) break;
+        }
+    }
+    if (rc != 0) {
+        fprintf(stderr, "ERROR, no such host: %s (%s)\n", host, gai_strerror(rc));
+        return NULL;
+    }
+    return request.ar_result;
+}
+
+// Starts a non-blocking connect; returns the socket or -1
+static int start_attempt(const struct addrinfo *ai) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) return fd;
+    close(fd);
+    return -1;
+}
+
+int irc_connect(const char *host, int port, int timeout_ms) {
+    long long deadline = monotonic_ms() + timeout_ms;
+    struct addrinfo *res = resolve(host, port, timeout_ms);
+    if (!res) return -1;
+    // Interleave address families, keeping the resolver's preference order
+    const struct addrinfo *primary[MAX_ATTEMPTS], *secondary[MAX_ATTEMPTS];
+    int nprimary = 0, nsecondary = 0;
+    for (const struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == res->ai_family) {
+            if (nprimary < MAX_ATTEMPTS) primary[nprimary++] = ai;
+        } else if (nsecondary < MAX_ATTEMPTS) {
+            secondary[nsecondary++] = ai;
+        }
+    }
+    const struct addrinfo *order[MAX_ATTEMPTS];
+    int count = 0;
+    for (int i = 0; count < MAX_ATTEMPTS && (i < nprimary || i < nsecondary); ++i) {
+        if (i < nprimary) order[count++] = primary[i];
+        if (i < nsecondary && count < MAX_ATTEMPTS) order[count++] = secondary[i];
+    }
+    struct pollfd pending[MAX_ATTEMPTS];
+    int npending = 0, next = 0, sockfd = -1;
+    long long next_start = 0;
+    while (sockfd < 0) {
+        long long now = monotonic_ms();
+        if (now >= deadline) {
+            fprintf(stderr, "ERROR connecting: timed out\n");
+            break;
+        }
+        // Start the next attempt when the last one stalls or nothing is in flight
+        if (next < count && (now >= next_start || npending == 0)) {
+            int fd = start_attempt(order[next++]);
+            if (fd >= 0) {
+                pending[npending].fd = fd;
+                pending[npending].events = POLLOUT;
+                npending++;
+            }
+            next_start = now + ATTEMPT_DELAY_MS;
+            continue;
+        }
+        if (npending == 0) {
+            fprintf(stderr, "ERROR connecting: no address reachable\n");
+            break;
+        }
+        long long wait = deadline - now;
+        if (next < count && next_start - now < wait) wait = next_start - now;
+        if (poll(pending, npending, (int)wait) < 0 && errno != EINTR) break;
+        for (int i = 0; i < npending; ++i) {
+            if (!pending[i].revents) continue;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0 && sockfd < 0) {
+                sockfd = pending[i].fd;
+            } else {
+                close(pending[i].fd);
+            }
+            pending[i--] = pending[--npending];
+        }
+    }
+    for (int i = 0; i < npending; ++i) close(pending[i].fd);
+    freeaddrinfo(res);
+    if (sockfd >= 0) {
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+        log_message("[INFO] Connected to %s:%d", host, port);
+    }
+    return sockfd;
+}
+
+int irc_register(int sockfd, const BotConfig *config, int timeout_ms, char *nick, size_t nick_len, char *leftover, size_t leftover_len) {
+    char buffer[1024];
+    int alternates = 0;
+    snprintf(nick, nick_len, "%s", config->nickname);
+    CapNegotiation caps;
+    // No children share the socket yet, so skip the paced send. CAP LS goes
+    // first so that servers supporting it hold registration until CAP END.
+    snprintf(buffer, sizeof(buffer), "%sNICK %s\r\nUSER %s 0 * :%s\r\n", cap_start(&caps), config->nickname, config->nickname, config->nickname);
+    send(sockfd, buffer, strlen(buffer), 0);
+    long long deadline = monotonic_ms() + timeout_ms;
+    size_t used = 0;
+    leftover[0] = 0;
+    for (;;) {
+        long long wait = deadline - monotonic_ms();
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        if (wait <= 0 || poll(&pfd, 1, (int)wait) == 0) {
+            fprintf(stderr, "ERROR registering: no welcome from server\n");
+            return -1;
+        }
+        if (used >= sizeof(buffer) - 1) used = 0; // overlong line, drop it
+        ssize_t n = recv(sockfd, buffer + used, sizeof(buffer) - 1 - used, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "ERROR registering: connection closed\n");
+            return -1;
+        }
+        used += n;
+        buffer[used] = 0;
+        char *line = buffer, *end;
+        while ((end = strstr(line, "\r\n")) != NULL) {
+            *end = 0;
+            printf("[IRC] %s\n", line);
+            log_message("[IRC] %s", line);
+            // The command follows the optional tags and prefix
+            MessageTags tags;
+            const char *cmd = irc_take_tags(line, &tags);
+            if (*cmd == ':') {
+                cmd = strchr(cmd, ' ');
+                cmd = cmd ? cmd + 1 : "";
+            }
+            if (strncmp(cmd, "PING", 4) == 0) {
+                char pong[512];
+                snprintf(pong, sizeof(pong), "PONG%s\r\n", cmd + 4);
+                send(sockfd, pong, strlen(pong), 0);
+            } else if (strncmp(cmd, "CAP ", 4) == 0) {
+                cap_handle_reply(&caps, sockfd, cmd);
+            } else if (strncmp(cmd, "421 ", 4) == 0 && strstr(cmd, " CAP ")) {
+                caps.done = 1; // no IRCv3 here; NICK/USER register as before
+            } else if (strncmp(cmd, "001 ", 4) == 0) {
+                cap_finish(&caps);
+                snprintf(leftover, leftover_len, "%s", end + 2);
+                log_message("[INFO] Registered as %s", nick);
+                return 0;
+            } else if ((strncmp(cmd, "432 ", 4) == 0 || strncmp(cmd, "433 ", 4) == 0) && alternates < (int)strlen(NICK_ALTERNATES)) {
+                // Nick refused (erroneous or in use): the configured one cut
+                // to NICKLEN - 1 characters plus one of NICK_ALTERNATES
+                snprintf(nick, nick_len, "%.*s%c", NICKLEN - 1, config->nickname, NICK_ALTERNATES[alternates++]);
+                log_message("[WARN] Nick refused (%.3s), trying %s", cmd, nick);
+                char request[MAX_STR + 8];
+                snprintf(request, sizeof(request), "NICK %s\r\n", nick);
+                send(sockfd, request, strlen(request), 0);
+            } else if (strncmp(cmd, "432 ", 4) == 0 || strncmp(cmd, "433 ", 4) == 0 || strncmp(cmd, "ERROR", 5) == 0) {
+                fprintf(stderr, "ERROR registering: %s\n", line);
+                return -1;
+            }
+            line = end + 2;
+        }
+        used = strlen(line);
+        memmove(buffer, line, used + 1);
+    }
+}
+
+int send_join_burst(int sockfd, int max_targets) {
+    size_t cap = 1024, len = 0;
+    char *burst = malloc(cap);
+    if (!burst) return 0;
+    int joined = 0, in_line = 0;
+    size_t line_start = 0;
+    for (int i = 0; i < shared_channel_count(); ++i) {
+        SharedChannel *slot = shared_channel(i);
+        if (!slot || !slot->active || !shard_owns(slot->name)) continue;
+        size_t name_len = strlen(slot->name);
+        if (len + name_len + 16 > cap) {
+            cap = cap * 2 + name_len;
+            char *grown = realloc(burst, cap);
+            if (!grown) break;
+            burst = grown;
+        }
+        // Start a new JOIN when this one would pass 510 bytes or max_targets
+        if (in_line && (len - line_start + 1 + name_len > 510 || (max_targets > 0 && in_line >= max_targets))) {
+            memcpy(burst + len, "\r\n", 2);
+            len += 2;
+            in_line = 0;
+        }
+        if (!in_line) {
+            line_start = len;
+            len += sprintf(burst + len, "JOIN %s", slot->name);
+        } else {
+            len += sprintf(burst + len, ",%s", slot->name);
+        }
+        in_line++;
+        joined++;
+    }
+    if (joined) {
+        memcpy(burst + len, "\r\n", 3);
+        printf("[MAIN] Joining %d channels: %s", joined, burst);
+        // Up to MAX_BATCH_LINES JOINs per write, each booked as a line by the pacer
+        struct iovec iov[MAX_BATCH_LINES];
+        int count = 0, lines = 0;
+        for (char *line = burst; *line; ) {
+            char *end = strstr(line, "\r\n") + 2;
+            iov[count].iov_base = line;
+            iov[count].iov_len = end - line;
+            line = end;
+            lines++;
+            if (++count == MAX_BATCH_LINES || !*line) {
+                send_irc_lines(sockfd, iov, count);
+                count = 0;
+            }
+        }
+        log_message("[INFO] Joined %d channels in %d JOIN lines", joined, lines);
+    }
+    free(burst);
+    return joined;
+}
@@ -0,0 +1,28 @@
+// connection.h - Server connection setup: resolve, connect, register, join
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include "config.h"
+
+// Resolves host (IPv4 and IPv6) without blocking past timeout_ms and connects
+// happy-eyeballs style: attempts are staggered 250 ms apart across address
+// families and the first to complete wins. Returns a blocking socket or -1.
+int irc_connect(const char *host, int port, int timeout_ms);
+
+// Sends CAP LS, NICK and USER in one write, negotiates the IRCv3 capabilities
+// the server offers (see ircv3.h) and waits for the 001 welcome, answering
+// PINGs meanwhile. Anything received after the 001 line is copied into
+// leftover for the dispatcher. If the server refuses config->nickname
+// (432/433), a few variants of it within NICKLEN are tried; nick gets the
+// one accepted (see dispatch_set_nick). Returns 0 once registered, -1 on
+// error/timeout.
+int irc_register(int sockfd, const BotConfig *config, int timeout_ms, char *nick, size_t nick_len, char *leftover, size_t leftover_len);
+
+// Joins every active channel this connection serves (see shard.h) with as few JOIN lines as
+// fit in 512 bytes (at most max_targets channels each, 0 = no limit), written
+// MAX_BATCH_LINES lines at a time and paced per line. Returns the number of
+// channels joined.
+int send_join_burst(int sockfd, int max_targets);
+
+#endif
@@ -0,0 +1,324 @@
+// dispatch.c - Routing of server traffic to channel handlers
+#include "dispatch.h"
+#include "irc_client.h"
+#include "admin.h"
+#include "utils.h"
+#include "shared_mem.h"
+#include "history.h"
+#include "seen.h"
+#include "shard.h"
+#include "trace.h"
+#include "pacing.h"
+#include "ircv3.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+// Copies the next space-separated parameter (a leading ':' dropped) into out
+static const char *next_param(const char *p, char *out, size_t len) {
+    while (*p == ' ') ++p;
+    if (*p == ':') ++p;
+    size_t n = strcspn(p, " ");
+    if (n >= len) n = len - 1;
+    memcpy(out, p, n);
+    out[n] = 0;
+    return p + strcspn(p, " ");
+}
+
+static const char *own_nick(const Dispatcher *d) {
+    return d->nick[0] ? d->nick : d->config->nickname;
+}
+
+// The !seen change of a JOIN, PART, KICK, QUIT or NICK line. Returns 0 for
+// other lines and for the bot's own presence.
+static int presence_event(const Dispatcher *d, const char *line, SeenEvent *ev) {
+    char cmd[16];
+    extract_nick(line, ev->nick, sizeof(ev->nick));
+    ev->nick[strcspn(ev->nick, " ")] = 0; // server prefixes have no '!'
+    const char *p = strchr(line, ' ');
+    if (!p) return 0;
+    p = next_param(p, cmd, sizeof(cmd));
+    ev->where[0] = 0;
+    if (strcmp(cmd, "JOIN") == 0) {
+        // extended-join adds the account and real name after the channel
+        ev->kind = SEEN_JOIN;
+        next_param(p, ev->where, sizeof(ev->where));
+    } else if (strcmp(cmd, "PART") == 0) {
+        ev->kind = SEEN_PART;
+        next_param(p, ev->where, sizeof(ev->where));
+    } else if (strcmp(cmd, "KICK") == 0) {
+        // The change is the kicked nick's, not the kicker's
+        ev->kind = SEEN_KICK;
+        p = next_param(p, ev->where, sizeof(ev->where));
+        next_param(p, ev->nick, sizeof(ev->nick));
+    } else if (strcmp(cmd, "QUIT") == 0) {
+        ev->kind = SEEN_QUIT;
+    } else if (strcmp(cmd, "NICK") == 0) {
+        ev->kind = SEEN_NICK;
+        next_param(p, ev->where, sizeof(ev->where));
+    } else {
+        return 0;
+    }
+    return ev->nick[0] && strcasecmp(ev->nick, own_nick(d)) != 0;
+}
+
+static IrcBatch *find_batch(Dispatcher *d, const char *ref) {
+    if (!ref[0]) return NULL;
+    for (int i = 0; i < MAX_OPEN_BATCHES; ++i) {
+        if (strcmp(d->batches[i].ref, ref) == 0) return &d->batches[i];
+    }
+    return NULL;
+}
+
+// Applies the presence changes a batch gathered, in one !seen update
+static void flush_batch(IrcBatch *b, time_t when) {
+    if (b->count == 0) return;
+    seen_update_many(b->events, b->count, when);
+    b->count = 0;
+}
+
+static void close_batch(IrcBatch *b, time_t when) {
+    int total = b->count;
+    flush_batch(b, when);
+    if (b->bulk) {
+        printf("[MAIN] %s: %d users %s\n", b->quits ? "Netsplit" : "Netjoin", total, b->quits ? "quit" : "returned");
+        log_message("[MAIN] %s: %d users %s", b->quits ? "Netsplit" : "Netjoin", total, b->quits ? "quit" : "returned");
+    }
+    free(b->events);
+    memset(b, 0, sizeof(*b));
+}
+
+// BATCH +ref type [params] opens a batch, BATCH -ref closes it
+static void handle_batch(Dispatcher *d, const char *line, time_t when) {
+    const char *p = strchr(line, ' ');
+    char cmd[16], ref[32], type[32];
+    if (line[0] != ':' || !p) return;
+    p = next_param(p, cmd, sizeof(cmd));
+    p = next_param(p, ref, sizeof(ref));
+    next_param(p, type, sizeof(type));
+    if (ref[0] == '-') {
+        IrcBatch *b = find_batch(d, ref + 1);
+        if (b) close_batch(b, when);
+        return;
+    }
+    if (ref[0] != '+' || !ref[1] || strlen(ref + 1) >= sizeof(d->batches[0].ref)) return;
+    IrcBatch *b = NULL;
+    for (int i = 0; i < MAX_OPEN_BATCHES && !b; ++i) {
+        if (!d->batches[i].ref[0]) b = &d->batches[i];
+    }
+    if (!b) return; // lines of a batch we cannot track are handled one by one
+    snprintf(b->ref, sizeof(b->ref), "%s", ref + 1);
+    b->quits = strcasecmp(type, "netsplit") == 0;
+    b->bulk = b->quits || strcasecmp(type, "netjoin") == 0;
+}
+
+// Feeds a presence change to the !seen table, or to the netsplit/netjoin it is part of
+static void track_presence(Dispatcher *d, const char *line, const MessageTags *tags, time_t when) {
+    SeenEvent ev;
+    if (!presence_event(d, line, &ev)) return;
+    IrcBatch *b = find_batch(d, tags->batch);
+    if (b && b->bulk) {
+        if (b->count == MAX_BATCH_EVENTS) flush_batch(b, when);
+        if (b->count == b->capacity) {
+            int capacity = b->capacity ? b->capacity * 2 : 64;
+            SeenEvent *events = realloc(b->events, capacity * sizeof(*events));
+            if (events) {
+                b->events = events;
+                b->capacity = capacity;
+            }
+        }
+        if (b->count < b->capacity) {
+            b->events[b->count++] = ev;
+            return;
+        }
+    }
+    seen_update(ev.nick, ev.kind, ev.where[0] ? ev.where : NULL, when);
+}
+
+// Follows a NICK change of our own (a reclaim going through); returns 0 for
+// anyone else's
+static int follow_own_nick(Dispatcher *d, const char *line, const char *cmd) {
+    char from[MAX_STR];
+    if (strncmp(cmd, " NICK ", 6) != 0) return 0;
+    extract_nick(line, from, sizeof(from));
+    if (strcasecmp(from, own_nick(d)) != 0) return 0;
+    next_param(cmd + 5, d->nick, sizeof(d->nick));
+    printf("[MAIN] Now known as %s\n", d->nick);
+    log_message("[INFO] Now known as %s", d->nick);
+    if (d->timers && strcasecmp(d->nick, d->config->nickname) == 0) tw_cancel(d->timers, &d->reclaim);
+    return 1;
+}
+
+// Forwards a NAMES reply (353) to the handler of its channel
+static void forward_names(Dispatcher *d, const char *line) {
+    const char *chan_start = strchr(line, '#');
+    if (!chan_start) return;
+    char chan_name[256];
+    size_t n = strcspn(chan_start, " ");
+    if (n >= sizeof(chan_name)) n = sizeof(chan_name) - 1;
+    memcpy(chan_name, chan_start, n);
+    chan_name[n] = 0;
+    int chan_idx = shared_channel_find(chan_name);
+    if (chan_idx != -1) {
+        TRACE(forward, chan_idx, strlen(line), trace_now_ns());
+        d->forward(chan_idx, line, strlen(line), NULL, d->forward_arg);
+    }
+}
+
+void dispatch_buffer(Dispatcher *d, char *buffer) {
+    // Print all server messages for debug
+    printf("[IRC] %s", buffer);
+    log_message("[IRC] %s", buffer); // Log all IRC server messages
+    fflush(stdout);
+    // Parse PRIVMSG and forward to correct child
+    char *line = buffer;
+    while (line && *line) {
+        char *next = strstr(line, "\r\n");
+        if (next) { *next = 0; next += 2; }
+        TRACE(line_received, strlen(line), trace_now_ns());
+        MessageTags tags;
+        line = irc_take_tags(line, &tags);
+        // server-time dates the line as sent; without it, as received
+        time_t when = tags.server_time_ms ? (time_t)(tags.server_time_ms / 1000) : bot_time();
+        pacing_server_time(tags.server_time_ms);
+        // Respond to PING
+        if (strncmp(line, "PING", 4) == 0) {
+            char pong[512];
+            snprintf(pong, sizeof(pong), "PONG%s\r\n", line+4);
+            send_irc_message(d->sockfd, pong);
+            printf("[MAIN] %s\n", pong);
+            log_message("[MAIN] PONG %s\n", pong);
+            line = next;
+            continue;
+        }
+        IrcPrivmsg pm;
+        if (parse_privmsg(line, &pm) == 0) {
+            // Prevent bot-to-bot loops: ignore nicks starting with 'b' and 9 alphanum
+            if (is_bot_nick(pm.sender)) {
+                printf("[MAIN] Ignoring bot nick: %s\n", pm.sender);
+                log_message("[MAIN] Ignoring bot nick: %s", pm.sender);
+                fflush(stdout);
+                line = next;
+                continue;
+            }
+            // Ignore messages from self
+            if (strcasecmp(pm.sender, own_nick(d)) == 0) {
+                printf("[MAIN] Ignoring self message from: %s\n", pm.sender);
+                log_message("[MAIN] Ignoring self message from: %s", pm.sender);
+                fflush(stdout);
+                line = next;
+                continue;
+            }
+            const char *msg = pm.text;
+            // Normalize channel name to lowercase for comparison
+            char target_lc[256];
+            snprintf(target_lc, sizeof(target_lc), "%s", pm.target);
+            for (char *p = target_lc; *p; ++p) *p = tolower(*p);
+
+            // Handle private messages to the bot, currently just for auth
+            if (strcasecmp(target_lc, own_nick(d)) == 0 && strncmp(msg, "!auth ", 6) == 0) {
+                try_admin_auth(pm.sender, msg+6, d->config, d->sockfd);
+                line = next; continue;
+            }
+            // Forward all other PRIVMSGs to the correct child
+            int i = shared_channel_find(target_lc);
+            // Only the connection serving a channel records it, so history keeps one writer
+            if (i != -1 && shard_owns(target_lc)) {
+                seen_update(pm.sender, SEEN_MESSAGE, pm.target, when);
+                // Bot commands are not history; a !search would find itself
+                if (msg[0] != '!') history_record(i, pm.sender, msg, when);
+                // Forward the full IRC line to the child
+                log_message("[FORWARD] Forwarding message from '%s' to channel '%s'", pm.sender, target_lc);
+                TRACE(forward, i, strlen(line), trace_now_ns());
+                d->forward(i, line, strlen(line), &pm, d->forward_arg);
+            }
+        } else {
+            if (line[0] == ':') {
+                const char *cmd = strchr(line, ' ');
+                if (cmd && strncmp(cmd, " BATCH ", 7) == 0) handle_batch(d, line, when);
+                else if (cmd && strncmp(cmd, " 353 ", 5) == 0) forward_names(d, line);
+                else if (cmd && !follow_own_nick(d, line, cmd)) track_presence(d, line, &tags, when);
+            }
+            // PONGs to our lag probes and flood warnings steer the send rate
+            pacing_server_line(line);
+        }
+        line = next;
+    }
+}
+
+void dispatch_reset(Dispatcher *d) {
+    for (int i = 0; i < MAX_OPEN_BATCHES; ++i) {
+        if (d->batches[i].ref[0]) close_batch(&d->batches[i], bot_time());
+    }
+}
+
+// Asks the server for the configured nick back (see dispatch_set_nick)
+static void reclaim_nick(Timer *timer, void *arg) {
+    Dispatcher *d = arg;
+    if (strcasecmp(own_nick(d), d->config->nickname) == 0) return;
+    char request[MAX_STR + 8];
+    snprintf(request, sizeof(request), "NICK %s\r\n", d->config->nickname);
+    send_irc_message(d->sockfd, request);
+    tw_add(d->timers, timer, bot_clock_ms() + NICK_RECLAIM_MS);
+}
+
+void dispatch_set_nick(Dispatcher *d, TimerWheel *timers, const char *nick) {
+    if (d->timers) tw_cancel(d->timers, &d->reclaim);
+    else timer_init(&d->reclaim, reclaim_nick, d);
+    d->timers = timers;
+    snprintf(d->nick, sizeof(d->nick), "%s", nick);
+    if (strcasecmp(nick, d->config->nickname) != 0) tw_add(timers, &d->reclaim, bot_clock_ms() + NICK_RECLAIM_MS);
+}
+
+int sync_channel_handlers(HandlerSet *set, handler_fn start, handler_fn stop, void *arg) {
+    if (!shared_data) return 0;
+    unsigned int generation = shared_data->channel_generation;
+    if (set->synced && generation == set->generation) return 0;
+    set->generation = generation;
+    set->synced = 1;
+    int count = shared_channel_count();
+    if (count > set->capacity) {
+        int capacity = set->capacity ? set->capacity : 8;
+        while (capacity < count) capacity *= 2;
+        unsigned int *epochs = realloc(set->epochs, capacity * sizeof(*epochs));
+        if (!epochs) return 0;
+        set->epochs = epochs;
+        char (*names)[MAX_STR] = realloc(set->names, capacity * sizeof(*names));
+        if (!names) return 0;
+        set->names = names;
+        memset(set->epochs + set->capacity, 0, (capacity - set->capacity) * sizeof(*epochs));
+        set->capacity = capacity;
+    }
+    int changes = 0;
+    for (int i = 0; i < count; ++i) {
+        SharedChannel *slot = shared_channel(i);
+        if (!slot) continue;
+        // Other connections run the handlers of the channels they serve
+        unsigned int want = slot->active && shard_owns(slot->name) ? slot->epoch : 0;
+        if (set->epochs[i] == want) continue;
+        if (set->epochs[i]) {
+            stop(i, set->names[i], arg);
+            set->epochs[i] = 0;
+            changes++;
+        }
+        if (want) {
+            snprintf(set->names[i], MAX_STR, "%s", slot->name);
+            set->epochs[i] = want;
+            start(i, set->names[i], arg);
+            changes++;
+        }
+    }
+    return changes;
+}
+
+int handler_running(const HandlerSet *set, int index) {
+    return index >= 0 && index < set->capacity && set->epochs[index] != 0;
+}
+
+void free_handler_set(HandlerSet *set) {
+    free(set->epochs);
+    free(set->names);
+    memset(set, 0, sizeof(*set));
+}
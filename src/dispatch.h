@@ -0,0 +1,70 @@
+// dispatch.h - Routing of server traffic to channel handlers
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stddef.h>
+#include "config.h"
+#include "irc_client.h"
+#include "seen.h"
+
+#define MAX_OPEN_BATCHES 4
+#define MAX_BATCH_EVENTS 8192 // a longer netsplit is applied in parts
+#define NICK_RECLAIM_MS 30000  // between requests for the configured nick back
+
+// An IRCv3 batch the server has opened (BATCH +ref type)
+typedef struct {
+    char ref[16];      // "" = slot free
+    int bulk;          // netsplit/netjoin: its presence changes are applied together
+    int quits;         // netsplit rather than netjoin
+    SeenEvent *events;
+    int count;
+    int capacity;
+} IrcBatch;
+
+// Delivers one line (without \r\n) to the handler of a channel; pm holds the
+// already parsed PRIVMSG, or is NULL for other lines such as NAMES replies
+typedef void (*forward_fn)(int channel_index, const char *line, size_t len, const IrcPrivmsg *pm, void *arg);
+
+typedef struct {
+    const BotConfig *config;
+    int sockfd;
+    forward_fn forward;
+    void *forward_arg;
+    IrcBatch batches[MAX_OPEN_BATCHES];
+    char nick[MAX_STR];  // nick the server knows us by, "" = config->nickname
+    TimerWheel *timers;  // of the reclaim timer, NULL until dispatch_set_nick
+    Timer reclaim;
+} Dispatcher;
+
+// Handles one buffer of whole lines received from the server: strips message
+// tags, answers PING, handles private !auth, forwards channel traffic and
+// NAMES replies and gathers netsplits and netjoins into one update each
+void dispatch_buffer(Dispatcher *d, char *buffer);
+// Applies and forgets batches left open (the connection was lost)
+void dispatch_reset(Dispatcher *d);
+// Records the nick irc_register got. While it is not config->nickname (that
+// was in use, e.g. by our own ghost after a reconnect), asks the server for
+// it back every NICK_RECLAIM_MS on timers. Handlers always go by
+// config->nickname. d must not move afterwards.
+void dispatch_set_nick(Dispatcher *d, TimerWheel *timers, const char *nick);
+
+// Tracks which channel slots have a running handler
+typedef struct {
+    unsigned int *epochs;    // slot epoch each handler was started for, 0 = none
+    char (*names)[MAX_STR];  // channel each running handler serves
+    int capacity;
+    unsigned int generation; // shared table generation last synced
+    int synced;
+} HandlerSet;
+
+typedef void (*handler_fn)(int channel_index, const char *name, void *arg);
+
+// Starts and stops handlers so they match the shared channel table (after
+// !join/!part); stop runs before start when a slot was reused. Returns the
+// number of handlers started or stopped.
+int sync_channel_handlers(HandlerSet *set, handler_fn start, handler_fn stop, void *arg);
+// Returns 1 if a handler is running for slot index
+int handler_running(const HandlerSet *set, int index);
+void free_handler_set(HandlerSet *set);
+
+#endif
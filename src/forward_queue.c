@@ -0,0 +1,85 @@
+// forward_queue.c - Bounded per-channel queue of lines waiting for a child
+#include "forward_queue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+
+struct QueuedLine {
+    char key[64];
+    size_t len;
+    char line[];
+};
+
+static QueuedLine *make_line(const char *line, size_t len, const char *key) {
+    QueuedLine *l = malloc(sizeof(QueuedLine) + len);
+    if (!l) return NULL;
+    strncpy(l->key, key ? key : "", sizeof(l->key) - 1);
+    l->key[sizeof(l->key) - 1] = 0;
+    l->len = len;
+    memcpy(l->line, line, len);
+    return l;
+}
+
+void fq_init(ForwardQueue *q, int limit) {
+    q->items = NULL;
+    q->head = q->count = 0;
+    q->limit = limit > 0 ? limit : 1;
+}
+
+int fq_push(ForwardQueue *q, const char *line, size_t len, const char *key, QueuePolicy policy) {
+    if (!q->items) {
+        q->items = calloc(q->limit, sizeof(QueuedLine *));
+        if (!q->items) return FQ_DROPPED_NEWEST;
+    }
+    if (q->count == q->limit && policy == QUEUE_DROP_NEWEST) return FQ_DROPPED_NEWEST;
+    QueuedLine *l = make_line(line, len, key);
+    if (!l) return FQ_DROPPED_NEWEST;
+    if (q->count < q->limit) {
+        q->items[(q->head + q->count) % q->limit] = l;
+        q->count++;
+        return FQ_QUEUED;
+    }
+    if (policy == QUEUE_COALESCE && key && *key) {
+        // Newest first: the latest line from the same source makes older ones moot
+        for (int i = q->count - 1; i >= 0; --i) {
+            QueuedLine **slot = &q->items[(q->head + i) % q->limit];
+            if (strcasecmp((*slot)->key, key) == 0) {
+                free(*slot);
+                *slot = l;
+                return FQ_COALESCED;
+            }
+        }
+    }
+    free(q->items[q->head]);
+    q->items[q->head] = NULL;
+    q->head = (q->head + 1) % q->limit;
+    q->items[(q->head + q->count - 1) % q->limit] = l;
+    return FQ_DROPPED_OLDEST;
+}
+
+int fq_flush(ForwardQueue *q, int fd) {
+    while (q->count > 0) {
+        QueuedLine *l = q->items[q->head];
+        // Lines are shorter than PIPE_BUF, so a pipe write is all or nothing
+        ssize_t n = write(fd, l->line, l->len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        free(l);
+        q->items[q->head] = NULL;
+        q->head = (q->head + 1) % q->limit;
+        q->count--;
+    }
+    return q->count;
+}
+
+void fq_clear(ForwardQueue *q) {
+    for (int i = 0; i < q->count; ++i) free(q->items[(q->head + i) % q->limit]);
+    free(q->items);
+    q->items = NULL;
+    q->head = q->count = 0;
+}
@@ -0,0 +1,29 @@
+// forward_queue.h - Bounded per-channel queue of lines waiting for a child
+#ifndef FORWARD_QUEUE_H
+#define FORWARD_QUEUE_H
+
+#include <stddef.h>
+#include "config.h"
+
+typedef struct QueuedLine QueuedLine;
+
+typedef struct {
+    QueuedLine **items; // ring of at most limit lines
+    int head, count, limit;
+} ForwardQueue;
+
+// What fq_push did with the line
+enum { FQ_QUEUED, FQ_DROPPED_NEWEST, FQ_DROPPED_OLDEST, FQ_COALESCED };
+
+void fq_init(ForwardQueue *q, int limit);
+// Queues line (already terminated with \r\n). When the queue is full the
+// policy decides: drop the new line, drop the oldest one, or coalesce - the
+// newest queued line with the same key (sender nick or command) is replaced,
+// falling back to dropping the oldest.
+int fq_push(ForwardQueue *q, const char *line, size_t len, const char *key, QueuePolicy policy);
+// Writes queued lines to the non-blocking fd until it would block. Returns
+// the number of lines still queued, or -1 if the reader is gone.
+int fq_flush(ForwardQueue *q, int fd);
+void fq_clear(ForwardQueue *q);
+
+#endif
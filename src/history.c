@@ -0,0 +1,308 @@
+// history.c - Per-channel message history with a word index
+//
+// Every channel slot owns a block of a shared memfd: a header, the bucket
+// heads of a hashed word index and a ring of lines. A line keeps the hashes of
+// its words and, per word, a link to the previous line that had a word in the
+// same bucket, so each bucket is a chain running back in time through the
+// ring. Links name their target by line number; once the ring overwrites a
+// line, links to it stop matching and the chain ends there. Lines thus drop
+// out of the index as they roll out of the ring, at no cost, and memory stays
+// fixed. The dispatcher is the only writer; handlers read concurrently and
+// re-check a line's number after copying it.
+#define _GNU_SOURCE
+#include "history.h"
+#include "shared_mem.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HEADER_SIZE 64
+#define WORD_SEED 2166136261u // FNV-1a offset basis
+#define NICK_SEED 0x9e3779b9u // keeps nicks and words apart
+
+typedef struct {
+    uint64_t seq;                     // line number in its channel, 0 while being written
+    time_t time;
+    char nick[32];
+    char text[HISTORY_TEXT];
+    int ntokens;
+    uint32_t tokens[HISTORY_TOKENS];  // tokens[0] hashes the sender, the rest distinct words
+    uint64_t next[HISTORY_TOKENS];    // per token: older line in the same bucket, as a LINK
+} HistoryLine;
+
+typedef struct {
+    unsigned int epoch;   // channel slot epoch the ring belongs to
+    uint64_t next_seq;    // number the next line gets
+    uint64_t first_seq;   // older lines belong to the slot's previous channel
+} HistoryHeader;
+
+// A link names token k of line seq; 0 ends a chain (line numbers start at 1)
+#define LINK(seq, k) ((uint64_t)(seq) << 8 | (uint64_t)(k))
+#define LINK_SEQ(link) ((link) >> 8)
+#define LINK_TOKEN(link) ((int)((link) & 0xff))
+
+static int history_fd = -1;
+static int ring_lines = 0;
+static uint32_t bucket_mask = 0;
+static size_t block_size = 0;
+static char *blocks = NULL;     // this process' view of all blocks
+static int mapped_blocks = 0;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static HistoryHeader *block_header(char *block) {
+    return (HistoryHeader *)block;
+}
+
+static uint64_t *block_heads(char *block) {
+    return (uint64_t *)(block + HEADER_SIZE);
+}
+
+static HistoryLine *block_lines(char *block) {
+    return (HistoryLine *)(block + HEADER_SIZE + ((size_t)bucket_mask + 1) * sizeof(uint64_t));
+}
+
+static int is_word_char(unsigned char c) {
+    return isalnum(c) || c >= 0x80;
+}
+
+// Start of the next word at or after p (length in *len), or NULL
+static const char *next_word(const char *p, size_t *len) {
+    while (*p && !is_word_char((unsigned char)*p)) ++p;
+    if (!*p) return NULL;
+    const char *end = p;
+    while (*end && is_word_char((unsigned char)*end)) ++end;
+    *len = end - p;
+    return p;
+}
+
+static uint32_t hash_word(const char *p, size_t len, uint32_t h) {
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)tolower((unsigned char)p[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Maps the block of a channel slot, growing the file first when grow is set.
+// Like the channel table, old mappings stay valid for threads still using them.
+static char *get_block(int index, int grow) {
+    if (history_fd == -1 || index < 0) return NULL;
+    if (index >= __atomic_load_n(&mapped_blocks, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&map_lock);
+        if (index >= mapped_blocks) {
+            struct stat st;
+            int have = fstat(history_fd, &st) == 0 ? (int)(st.st_size / block_size) : 0;
+            if (index >= have && grow) {
+                int want = have ? have : 16;
+                while (want <= index) want *= 2;
+                if (ftruncate(history_fd, (off_t)want * block_size) == 0) have = want;
+                else perror("ftruncate history");
+            }
+            if (index < have) {
+                void *p = mmap(NULL, (size_t)have * block_size, PROT_READ | PROT_WRITE, MAP_SHARED, history_fd, 0);
+                if (p != MAP_FAILED) {
+                    blocks = p;
+                    __atomic_store_n(&mapped_blocks, have, __ATOMIC_RELEASE);
+                } else {
+                    perror("mmap history");
+                }
+            }
+        }
+        pthread_mutex_unlock(&map_lock);
+        if (index >= mapped_blocks) return NULL;
+    }
+    return blocks + (size_t)index * block_size;
+}
+
+// Block of a channel as long as it still holds that channel's lines
+static char *channel_block(int channel_index) {
+    SharedChannel *slot = shared_channel(channel_index);
+    char *block = slot ? get_block(channel_index, 0) : NULL;
+    if (!block || block_header(block)->epoch != slot->epoch) return NULL;
+    return block;
+}
+
+int history_init(int lines_per_channel) {
+    if (lines_per_channel <= 0) return 0;
+    ring_lines = lines_per_channel;
+    uint32_t buckets = 64;
+    while (buckets < 2u * (uint32_t)ring_lines) buckets *= 2;
+    bucket_mask = buckets - 1;
+    block_size = HEADER_SIZE + (size_t)buckets * sizeof(uint64_t) + (size_t)ring_lines * sizeof(HistoryLine);
+    block_size = (block_size + 63) & ~(size_t)63;
+    history_fd = memfd_create("irc_history", 0);
+    if (history_fd == -1) {
+        perror("memfd_create history");
+        return -1;
+    }
+    int capacity = shared_data ? shared_data->channel_capacity : 16;
+    if (!get_block(capacity > 0 ? capacity - 1 : 0, 1)) return -1;
+    printf("[HISTORY] %d lines per channel, %zu KB each\n", ring_lines, block_size / 1024);
+    fflush(stdout);
+    return 0;
+}
+
+void history_cleanup(void) {
+    if (blocks) munmap(blocks, (size_t)mapped_blocks * block_size);
+    if (history_fd != -1) close(history_fd);
+    blocks = NULL;
+    mapped_blocks = 0;
+    history_fd = -1;
+}
+
+void history_record(int channel_index, const char *nick, const char *text, time_t when) {
+    SharedChannel *slot = shared_channel(channel_index);
+    char *block = slot ? get_block(channel_index, 1) : NULL;
+    if (!block) return;
+    HistoryHeader *h = block_header(block);
+    uint64_t *heads = block_heads(block);
+    if (h->epoch != slot->epoch) {
+        // The slot serves a new channel: drop the previous channel's lines
+        memset(heads, 0, ((size_t)bucket_mask + 1) * sizeof(uint64_t));
+        if (h->next_seq == 0) h->next_seq = 1;
+        h->first_seq = h->next_seq;
+        h->epoch = slot->epoch;
+    }
+    uint64_t seq = h->next_seq;
+    HistoryLine *line = &block_lines(block)[seq % ring_lines];
+    __atomic_store_n(&line->seq, 0, __ATOMIC_RELEASE);
+    line->time = when;
+    snprintf(line->nick, sizeof(line->nick), "%s", nick);
+    size_t len = strlen(text);
+    if (len >= HISTORY_TEXT) {
+        len = HISTORY_TEXT - 1;
+        while (len > 0 && ((unsigned char)text[len] & 0xC0) == 0x80) --len; // whole UTF-8 characters only
+    }
+    memcpy(line->text, text, len);
+    line->text[len] = 0;
+    int n = 0;
+    line->tokens[n++] = hash_word(nick, strlen(nick), NICK_SEED);
+    size_t wlen;
+    for (const char *w = next_word(text, &wlen); w && n < HISTORY_TOKENS; w = next_word(w + wlen, &wlen)) {
+        uint32_t hash = hash_word(w, wlen, WORD_SEED);
+        int dup = 0;
+        for (int k = 1; k < n && !dup; ++k) dup = line->tokens[k] == hash;
+        if (!dup) line->tokens[n++] = hash;
+    }
+    line->ntokens = n;
+    // Chain each token behind the newest earlier token of its bucket, which
+    // may be in this same line
+    for (int k = 0; k < n; ++k) {
+        uint32_t bucket = line->tokens[k] & bucket_mask;
+        uint64_t next = heads[bucket];
+        for (int j = k - 1; j >= 0; --j) {
+            if ((line->tokens[j] & bucket_mask) == bucket) { next = LINK(seq, j); break; }
+        }
+        line->next[k] = next;
+    }
+    __atomic_store_n(&line->seq, seq, __ATOMIC_RELEASE);
+    for (int k = 0; k < n; ++k) {
+        __atomic_store_n(&heads[line->tokens[k] & bucket_mask], LINK(seq, k), __ATOMIC_RELEASE);
+    }
+    h->next_seq = seq + 1;
+}
+
+typedef int (*visit_fn)(const HistoryLine *line, void *arg);
+
+// Calls visit with a stable copy of each line holding hash, newest first,
+// until it returns 0 or the chain runs past the oldest line in the ring
+static void walk_chain(char *block, uint32_t hash, visit_fn visit, void *arg) {
+    HistoryLine copy;
+    uint64_t first = block_header(block)->first_seq;
+    HistoryLine *lines = block_lines(block);
+    uint64_t link = __atomic_load_n(&block_heads(block)[hash & bucket_mask], __ATOMIC_ACQUIRE);
+    long steps = (long)ring_lines * HISTORY_TOKENS;
+    while (link && steps-- > 0) {
+        uint64_t seq = LINK_SEQ(link);
+        int k = LINK_TOKEN(link);
+        if (seq < first || k >= HISTORY_TOKENS) break;
+        HistoryLine *line = &lines[seq % ring_lines];
+        // Overwritten: every older line on the chain is gone as well
+        if (__atomic_load_n(&line->seq, __ATOMIC_ACQUIRE) != seq) break;
+        int hit = line->tokens[k] == hash;
+        uint64_t next = line->next[k];
+        if (hit) memcpy(&copy, line, sizeof(copy));
+        if (__atomic_load_n(&line->seq, __ATOMIC_ACQUIRE) != seq) break;
+        if (hit && !visit(&copy, arg)) break;
+        link = next;
+    }
+}
+
+static void copy_match(HistoryMatch *out, const HistoryLine *line) {
+    out->time = line->time;
+    memcpy(out->nick, line->nick, sizeof(out->nick));
+    memcpy(out->text, line->text, sizeof(out->text));
+}
+
+typedef struct {
+    char words[HISTORY_MAX_WORDS][64];
+    uint32_t hashes[HISTORY_MAX_WORDS];
+    int count;
+    HistoryMatch *out;
+    int max;
+    int found;
+} SearchState;
+
+static int visit_search(const HistoryLine *line, void *arg) {
+    SearchState *s = arg;
+    for (int i = 0; i < s->count; ++i) {
+        int indexed = 0;
+        for (int k = 1; k < line->ntokens && !indexed; ++k) indexed = line->tokens[k] == s->hashes[i];
+        // The text check also rules out hash collisions
+        if (!indexed || !strcasestr(line->text, s->words[i])) return 1;
+    }
+    copy_match(&s->out[s->found++], line);
+    return s->found < s->max;
+}
+
+int history_search(int channel_index, const char *words, HistoryMatch *out, int max) {
+    char *block = channel_block(channel_index);
+    if (!block || max <= 0) return 0;
+    SearchState s;
+    s.count = 0;
+    int rarest = 0;
+    size_t len;
+    for (const char *w = next_word(words, &len); w && s.count < HISTORY_MAX_WORDS; w = next_word(w + len, &len)) {
+        size_t n = len < sizeof(s.words[0]) ? len : sizeof(s.words[0]) - 1;
+        memcpy(s.words[s.count], w, n);
+        s.words[s.count][n] = 0;
+        s.hashes[s.count] = hash_word(w, len, WORD_SEED);
+        // Walk the chain of the longest word, most likely the rarest
+        if (len > strlen(s.words[rarest])) rarest = s.count;
+        s.count++;
+    }
+    if (s.count == 0) return 0;
+    s.out = out;
+    s.max = max;
+    s.found = 0;
+    walk_chain(block, s.hashes[rarest], visit_search, &s);
+    return s.found;
+}
+
+typedef struct {
+    const char *nick;
+    HistoryMatch *out;
+    int found;
+} LastState;
+
+static int visit_last(const HistoryLine *line, void *arg) {
+    LastState *s = arg;
+    if (strcasecmp(line->nick, s->nick) != 0) return 1;
+    copy_match(s->out, line);
+    s->found = 1;
+    return 0;
+}
+
+int history_last(int channel_index, const char *nick, HistoryMatch *out) {
+    char *block = channel_block(channel_index);
+    if (!block) return 0;
+    LastState s = { nick, out, 0 };
+    walk_chain(block, hash_word(nick, strlen(nick), NICK_SEED), visit_last, &s);
+    return s.found;
+}
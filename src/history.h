@@ -0,0 +1,29 @@
+// history.h - Per-channel message history with a word index
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <time.h>
+
+#define HISTORY_TEXT 400   // longer messages are stored cut
+#define HISTORY_TOKENS 24  // distinct words indexed per line, the sender included
+#define HISTORY_MAX_WORDS 8
+
+typedef struct {
+    time_t time;
+    char nick[32];
+    char text[HISTORY_TEXT];
+} HistoryMatch;
+
+// Sets up a ring of lines_per_channel lines for every channel slot in shared
+// memory (0 disables history). Call after init_shared_resources and before
+// handlers are forked.
+int history_init(int lines_per_channel);
+void history_cleanup(void);
+// Appends a channel message; dispatcher only (a single writer)
+void history_record(int channel_index, const char *nick, const char *text, time_t when);
+// Newest lines containing every word (case-insensitive), newest first; returns the count
+int history_search(int channel_index, const char *words, HistoryMatch *out, int max);
+// Newest line said by nick; returns 1 if found
+int history_last(int channel_index, const char *nick, HistoryMatch *out);
+
+#endif
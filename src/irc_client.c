@@ -4,11 +4,19 @@
 #include "admin.h"
 #include "utils.h"
 #include "mention.h"
+#include "outbound.h"
+#include "history.h"
+#include "seen.h"
+#include "trace.h"
+#include "pacing.h"
+#include "plugin.h"
+#include "rehash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <ctype.h>
@@ -23,12 +31,15 @@
 #include <arpa/inet.h>
 #endif
 
+#define REPEAT_WINDOW_MS 1000 // identical input within this window is ignored
+#define HISTORY_REPLY_MAX 3     // matches shown for !search
+
 // Declare these as extern, definition should be in main.c
 extern volatile sig_atomic_t terminate_flag;
 extern void handle_termination(int sig);
 
 // Helper to extract nick from IRC prefix
-static void extract_nick(const char *prefix, char *out, size_t outlen) {
+void extract_nick(const char *prefix, char *out, size_t outlen) {
     if (!prefix || prefix[0] != ':') { out[0] = 0; return; }
     const char *bang = strchr(prefix, '!');
     size_t len = bang ? (size_t)(bang - prefix - 1) : strlen(prefix+1);
@@ -37,6 +48,34 @@ static void extract_nick(const char *prefix, char *out, size_t outlen) {
     out[len] = 0;
 }
 
+int parse_privmsg(const char *line, IrcPrivmsg *out) {
+    const char *privmsg = strstr(line, "PRIVMSG ");
+    if (!privmsg) return -1;
+    // Extract sender nick (from prefix)
+    extract_nick(line, out->sender, sizeof(out->sender));
+    const char *target = privmsg + 8;
+    const char *space = strchr(target, ' ');
+    if (!space) return -1;
+    size_t target_len = space - target;
+    if (target_len >= sizeof(out->target)) target_len = sizeof(out->target) - 1;
+    memcpy(out->target, target, target_len);
+    out->target[target_len] = 0;
+    // Only a message if there is a colon (:) after the target
+    const char *msg_colon = strchr(space + 1, ':');
+    if (!msg_colon) return -1;
+    out->text = msg_colon + 1;
+    return 0;
+}
+
+// Bot nicks are 'b' followed by 8 alphanumerics
+int is_bot_nick(const char *nick) {
+    if (strlen(nick) != 9 || nick[0] != 'b') return 0;
+    for (int i = 0; i < 9; ++i) {
+        if (!isalnum((unsigned char)nick[i])) return 0;
+    }
+    return 1;
+}
+
 // Returns 1 if nick is in admin list, 0 otherwise
 int is_admin(const BotConfig *config, const char *nick) {
     for (int i = 0; i < config->admin_count; ++i) {
@@ -89,12 +128,278 @@ void clear_ignored_users(void) {
     if (ignored_count) *ignored_count = 0;
 }
 
+static void (*send_hook)(int sockfd, const char *msg) = NULL;
+
+void set_irc_send_hook(void (*hook)(int sockfd, const char *msg)) {
+    send_hook = hook;
+}
+
 // Helper to send IRC message with locking and delay
 void send_irc_message(int sockfd, const char *msg) {
-    sem_lock();
-    send(sockfd, msg, strlen(msg), 0);
-    sem_unlock();
-    usleep(100000); // 100ms delay to avoid flooding
+    TRACE(send_enqueue, strlen(msg), trace_now_ns());
+    if (send_hook) {
+        send_hook(sockfd, msg);
+    } else {
+        sem_lock();
+        ssize_t n = send(sockfd, msg, strlen(msg), 0);
+        sem_unlock();
+        TRACE(socket_write, n, trace_now_ns());
+    }
+    pacing_after_send(1); // the connection's adaptive rate (see pacing.c)
+}
+
+static size_t iov_total(const struct iovec *iov, int count) {
+    size_t len = 0;
+    for (int i = 0; i < count; ++i) len += iov[i].iov_len;
+    return len;
+}
+
+void send_irc_lines(int sockfd, const struct iovec *iov, int count) {
+    if (count <= 0) return;
+    TRACE(send_enqueue, iov_total(iov, count), trace_now_ns());
+    if (send_hook) {
+        char joined[MAX_BATCH_LINES * IRC_LINE_MAX + 1];
+        size_t len = 0;
+        for (int i = 0; i < count && len + iov[i].iov_len < sizeof(joined); ++i) {
+            memcpy(joined + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        joined[len] = 0;
+        send_hook(sockfd, joined);
+    } else {
+        sem_lock();
+        ssize_t n = writev(sockfd, iov, count);
+        sem_unlock();
+        TRACE(socket_write, n, trace_now_ns());
+    }
+    pacing_after_send(count); // same pacing as one send_irc_message per line
+}
+
+static void end_repeat_window(Timer *timer, void *arg) {
+    ChannelContext *ctx = arg;
+    ctx->last_msg[0] = 0;
+}
+
+void channel_init(ChannelContext *ctx, const BotConfig *config, int channel_index, int sockfd) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->config = config;
+    ctx->channel_index = channel_index;
+    ctx->sockfd = sockfd;
+    SharedChannel *slot = shared_channel(channel_index);
+    snprintf(ctx->name, sizeof(ctx->name), "%s", slot ? slot->name : "");
+    ctx->privmsg_prefix_len = snprintf(ctx->privmsg_prefix, sizeof(ctx->privmsg_prefix), "PRIVMSG %s :", ctx->name);
+    tw_init(&ctx->timers, bot_clock_ms());
+    timer_init(&ctx->repeat_timer, end_repeat_window, ctx);
+    mention_request_init(&ctx->mention);
+    narrative_recent_init(&ctx->recent, config->narrative_no_repeat, channel_index);
+    narrative_cache_init(&ctx->cache, config->narrative_cache);
+}
+
+void channel_run_timers(ChannelContext *ctx) {
+    tw_advance(&ctx->timers, bot_clock_ms());
+}
+
+// Returns 1 if the same input was already handled less than a second ago
+static int is_repeated_input(ChannelContext *ctx, const char *data) {
+    if (timer_armed(&ctx->repeat_timer) && strcmp(data, ctx->last_msg) == 0) {
+        return 1;
+    }
+    strncpy(ctx->last_msg, data, sizeof(ctx->last_msg)-1);
+    ctx->last_msg[sizeof(ctx->last_msg)-1] = 0;
+    tw_add(&ctx->timers, &ctx->repeat_timer, bot_clock_ms() + REPEAT_WINDOW_MS);
+    return 0;
+}
+
+// Answers !search <words> and !last <nick> from the channel's history
+static void send_history_reply(ChannelContext *ctx, const char *msg) {
+    HistoryMatch matches[HISTORY_REPLY_MAX];
+    char text[HISTORY_REPLY_MAX * (HISTORY_TEXT + 64)];
+    size_t len = 0;
+    int found;
+    int search = strncmp(msg, "!search ", 8) == 0;
+    const char *query = msg + (search ? 8 : 6);
+    if (search) {
+        found = history_search(ctx->channel_index, query, matches, HISTORY_REPLY_MAX);
+    } else {
+        found = history_last(ctx->channel_index, query, &matches[0]);
+    }
+    for (int i = 0; i < found; ++i) {
+        char when[32];
+        struct tm tm_info;
+        localtime_r(&matches[i].time, &tm_info);
+        strftime(when, sizeof(when), "%m-%d %H:%M", &tm_info);
+        len += snprintf(text + len, sizeof(text) - len, "%s[%s] <%s> %s", i ? "\n" : "", when, matches[i].nick, matches[i].text);
+    }
+    if (found == 0) {
+        len = snprintf(text, sizeof(text), search ? "No messages in %s match: %s" : "No messages in %s from %s.", ctx->name, query);
+    }
+    printf("[CHILD %d] History reply for %s: %d found\n", ctx->channel_index, msg, found);
+    fflush(stdout);
+    batch_init(&ctx->batch);
+    batch_add_text(&ctx->batch, ctx->config->nickname, ctx->privmsg_prefix, ctx->privmsg_prefix_len, text, len);
+    send_irc_lines(ctx->sockfd, ctx->batch.iov, ctx->batch.count);
+}
+
+// Plugin replies go to the channel, batched until the plugin returns
+static void queue_plugin_reply(void *arg, const char *text, size_t len) {
+    ChannelContext *ctx = arg;
+    batch_add_text(&ctx->batch, ctx->config->nickname, ctx->privmsg_prefix, ctx->privmsg_prefix_len, text, len);
+}
+
+// Handles a PRIVMSG seen by this channel; returns 1 when the line needs no further handling
+static int handle_channel_privmsg(ChannelContext *ctx, const IrcPrivmsg *pm) {
+    const BotConfig *config = ctx->config;
+    int channel_index = ctx->channel_index;
+    int sockfd = ctx->sockfd;
+    const char *sender = pm->sender;
+    const char *target = pm->target;
+    const char *msg = pm->text;
+    SharedChannel *slot = shared_channel(channel_index);
+    if (!slot) return 1;
+    // Skip messages from self (bot)
+    if (strcasecmp(sender, config->nickname) == 0) {
+        return 1;
+    }
+    // Normalize both target and config channel to lowercase for comparison
+    char target_lc[256], config_chan_lc[256];
+    snprintf(target_lc, sizeof(target_lc), "%s", target);
+    snprintf(config_chan_lc, sizeof(config_chan_lc), "%s", ctx->name);
+    for (char *p = target_lc; *p; ++p) *p = tolower(*p);
+    for (char *p = config_chan_lc; *p; ++p) *p = tolower(*p);
+    // Admin channel: handle secret commands
+    if (strcmp(config_chan_lc, "#admin") == 0) {
+        // Call the extracted admin command handler
+        if (handle_admin_command(sender, msg, config, sockfd, shared_data)) {
+            return 1;
+        }
+    }
+    // For all channels: obey admin state
+    if (strcmp(target_lc, config_chan_lc) == 0) {
+        // If stop_talking is set, do not reply
+        if (slot->stop_talking) { return 1; }
+        // If sender is ignored, do not reply
+        if (is_ignored_user(sender)) {
+            printf("[DEBUG] Ignoring user: %s\n", sender);
+            return 1;
+        }
+        // If topic is set for this channel, respond to !topic with the topic
+        if (strncmp(msg, "!topic", 6) == 0 && slot->current_topic[0]) {
+            char reply[512];
+            snprintf(reply, sizeof(reply), "Current topic: %s", slot->current_topic);
+            printf("[CHILD %d] Sending to IRC: PRIVMSG %s :%s\n", channel_index, target, reply);
+            fflush(stdout);
+            send_privmsg(sockfd, config->nickname, target, reply);
+            return 1;
+        }
+        // Format: !settopic <topic>
+        if (strncmp(msg, "!settopic ", 10) == 0) {
+            char *topic = (char*)msg + 10;
+            if (!*topic) {
+                char errmsg[256];
+                snprintf(errmsg, sizeof(errmsg), "PRIVMSG %s :Usage: !settopic <topic>\r\n", ctx->name);
+                send_irc_message(sockfd, errmsg);
+                log_message("[ADMIN] %s issued invalid !settopic command in %s", sender, ctx->name);
+                return 1;
+            }
+            strncpy(slot->current_topic, topic, sizeof(slot->current_topic)-1);
+            slot->current_topic[sizeof(slot->current_topic)-1] = 0;
+            printf("[ADMIN] Topic for %s changed to: %s\n", ctx->name, slot->current_topic);
+            log_message("[ADMIN] %s set topic for %s: %s", sender, ctx->name, slot->current_topic);
+            char adminmsg[512];
+            snprintf(adminmsg, sizeof(adminmsg), "Topic changed to: %s", slot->current_topic);
+            send_privmsg(sockfd, config->nickname, ctx->name, adminmsg);
+            return 1;
+        }
+        if ((strncmp(msg, "!search ", 8) == 0 && msg[8]) || (strncmp(msg, "!last ", 6) == 0 && msg[6])) {
+            send_history_reply(ctx, msg);
+            return 1;
+        }
+        // Format: !seen <nick>
+        if (strncmp(msg, "!seen ", 6) == 0 && msg[6]) {
+            const char *who = msg + 6;
+            char reply[512];
+            SeenInfo info;
+            if (strcasecmp(who, sender) == 0) {
+                snprintf(reply, sizeof(reply), "That's you, %s.", sender);
+            } else if (strcasecmp(who, config->nickname) == 0) {
+                snprintf(reply, sizeof(reply), "I'm right here.");
+            } else if (seen_lookup(who, &info)) {
+                seen_describe(&info, bot_time(), reply, sizeof(reply));
+            } else {
+                snprintf(reply, sizeof(reply), "I have not seen %s.", who);
+            }
+            send_privmsg(sockfd, config->nickname, ctx->name, reply);
+            return 1;
+        }
+        // Commands of loaded plugins; built-in commands above take precedence
+        if (msg[0] == '!') {
+            batch_init(&ctx->batch);
+            int handled = plugin_dispatch(ctx->name, sender, msg, queue_plugin_reply, ctx);
+            if (ctx->batch.count > 0) send_irc_lines(sockfd, ctx->batch.iov, ctx->batch.count);
+            if (handled) return 1;
+        }
+        // Alert if message mentions another channel (word boundary check)
+        handle_channel_mentions(config, channel_index, sockfd, msg, sender);
+        // Alert if message mentions a user (of ABCD1234 username format) in the channel (case-insensitive)
+        handle_user_mentions(config, channel_index, sockfd, msg, sender, &ctx->mention, &ctx->timers);
+
+        // Normal narrative response, rendered from its precompiled template
+        const NarrativeEntry *entry;
+        if (find_narrative_cached(&ctx->cache, config_chan_lc, msg, &entry)) slot->cache_hits++;
+        else slot->cache_misses++;
+        if (entry) {
+            entry = pick_narrative(entry, &ctx->recent);
+            char text[2048];
+            LineBatch *batch = &ctx->batch;
+            TemplateVars vars = { sender, ctx->name, slot->current_topic };
+            size_t len = render_response(entry, &vars, text, sizeof(text));
+            batch_init(batch);
+            batch_add_text(batch, config->nickname, ctx->privmsg_prefix, ctx->privmsg_prefix_len, text, len);
+            printf("[CHILD %d] Sending to IRC: %s%s\n", channel_index, ctx->privmsg_prefix, text);
+            fflush(stdout);
+            send_irc_lines(sockfd, batch->iov, batch->count);
+        }
+    }
+    return 0;
+}
+
+static void handle_channel_line(ChannelContext *ctx, const char *line, const IrcPrivmsg *pm) {
+    if (pm && handle_channel_privmsg(ctx, pm)) return;
+    // Handle NAMES reply (353) for user mention alert
+    if (strncmp(line, ":", 1) == 0 && strstr(line, " 353 ")) {
+        handle_names_reply(line, ctx->channel_index, ctx->sockfd, &ctx->mention, &ctx->timers);
+    }
+}
+
+void channel_handle_input(ChannelContext *ctx, char *buffer) {
+    TRACE(handler_entry, ctx->channel_index, strlen(buffer), trace_now_ns());
+    channel_run_timers(ctx);
+    // Process each IRC line in buffer (split on \r\n), dropping repeats line by line
+    char *line = buffer;
+    while (line && *line) {
+        char *next = strstr(line, "\r\n");
+        if (next) { *next = 0; next += 2; }
+        if (!is_repeated_input(ctx, line)) {
+            // Debug: print what the child receives from the pipe
+            printf("[CHILD %d] Received from pipe: %s\n", ctx->channel_index, line);
+            fflush(stdout);
+            IrcPrivmsg pm;
+            handle_channel_line(ctx, line, parse_privmsg(line, &pm) == 0 ? &pm : NULL);
+        }
+        line = next;
+    }
+    TRACE(handler_exit, ctx->channel_index, trace_now_ns());
+}
+
+void channel_handle_message(ChannelContext *ctx, const char *line, const IrcPrivmsg *pm) {
+    TRACE(handler_entry, ctx->channel_index, strlen(line), trace_now_ns());
+    channel_run_timers(ctx);
+    if (!is_repeated_input(ctx, line)) {
+        printf("[CHILD %d] Received from dispatcher: %s\n", ctx->channel_index, line);
+        fflush(stdout);
+        handle_channel_line(ctx, line, pm);
+    }
+    TRACE(handler_exit, ctx->channel_index, trace_now_ns());
 }
 
 void irc_channel_loop(const BotConfig *config, int channel_index, int sockfd, int pipe_fd) {
@@ -106,149 +411,49 @@ void irc_channel_loop(const BotConfig *config, int channel_index, int sockfd, in
 #ifdef SIGTSTP
     signal(SIGTSTP, handle_termination);  // Ctrl+Z (if available)
 #endif
-    char buffer[512];
-    char last_msg[512] = {0};
-    time_t last_msg_time = 0;
-    // Send JOIN for assigned channel (child process only)
-    printf("[DEBUG] Child process joining channel: '%s'\n", config->channels[channel_index]);
+    // Holds a partial line between reads: a read can end anywhere in the
+    // queued and rescued lines the dispatcher writes (up to 1024 bytes each)
+    char buffer[4096];
+    size_t held = 0;
+    ChannelContext ctx;
+    channel_init(&ctx, config, channel_index, sockfd);
+    // The dispatcher joins the channel for us (in one burst at startup)
+    printf("[DEBUG] Child process handling channel: '%s'\n", ctx.name);
     fflush(stdout);
-    snprintf(buffer, sizeof(buffer), "JOIN %s\r\n", config->channels[channel_index]);
-    send_irc_message(sockfd, buffer);
-    usleep(100000); // 100ms delay to avoid flooding
     // Main loop: print server messages and listen for pipe commands
     fd_set fds;
     int maxfd = pipe_fd;
     while (!terminate_flag) {
         FD_ZERO(&fds);
         FD_SET(pipe_fd, &fds);
-        int ready = select(maxfd+1, &fds, NULL, NULL, NULL);
+        // Sleep until input or the next deadline, whichever comes first
+        int wait_ms = tw_next_timeout(&ctx.timers, bot_clock_ms());
+        struct timeval tv = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+        int ready = select(maxfd+1, &fds, NULL, NULL, wait_ms < 0 ? NULL : &tv);
         if (ready < 0) break;
-        if (FD_ISSET(pipe_fd, &fds)) {
+        rehash_check();
+        channel_run_timers(&ctx);
+        if (ready > 0 && FD_ISSET(pipe_fd, &fds)) {
             // Read IRC message from main process and respond if needed
-            int n = read(pipe_fd, buffer, sizeof(buffer)-1);
+            ssize_t n = read(pipe_fd, buffer + held, sizeof(buffer) - 1 - held);
             if (n > 0) {
-                buffer[n] = 0;
-                // Simple duplicate message/timing check
-                time_t now = time(NULL);
-                if (strcmp(buffer, last_msg) == 0 && (now - last_msg_time) < 1) {
-                    continue;
-                }
-                strncpy(last_msg, buffer, sizeof(last_msg)-1);
-                last_msg[sizeof(last_msg)-1] = 0;
-                last_msg_time = now;
-                // Debug: print what the child receives from the pipe
-                printf("[CHILD %d] Received from pipe: %s\n", channel_index, buffer);
+                held += n;
+                buffer[held] = 0;
+                // Handle the complete lines; a line too long for the buffer goes as is
+                char *end = strrchr(buffer, '\n');
+                size_t done = end ? (size_t)(end + 1 - buffer) : (held == sizeof(buffer) - 1 ? held : 0);
+                if (done == 0) continue;
+                char first = buffer[done];
+                buffer[done] = 0;
+                channel_handle_input(&ctx, buffer);
+                buffer[done] = first;
+                held -= done;
+                memmove(buffer, buffer + done, held);
+            } else if (n == 0) {
+                // Dispatcher closed our pipe: the channel was parted, leave without QUIT
+                printf("[CHILD %d] Channel %s parted, exiting\n", channel_index, ctx.name);
                 fflush(stdout);
-                // Process each IRC line in buffer (split on \r\n)
-                char *line = buffer;
-                while (line && *line) {
-                    char *next = strstr(line, "\r\n");
-                    if (next) { *next = 0; next += 2; }
-                    char *privmsg = strstr(line, "PRIVMSG ");
-                    if (privmsg) {
-                        // Extract channel/target
-                        char *target = privmsg + 8;
-                        char *space = strchr(target, ' ');
-                        if (!space) { line = next; continue; }
-                        *space = 0;
-                        // Extract message (after first ' :')
-                        char *msg = strstr(space+1, ":");
-                        if (!msg) { line = next; continue; }
-                        msg++;
-                        // Extract sender nick
-                        char sender[64] = "";
-                        extract_nick(line, sender, sizeof(sender));
-                        // Skip messages from self (bot)
-                        if (strcasecmp(sender, config->nickname) == 0) {
-                            line = next;
-                            continue;
-                        }
-                        // Normalize both target and config channel to lowercase for comparison
-                        char target_lc[256], config_chan_lc[256];
-                        snprintf(target_lc, sizeof(target_lc), "%s", target);
-                        snprintf(config_chan_lc, sizeof(config_chan_lc), "%s", config->channels[channel_index]);
-                        for (char *p = target_lc; *p; ++p) *p = tolower(*p);
-                        for (char *p = config_chan_lc; *p; ++p) *p = tolower(*p);
-                        // Admin channel: handle secret commands
-                        if (strcmp(config_chan_lc, "#admin") == 0) {
-                            // Call the extracted admin command handler
-                            if (handle_admin_command(sender, msg, config, sockfd, shared_data)) {
-                                continue;
-                            }
-                        }
-                        // For all channels: obey admin state
-                        if (strcmp(target_lc, config_chan_lc) == 0) {
-                            // If stop_talking is set, do not reply
-                            if (shared_data->stop_talking[channel_index]) { line = next; continue; }
-                            // If sender is ignored, do not reply
-                            if (is_ignored_user(sender)) {
-                                printf("[DEBUG] Ignoring user: %s\n", sender);
-                                line = next;
-                                continue;
-                            }
-                            // If topic is set for this channel, respond to !topic with the topic
-                            if (strncmp(msg, "!topic", 6) == 0 && shared_data->current_topic[channel_index][0]) {
-                                char reply[512];
-                                char safe_topic_reply[400];
-                                strncpy(safe_topic_reply, shared_data->current_topic[channel_index], sizeof(safe_topic_reply)-1);
-                                safe_topic_reply[sizeof(safe_topic_reply)-1] = '\0';
-                                snprintf(reply, sizeof(reply), "PRIVMSG %s :Current topic: %s\r\n", target, safe_topic_reply);
-                                printf("[CHILD %d] Sending to IRC: %s\n", channel_index, reply);
-                                fflush(stdout);
-                                send_irc_message(sockfd, reply);
-                                line = next; continue;
-                            }
-                            // Format: !settopic <topic>
-                            if (strncmp(msg, "!settopic ", 10) == 0) {
-                                char *topic = (char*)msg + 10;
-                                if (!*topic) {
-                                    char errmsg[256];
-                                    snprintf(errmsg, sizeof(errmsg), "PRIVMSG %s :Usage: !settopic <topic>\r\n", config->channels[channel_index]);
-                                    send_irc_message(sockfd, errmsg);
-                                    log_message("[ADMIN] %s issued invalid !settopic command in %s", sender, config->channels[channel_index]);
-                                    line = next; continue;
-                                }
-                                strncpy(shared_data->current_topic[channel_index], topic, sizeof(shared_data->current_topic[channel_index])-1);
-                                shared_data->current_topic[channel_index][sizeof(shared_data->current_topic[channel_index])-1] = 0;
-                                printf("[ADMIN] Topic for %s changed to: %s\n", config->channels[channel_index], shared_data->current_topic[channel_index]);
-                                log_message("[ADMIN] %s set topic for %s: %s", sender, config->channels[channel_index], shared_data->current_topic[channel_index]);
-                                char adminmsg[512]; // IRC max message size
-                                // Calculate max topic length so the IRC message always fits
-                                const char *prefix = "PRIVMSG ";
-                                const char *mid = " :Topic changed to: ";
-                                const char *suffix = "\r\n";
-                                size_t chanlen = strlen(config->channels[channel_index]);
-                                size_t max_topic_len = sizeof(adminmsg) - strlen(prefix) - chanlen - strlen(mid) - strlen(suffix) - 1; // -1 for null
-                                if (max_topic_len > sizeof(shared_data->current_topic[channel_index]) - 1)
-                                    max_topic_len = sizeof(shared_data->current_topic[channel_index]) - 1;
-                                char safe_topic[max_topic_len + 1];
-                                snprintf(safe_topic, sizeof(safe_topic), "%s", shared_data->current_topic[channel_index]);
-                                snprintf(adminmsg, sizeof(adminmsg), "PRIVMSG %s :Topic changed to: %s\r\n", config->channels[channel_index], safe_topic);
-                                send_irc_message(sockfd, adminmsg);
-                                line = next; continue;
-                            }
-                            // Alert if message mentions another channel (word boundary check)
-                            handle_channel_mentions(config, channel_index, sockfd, msg, sender);
-                            // Alert if message mentions a user (of ABCD1234 username format) in the channel (case-insensitive)
-                            handle_user_mentions(config, channel_index, sockfd, msg, sender);
-
-                            // Normal narrative response
-                            const char* reply_text = get_narrative_response(config_chan_lc, msg);
-                            if (reply_text) {
-                                char reply[512];
-                                snprintf(reply, sizeof(reply), "PRIVMSG %s :%s\r\n", target, reply_text);
-                                printf("[CHILD %d] Sending to IRC: %s\n", channel_index, reply);
-                                fflush(stdout);
-                                send_irc_message(sockfd, reply);
-                            }
-                        }
-                    }
-                    // Handle NAMES reply (353) for user mention alert
-                    if (strncmp(line, ":", 1) == 0 && strstr(line, " 353 ")) {
-                        handle_names_reply(line, channel_index, sockfd);
-                    }
-                    line = next;
-                }
+                return;
             }
         }
     }
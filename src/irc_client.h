@@ -3,8 +3,59 @@
 #define IRC_CLIENT_H
 #include "config.h"
 
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "mention.h"
+#include "outbound.h"
+#include "timer_wheel.h"
+#include "narrative.h"
+
+// A PRIVMSG line split into its parts; text points into the parsed line
+typedef struct {
+    char sender[64];
+    char target[256];
+    const char *text;
+} IrcPrivmsg;
+
+// Per-channel handler state; one per channel child (or per channel when run in-process)
+typedef struct {
+    const BotConfig *config;
+    int channel_index;
+    int sockfd;
+    char name[MAX_STR]; // channel served, copied from the shared slot
+    char privmsg_prefix[MAX_STR + 16]; // "PRIVMSG <name> :", built once
+    size_t privmsg_prefix_len;
+    LineBatch batch;    // outbound lines of the reply being sent
+    TimerWheel timers;  // this handler's deadlines, on bot_clock_ms()
+    char last_msg[512];
+    Timer repeat_timer; // armed while last_msg counts as a repeat
+    struct MentionRequest mention;
+    NarrativeRecent recent; // responses given lately, for narrative_no_repeat
+    NarrativeCache cache;   // catalogue lookups of recent messages
+} ChannelContext;
+
+// Sets up ctx in place; it must not move afterwards (its timers point into it)
+void channel_init(ChannelContext *ctx, const BotConfig *config, int channel_index, int sockfd);
+// Fires the handler's due timers; input handling does this too
+void channel_run_timers(ChannelContext *ctx);
+// Handles complete lines forwarded by the dispatcher (one or more, \r\n separated);
+// a repeat of the line before it within a second is dropped
+void channel_handle_input(ChannelContext *ctx, char *buffer);
+// Handles one line the dispatcher already parsed (pm is NULL for non-PRIVMSG lines)
+void channel_handle_message(ChannelContext *ctx, const char *line, const IrcPrivmsg *pm);
 void irc_channel_loop(const BotConfig *config, int channel_index, int sockfd, int pipe_fd);
 void send_irc_message(int sockfd, const char *msg);
+// Sends complete lines in one writev (one hook call when hooked), paced per line
+void send_irc_lines(int sockfd, const struct iovec *iov, int count);
+// Replaces the socket write in send_irc_message (NULL restores it), e.g. for benchmarks
+void set_irc_send_hook(void (*hook)(int sockfd, const char *msg));
+// Copies the nick of a ":nick!user@host" prefix into out ("" without a prefix)
+void extract_nick(const char *prefix, char *out, size_t outlen);
+// Returns 0 and fills out if line is a PRIVMSG carrying a message, -1 otherwise
+int parse_privmsg(const char *line, IrcPrivmsg *out);
+// Returns 1 for nicks of the bAAAA9999 bot form
+int is_bot_nick(const char *nick);
 int is_ignored_user(const char *nick);
 void add_ignored_user(const char *nick);
 void remove_ignored_user(const char *nick);
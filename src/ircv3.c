@@ -0,0 +1,167 @@
+// ircv3.c - IRCv3 capability negotiation and message tags
+//
+// Registration asks for the capabilities below with CAP LS 302 ahead of
+// NICK/USER and requests whichever the server lists, all in one CAP REQ, so
+// negotiation costs one round trip on top of the plain handshake. The
+// dispatcher strips tags off every line before parsing it, so handlers only
+// ever see plain RFC 1459 lines.
+#define _GNU_SOURCE
+#include "ircv3.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+static const struct {
+    const char *name;
+    unsigned int bit;
+} wanted_caps[] = {
+    { "server-time", CAP_SERVER_TIME },
+    { "message-tags", CAP_MESSAGE_TAGS },
+    { "multi-prefix", CAP_MULTI_PREFIX },
+    { "userhost-in-names", CAP_USERHOST_IN_NAMES },
+    { "extended-join", CAP_EXTENDED_JOIN },
+    { "batch", CAP_BATCH },
+};
+#define WANTED_COUNT (sizeof(wanted_caps) / sizeof(wanted_caps[0]))
+
+static unsigned int enabled_caps = 0;
+
+const char *cap_start(CapNegotiation *n) {
+    memset(n, 0, sizeof(*n));
+    return "CAP LS 302\r\n";
+}
+
+// Bits of the wanted caps in a space-separated list; "name=value" (CAP 302)
+// and "-name" (a cap being disabled, skipped) are understood
+static unsigned int parse_cap_list(const char *list) {
+    unsigned int caps = 0;
+    while (*list) {
+        while (*list == ' ') ++list;
+        size_t len = strcspn(list, " ");
+        size_t name_len = strcspn(list, " =");
+        if (name_len > len) name_len = len;
+        if (len > 0 && list[0] != '-') {
+            for (size_t i = 0; i < WANTED_COUNT; ++i) {
+                if (strlen(wanted_caps[i].name) == name_len && strncmp(list, wanted_caps[i].name, name_len) == 0) {
+                    caps |= wanted_caps[i].bit;
+                }
+            }
+        }
+        list += len;
+    }
+    return caps;
+}
+
+void cap_names(unsigned int caps, char *buf, size_t len) {
+    size_t used = 0;
+    buf[0] = 0;
+    for (size_t i = 0; i < WANTED_COUNT && used < len; ++i) {
+        if (caps & wanted_caps[i].bit) {
+            used += snprintf(buf + used, len - used, "%s%s", used ? " " : "", wanted_caps[i].name);
+        }
+    }
+    if (!caps) snprintf(buf, len, "none");
+}
+
+static void send_raw(int sockfd, const char *line) {
+    // No children share the socket during registration
+    send(sockfd, line, strlen(line), MSG_NOSIGNAL);
+}
+
+void cap_handle_reply(CapNegotiation *n, int sockfd, const char *cmd) {
+    // CAP <nick or *> <subcommand> [*] :<caps>
+    char target[64], sub[16];
+    int offset = 0;
+    if (n->done || sscanf(cmd, "CAP %63s %15s %n", target, sub, &offset) != 2) return;
+    const char *rest = cmd + offset;
+    int more = strncmp(rest, "* ", 2) == 0; // multi-line LS continues
+    const char *list = strchr(rest, ':');
+    list = list ? list + 1 : rest;
+    if (strcmp(sub, "LS") == 0) {
+        n->offered |= parse_cap_list(list);
+        if (more) return;
+        if (n->offered) {
+            char req[256];
+            cap_names(n->offered, req, sizeof(req));
+            char line[300];
+            snprintf(line, sizeof(line), "CAP REQ :%s\r\n", req);
+            send_raw(sockfd, line);
+            return;
+        }
+    } else if (strcmp(sub, "ACK") == 0) {
+        n->enabled |= parse_cap_list(list);
+    } else if (strcmp(sub, "NAK") != 0) {
+        return;
+    }
+    // A NAK rejects the whole request; carry on without capabilities
+    send_raw(sockfd, "CAP END\r\n");
+    n->done = 1;
+}
+
+void cap_finish(const CapNegotiation *n) {
+    char names[256];
+    enabled_caps = n->enabled;
+    cap_names(enabled_caps, names, sizeof(names));
+    log_message("[INFO] IRCv3 capabilities: %s", names);
+}
+
+unsigned int irc_caps(void) {
+    return enabled_caps;
+}
+
+// "2026-10-19T05:41:00.123Z" to ms since the epoch, 0 if malformed
+static long long parse_server_time(const char *value, size_t len) {
+    char text[40];
+    if (len >= sizeof(text)) return 0;
+    memcpy(text, value, len);
+    text[len] = 0;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int ms = 0, consumed = 0;
+    if (sscanf(text, "%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6) return 0;
+    if (text[consumed] == '.') {
+        // Milliseconds, whatever precision was sent
+        int digits = 0;
+        for (const char *p = text + consumed + 1; *p >= '0' && *p <= '9'; ++p, ++digits) {
+            if (digits < 3) ms = ms * 10 + (*p - '0');
+        }
+        for (; digits < 3; ++digits) ms *= 10;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return (long long)timegm(&tm) * 1000 + ms;
+}
+
+char *irc_take_tags(char *line, MessageTags *tags) {
+    tags->server_time_ms = 0;
+    tags->batch[0] = 0;
+    if (line[0] != '@') return line;
+    char *end = strchr(line, ' ');
+    if (!end) return line + strlen(line);
+    for (char *tag = line + 1; tag < end;) {
+        size_t len = strcspn(tag, "; ");
+        size_t key_len = strcspn(tag, "=; ");
+        const char *value = tag[key_len] == '=' ? tag + key_len + 1 : "";
+        size_t value_len = tag[key_len] == '=' ? len - key_len - 1 : 0;
+        if (key_len == 4 && strncmp(tag, "time", 4) == 0) {
+            tags->server_time_ms = parse_server_time(value, value_len);
+        } else if (key_len == 5 && strncmp(tag, "batch", 5) == 0 && value_len < sizeof(tags->batch)) {
+            memcpy(tags->batch, value, value_len);
+            tags->batch[value_len] = 0;
+        }
+        tag += len;
+        if (*tag == ';') ++tag;
+    }
+    while (*end == ' ') ++end;
+    return end;
+}
+
+char *names_entry_nick(char *entry) {
+    entry += strspn(entry, "~&@%+");
+    entry[strcspn(entry, "!")] = 0;
+    return entry;
+}
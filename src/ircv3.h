@@ -0,0 +1,46 @@
+// ircv3.h - IRCv3 capability negotiation and message tags
+#ifndef IRCV3_H
+#define IRCV3_H
+
+#include <stddef.h>
+
+#define CAP_SERVER_TIME       0x01
+#define CAP_MESSAGE_TAGS      0x02
+#define CAP_MULTI_PREFIX      0x04
+#define CAP_USERHOST_IN_NAMES 0x08
+#define CAP_EXTENDED_JOIN     0x10
+#define CAP_BATCH             0x20
+
+// Capability negotiation of one registration. Servers without CAP ignore it
+// or answer 421, and registration goes ahead with no capabilities.
+typedef struct {
+    unsigned int offered; // wanted caps listed by CAP LS so far
+    unsigned int enabled; // acknowledged by CAP ACK
+    int done;             // CAP END sent (or CAP unsupported)
+} CapNegotiation;
+
+// "CAP LS 302\r\n", sent ahead of NICK/USER
+const char *cap_start(CapNegotiation *n);
+// Handles a CAP reply (cmd points at "CAP ..."); sends CAP REQ or CAP END on sockfd as due
+void cap_handle_reply(CapNegotiation *n, int sockfd, const char *cmd);
+// Makes n's result this connection's capabilities (after 001), logged by name
+void cap_finish(const CapNegotiation *n);
+// Capabilities of this process's connection
+unsigned int irc_caps(void);
+// "server-time batch ..." for caps, "none" if empty
+void cap_names(unsigned int caps, char *buf, size_t len);
+
+typedef struct {
+    long long server_time_ms; // time= tag, ms since the epoch; 0 if absent
+    char batch[16];           // batch= reference; "" if none
+} MessageTags;
+
+// Parses and skips a leading "@tags " block. Returns the rest of the line
+// (line itself without tags); tags is always filled in.
+char *irc_take_tags(char *line, MessageTags *tags);
+
+// Points past the channel-status prefixes of a NAMES entry ("@+nick" with
+// multi-prefix) and cuts "!user@host" (userhost-in-names) off it in place
+char *names_entry_nick(char *entry);
+
+#endif
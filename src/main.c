@@ -5,6 +5,9 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -20,7 +23,23 @@
 #include "admin.h"
 #include "shared_mem.h"
 #include "utils.h"
+#include "dispatch.h"
+#include "replay.h"
+#include "worker_pool.h"
+#include "connection.h"
+#include "forward_queue.h"
+#include "schedule.h"
+#include "history.h"
+#include "seen.h"
+#include "timer_wheel.h"
+#include "shard.h"
+#include "trace.h"
+#include "pacing.h"
+#include "plugin.h"
+#include "placement.h"
+#include "rehash.h"
 #include <ctype.h>
+#include <limits.h>
 
 volatile sig_atomic_t terminate_flag = 0;
 
@@ -28,6 +47,764 @@ void handle_termination(int sig) {
     terminate_flag = 1;
 }
 
+static TimerWheel dispatcher_timers;
+
+// Periodic snapshot of the shared state (state_file)
+static void sync_state(Timer *timer, void *arg) {
+    const BotConfig *config = arg;
+    shared_state_sync();
+    tw_add(&dispatcher_timers, timer, timer->deadline + config->state_sync * 1000LL);
+}
+
+// Channel children, indexed by shared channel slot
+typedef struct {
+    int *write_fds;  // dispatcher end of each child's pipe (non-blocking), -1 if none
+    int *read_fds;   // dispatcher's copy of each child's read end, to rescue unread lines after a crash
+    pid_t *pids;
+    ForwardQueue *queues; // lines waiting for a child that is behind
+    long long *respawned_ms; // last crash recovery per channel
+    int *rapid_crashes;      // crashes in a row, each within a second of the last recovery
+    int capacity;
+    const BotConfig *config;
+    int sockfd;
+    int control_fd;  // read end of the channel notify pipe, closed in children
+    int announce;    // JOIN channels as they start; the startup set is joined in one burst
+    // Warm spare: a forked handler waiting on its pipe for the slot it takes over
+    pid_t spare_pid; // 0 = none
+    int spare_write, spare_read;
+    int keep_spare;  // process mode only; pool handlers are threads
+} ChildTable;
+
+// A channel whose handler keeps dying right after each recovery is left without one
+#define CRASH_LOOP_LIMIT 5
+// Room for a tagged line: up to 8191 bytes of IRCv3 tags ahead of the line
+#define INBOUND_MAX (8192 + 512)
+// How long a handler waits for room in a full outbound pipe before giving up on a line
+#define OUTBOUND_WAIT_MS 5000
+
+// SIGCHLD only writes to this pipe, which the dispatcher polls, so a dead
+// handler is noticed at once instead of on the next line for its channel
+static int child_exit_pipe[2] = { -1, -1 };
+
+static void note_child_exit(int sig) {
+    int saved = errno;
+    write(child_exit_pipe[1], "", 1);
+    errno = saved;
+}
+
+// Writes out what a slow child's queue holds now that its pipe has room
+static void flush_child_queue(ChildTable *children, int channel_index) {
+    ForwardQueue *q = &children->queues[channel_index];
+    int before = q->count;
+    int left = fq_flush(q, children->write_fds[channel_index]);
+    SharedChannel *slot = shared_channel(channel_index);
+    if (left < 0) {
+        fq_clear(q); // child is gone; it gets reaped
+    } else if (slot) {
+        slot->forwarded += before - left;
+    }
+}
+
+// Forwards a dispatched line to the channel child over its pipe. The pipe is
+// non-blocking: if the child is behind, the line waits in a bounded queue and
+// the configured policy picks what to drop, so one slow child never stalls
+// the dispatcher (and with it PING replies and every other channel).
+static void forward_to_child(int channel_index, const char *line, size_t len, const IrcPrivmsg *pm, void *arg) {
+    ChildTable *children = arg;
+    if (channel_index >= children->capacity || children->write_fds[channel_index] < 0) return;
+    char chunk[1024];
+    if (len > sizeof(chunk) - 2) len = sizeof(chunk) - 2;
+    memcpy(chunk, line, len);
+    memcpy(chunk + len, "\r\n", 2);
+    len += 2;
+    ForwardQueue *q = &children->queues[channel_index];
+    SharedChannel *slot = shared_channel(channel_index);
+    if (q->count == 0) {
+        ssize_t n = write(children->write_fds[channel_index], chunk, len);
+        if (n == (ssize_t)len) {
+            if (slot) slot->forwarded++;
+            return;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return;
+    }
+    int result = fq_push(q, chunk, len, pm ? pm->sender : NULL, children->config->queue_policy);
+    if (!slot) return;
+    if (q->count > slot->queue_peak) slot->queue_peak = q->count;
+    if (result == FQ_COALESCED) {
+        slot->coalesced++;
+    } else if (result != FQ_QUEUED) {
+        slot->dropped++;
+        if (slot->dropped == 1 || slot->dropped % 100 == 0) {
+            log_message("[WARN] Handler for %s is behind, %lu lines dropped so far", slot->name, slot->dropped);
+        }
+    }
+}
+
+static int grow_children(ChildTable *children, int index) {
+    if (index < children->capacity) return 0;
+    int capacity = children->capacity ? children->capacity : 16;
+    while (capacity <= index) capacity *= 2;
+    int *fds = realloc(children->write_fds, capacity * sizeof(*fds));
+    if (!fds) return -1;
+    children->write_fds = fds;
+    int *read_fds = realloc(children->read_fds, capacity * sizeof(*read_fds));
+    if (!read_fds) return -1;
+    children->read_fds = read_fds;
+    pid_t *pids = realloc(children->pids, capacity * sizeof(*pids));
+    if (!pids) return -1;
+    children->pids = pids;
+    ForwardQueue *queues = realloc(children->queues, capacity * sizeof(*queues));
+    if (!queues) return -1;
+    children->queues = queues;
+    long long *respawned = realloc(children->respawned_ms, capacity * sizeof(*respawned));
+    if (!respawned) return -1;
+    children->respawned_ms = respawned;
+    int *rapid = realloc(children->rapid_crashes, capacity * sizeof(*rapid));
+    if (!rapid) return -1;
+    children->rapid_crashes = rapid;
+    for (int i = children->capacity; i < capacity; ++i) {
+        fds[i] = -1;
+        read_fds[i] = -1;
+        pids[i] = 0;
+        fq_init(&queues[i], children->config->queue_limit);
+        respawned[i] = 0;
+        rapid[i] = 0;
+    }
+    children->capacity = capacity;
+    return 0;
+}
+
+// Lines in buf, counting an unterminated tail as one
+static unsigned long count_lines(const char *buf, size_t len) {
+    unsigned long lines = 0;
+    for (size_t i = 0; i < len; ++i) lines += buf[i] == '\n';
+    return lines + (len > 0 && buf[len - 1] != '\n');
+}
+
+// Writes msg to an outbound pipe in pieces of whole lines up to PIPE_BUF,
+// which the pipe takes all or nothing, so lines from different writers never
+// interleave. When the pipe is full a handler waits up to OUTBOUND_WAIT_MS
+// for room (the dispatcher drains it even while reconnecting); a dispatcher
+// never waits. Returns the number of bytes left unwritten.
+static size_t write_outbound(int fd, const char *msg, size_t len) {
+    long long deadline = monotonic_ms() + OUTBOUND_WAIT_MS;
+    while (len > 0) {
+        size_t piece = len;
+        if (piece > PIPE_BUF) {
+            piece = PIPE_BUF;
+            while (piece > 0 && msg[piece - 1] != '\n') --piece;
+            if (piece == 0) piece = PIPE_BUF; // overlong line, cannot be atomic anyway
+        }
+        ssize_t n = write(fd, msg, piece);
+        if (n > 0) {
+            msg += n;
+            len -= n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        long long left = deadline - monotonic_ms();
+        if (n < 0 && errno == EAGAIN && left > 0 && !on_dispatcher_thread()) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            poll(&pfd, 1, (int)left);
+            continue;
+        }
+        break;
+    }
+    return len;
+}
+
+// Children send through this pipe instead of the socket, so the dispatcher
+// can replace the connection under them. With several connections a line
+// for a channel goes to the connection that joined it.
+static void send_via_dispatcher(int sockfd, const char *msg) {
+    size_t len = strlen(msg);
+    size_t left = write_outbound(shard_route_fd(msg), msg, len);
+    if (left > 0) pacing_note_unsent(shard_route(msg), count_lines(msg + len - left, left));
+}
+
+// The dispatcher's hook with several connections: its own lines go straight
+// to the socket (it cannot wait on its own pipe), others to their connection
+static void send_via_owner(int sockfd, const char *msg) {
+    if (shard_route(msg) != shard_index()) {
+        send_via_dispatcher(sockfd, msg);
+        return;
+    }
+    sem_lock();
+    ssize_t n = send(sockfd, msg, strlen(msg), MSG_NOSIGNAL);
+    sem_unlock();
+    TRACE(socket_write, n, trace_now_ns());
+}
+
+// Forwards complete lines the children queued to the socket; with
+// connected == 0 they are discarded (and counted, see pacing_note_unsent).
+// Returns -1 if the socket write failed.
+static int flush_outbound(int read_fd, int sockfd, int connected) {
+    static char pending[8192];
+    static size_t used = 0;
+    int rc = 0;
+    for (;;) {
+        ssize_t n = read(read_fd, pending + used, sizeof(pending) - used);
+        if (n <= 0) break;
+        used += n;
+        // Only whole lines go out; a partial one waits for the rest
+        size_t whole = used;
+        while (whole > 0 && pending[whole - 1] != '\n') --whole;
+        if (whole == 0 && used == sizeof(pending)) whole = used; // overlong, pass through
+        if (whole > 0 && connected && rc == 0) {
+            sem_lock();
+            if (send(sockfd, pending, whole, MSG_NOSIGNAL) < 0) rc = -1;
+            sem_unlock();
+            TRACE(socket_write, whole, trace_now_ns());
+        }
+        if (whole > 0 && (!connected || rc != 0)) pacing_note_unsent(shard_index(), count_lines(pending, whole));
+        memmove(pending, pending + whole, used - whole);
+        used -= whole;
+    }
+    return rc;
+}
+
+// Waits ms milliseconds, or until shutdown, discarding child output meanwhile
+static void backoff_wait(int ms, int outbound_read) {
+    struct pollfd pfd = { outbound_read, POLLIN, 0 };
+    long long end = monotonic_ms() + ms;
+    long long left;
+    while (!terminate_flag && (left = end - monotonic_ms()) > 0) {
+        if (poll(&pfd, 1, (int)left) > 0) flush_outbound(outbound_read, -1, 0);
+    }
+}
+
+// Replaces a dead connection. The new socket is dup2()ed onto the old
+// descriptor, so pool threads and the dispatcher keep using the same fd.
+// Retries with exponential backoff (first retry immediately) until it is
+// registered again (under the nick left in nick) or the bot is shutting down.
+static int reconnect(const BotConfig *config, int sockfd, int outbound_read, char *nick, char *leftover, size_t leftover_len) {
+    int delay_ms = 0;
+    shutdown(sockfd, SHUT_RDWR);
+    while (!terminate_flag) {
+        if (delay_ms > 0) {
+            // Up to 25% jitter so a fleet of bots doesn't reconnect in lockstep
+            int jitter = rand() % (delay_ms / 4 + 1);
+            printf("[MAIN] Reconnecting in %d ms\n", delay_ms + jitter);
+            backoff_wait(delay_ms + jitter, outbound_read);
+            if (terminate_flag) break;
+        }
+        delay_ms = delay_ms ? delay_ms * 2 : 1000;
+        if (delay_ms > config->reconnect_max * 1000) delay_ms = config->reconnect_max * 1000;
+        int fd = irc_connect(config->server, config->port, config->connect_timeout * 1000);
+        if (fd < 0) continue;
+        if (irc_register(fd, config, config->connect_timeout * 1000, nick, MAX_STR, leftover, leftover_len) != 0) {
+            close(fd);
+            continue;
+        }
+        sem_lock();
+        dup2(fd, sockfd);
+        sem_unlock();
+        close(fd);
+        return 0;
+    }
+    return -1;
+}
+
+static void send_join(ChildTable *children, const char *name) {
+    char buffer[MAX_STR + 16];
+    if (!children->announce) return;
+    snprintf(buffer, sizeof(buffer), "JOIN %s\r\n", name);
+    send_irc_message(children->sockfd, buffer);
+}
+
+// Forks a handler reading from fds[0]. channel_index < 0 forks the warm
+// spare, which blocks until the dispatcher writes it the slot to take over.
+// The parent keeps both ends: the write end non-blocking, the read end to
+// rescue what the child leaves unread if it dies. The read end stays
+// blocking, since O_NONBLOCK would apply to the child's copy too (it is
+// the same open file description); see read_waiting.
+static pid_t fork_handler(ChildTable *children, int channel_index, int fds[2]) {
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fflush(stdout); // or the child prints our buffered output again
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child: close every dispatcher end (ours and our siblings'), keep only our read end
+        close(fds[1]);
+        for (int i = 0; i < children->capacity; ++i) {
+            if (children->write_fds[i] >= 0) close(children->write_fds[i]);
+            if (children->read_fds[i] >= 0) close(children->read_fds[i]);
+        }
+        if (children->spare_pid > 0) {
+            close(children->spare_write);
+            close(children->spare_read);
+        }
+        close(children->control_fd);
+        close(child_exit_pipe[0]);
+        close(child_exit_pipe[1]);
+        signal(SIGCHLD, SIG_DFL);
+        set_irc_send_hook(send_via_dispatcher);
+        // In each child process after mapping shared memory:
+        set_shared_admin_auth_ptr(&shared_data->authed_admins);
+        if (channel_index < 0) {
+            // Until it has a channel, the spare just dies with the bot
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGHUP, SIG_DFL);
+            if (read(fds[0], &channel_index, sizeof(channel_index)) != sizeof(channel_index) || terminate_flag) exit(0);
+        }
+        placement_enter_handler(channel_index);
+        irc_channel_loop(children->config, channel_index, children->sockfd, fds[0]);
+        exit(0);
+    } else if (pid > 0) {
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    } else {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+    }
+    return pid;
+}
+
+// Keeps one handler forked ahead of time, so a crashed channel is taken over
+// without paying for a fork (and the page table copy) while lines pile up
+static void fork_spare(ChildTable *children) {
+    int fds[2];
+    if (!children->keep_spare || children->spare_pid > 0 || terminate_flag) return;
+    pid_t pid = fork_handler(children, -1, fds);
+    if (pid <= 0) return;
+    children->spare_pid = pid;
+    children->spare_write = fds[1];
+    children->spare_read = fds[0];
+}
+
+// Forks the handler child for a newly joined channel
+static void start_child(int channel_index, const char *name, void *arg) {
+    ChildTable *children = arg;
+    int fds[2];
+    if (grow_children(children, channel_index) != 0) {
+        perror("realloc");
+        return;
+    }
+    pid_t pid = fork_handler(children, channel_index, fds);
+    if (pid <= 0) return;
+    children->write_fds[channel_index] = fds[1];
+    children->read_fds[channel_index] = fds[0];
+    children->pids[channel_index] = pid;
+    send_join(children, name);
+}
+
+// Parts a channel: the child sees EOF on its pipe and exits
+static void stop_child(int channel_index, const char *name, void *arg) {
+    ChildTable *children = arg;
+    char buffer[MAX_STR + 16];
+    snprintf(buffer, sizeof(buffer), "PART %s\r\n", name);
+    send_irc_message(children->sockfd, buffer);
+    if (channel_index < children->capacity && children->write_fds[channel_index] >= 0) {
+        close(children->write_fds[channel_index]);
+        close(children->read_fds[channel_index]);
+        children->write_fds[channel_index] = -1;
+        children->read_fds[channel_index] = -1;
+        fq_clear(&children->queues[channel_index]);
+    }
+}
+
+// Worker pool mode: handlers are thread contexts, the dispatcher joins for them
+static void start_pool_channel(int channel_index, const char *name, void *arg) {
+    if (worker_pool_add_channel(channel_index, name) != 0) return;
+    send_join(arg, name);
+}
+
+static void stop_pool_channel(int channel_index, const char *name, void *arg) {
+    ChildTable *children = arg;
+    char buffer[MAX_STR + 16];
+    worker_pool_remove_channel(channel_index);
+    snprintf(buffer, sizeof(buffer), "PART %s\r\n", name);
+    send_irc_message(children->sockfd, buffer);
+}
+
+// Reads what is already waiting in a blocking pipe; 0 if it is empty
+static ssize_t read_waiting(int fd, void *buf, size_t len) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)) return 0;
+    return read(fd, buf, len);
+}
+
+// Replaces the handler of a channel that is still joined but whose child
+// died. The warm spare takes the slot if there is one. The lines the dead
+// child never read are rescued from its pipe and handed over ahead of the
+// ones still queued, so the channel loses at most the line it died on.
+static void recover_child(ChildTable *children, int i, int status) {
+    SharedChannel *slot = shared_channel(i);
+    const char *name = slot ? slot->name : "?";
+    char how[32];
+    if (WIFSIGNALED(status)) snprintf(how, sizeof(how), "signal %d", WTERMSIG(status));
+    else snprintf(how, sizeof(how), "exit status %d", WEXITSTATUS(status));
+    if (slot) slot->crashes++;
+
+    // Whole lines only: the dispatcher writes a line at a time (atomically,
+    // under PIPE_BUF), but the child may have read part of the first one
+    static char rescued[60 * 1024]; // fits the replacement's empty pipe
+    ssize_t used = read_waiting(children->read_fds[i], rescued, sizeof(rescued));
+    if (used < 0) used = 0;
+    // Anything beyond the rescue buffer is lost, and counted like queue drops
+    char discard[4096];
+    size_t lost_bytes = 0, lost_lines = 0;
+    ssize_t n;
+    while ((n = read_waiting(children->read_fds[i], discard, sizeof(discard))) > 0) {
+        lost_bytes += n;
+        for (ssize_t k = 0; k < n; ++k) lost_lines += discard[k] == '\n';
+    }
+    if (lost_bytes > 0) {
+        if (slot) slot->dropped += lost_lines;
+        log_message("[WARN] Handler for %s left %zu bytes (%zu lines) unread beyond the %zu-byte rescue buffer; dropped",
+                    name, lost_bytes, lost_lines, sizeof(rescued));
+    }
+    const char *start = rescued, *end = rescued + used;
+    if (used > 0 && rescued[0] != ':') {
+        const char *nl = memchr(rescued, '\n', used);
+        start = nl ? nl + 1 : end;
+    }
+    while (end > start && end[-1] != '\n') --end;
+    close(children->write_fds[i]);
+    close(children->read_fds[i]);
+    children->write_fds[i] = children->read_fds[i] = -1;
+
+    long long now = monotonic_ms();
+    children->rapid_crashes[i] = now - children->respawned_ms[i] < 1000 ? children->rapid_crashes[i] + 1 : 0;
+    children->respawned_ms[i] = now;
+    if (children->rapid_crashes[i] >= CRASH_LOOP_LIMIT) {
+        printf("[SUPERVISOR] Handler for %s keeps crashing (%s), giving up on it\n", name, how);
+        log_message("[ERROR] Handler for %s crashed %d times in a row, not restarting it", name, CRASH_LOOP_LIMIT + 1);
+        fq_clear(&children->queues[i]);
+        return;
+    }
+
+    int fds[2];
+    pid_t pid;
+    const char *via = "warm spare";
+    if (children->spare_pid > 0 && write(children->spare_write, &i, sizeof(i)) == sizeof(i)) {
+        pid = children->spare_pid;
+        fds[0] = children->spare_read;
+        fds[1] = children->spare_write;
+        children->spare_pid = 0;
+    } else {
+        via = "fresh fork";
+        pid = fork_handler(children, i, fds);
+        if (pid <= 0) {
+            log_message("[ERROR] Could not restart the handler for %s", name);
+            fq_clear(&children->queues[i]);
+            return;
+        }
+    }
+    children->write_fds[i] = fds[1];
+    children->read_fds[i] = fds[0];
+    children->pids[i] = pid;
+    size_t handed = 0;
+    for (const char *p = start; p < end; p = memchr(p, '\n', end - p) + 1) handed++;
+    if (end > start && write(fds[1], start, end - start) != end - start && slot) {
+        slot->dropped += handed;
+        handed = 0;
+    }
+    handed += children->queues[i].count;
+    flush_child_queue(children, i);
+    printf("[SUPERVISOR] Handler for %s died (%s), %s took over with %zu pending lines\n", name, how, via, handed);
+    log_message("[WARN] Handler for %s died (%s); restarted from a %s with %zu pending lines", name, how, via, handed);
+}
+
+// Collects exited children without blocking. One whose channel is still
+// joined has crashed and is replaced; the spare is refilled afterwards.
+static void reap_children(ChildTable *children) {
+    pid_t pid;
+    int status;
+    char drain[64];
+    while (read(child_exit_pipe[0], drain, sizeof(drain)) > 0) {}
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == children->spare_pid) {
+            close(children->spare_write);
+            close(children->spare_read);
+            children->spare_pid = 0;
+            continue;
+        }
+        for (int i = 0; i < children->capacity; ++i) {
+            if (children->pids[i] != pid) continue;
+            children->pids[i] = 0;
+            if (children->write_fds[i] >= 0 && !terminate_flag) recover_child(children, i, status);
+            break;
+        }
+    }
+    fork_spare(children);
+}
+
+// Dispatches the whole lines among the used bytes of buffer and keeps a line
+// cut off by the end of a read for the next one
+static void dispatch_lines(Dispatcher *d, char *buffer, size_t *used) {
+    buffer[*used] = 0;
+    char *end = NULL;
+    for (char *p = buffer; (p = strstr(p, "\r\n")) != NULL; p += 2) end = p + 2;
+    if (!end) {
+        if (*used < INBOUND_MAX - 1) return;
+        end = buffer + *used; // overlong line: pass it on as it is
+    }
+    char rest = *end;
+    *end = 0;
+    dispatch_buffer(d, buffer);
+    *end = rest;
+    *used -= end - buffer;
+    memmove(buffer, end, *used + 1);
+}
+
+// Connects, registers and runs the dispatcher loop of this process's
+// connection until shutdown. Returns the exit status.
+static int run_connection(BotConfig *config) {
+    char buffer[INBOUND_MAX];
+    size_t buffered = 0;
+    placement_enter_dispatcher();
+    mark_dispatcher_thread();
+    int sockfd = irc_connect(config->server, config->port, config->connect_timeout * 1000);
+    if (sockfd < 0) {
+        return 1;
+    }
+    // IRC handshake (dispatcher only): handlers start once we are welcomed
+    char leftover[1024], nick[MAX_STR];
+    if (irc_register(sockfd, config, config->connect_timeout * 1000, nick, sizeof(nick), leftover, sizeof(leftover)) != 0) {
+        close(sockfd);
+        return 1;
+    }
+    // Channel table changes are announced on the control pipe so the
+    // dispatcher wakes up to start or stop handlers
+    int control = shard_control_fd();
+    int outbound = shard_outbound_fd();
+    if (shard_count() > 1) {
+        // Handlers of other connections send to our channels through us
+        set_irc_send_hook(send_via_owner);
+    }
+
+    ChildTable children = { NULL, NULL, NULL, NULL, NULL, NULL, 0, config, sockfd, control, 0, 0, -1, -1, 0 };
+    HandlerSet handlers = {0};
+    handler_fn start_handler = start_child, stop_handler = stop_child;
+    Dispatcher dispatcher = { config, sockfd, forward_to_child, &children };
+    if (config->workers > 0) {
+        // Worker pool mode: handlers run as threads in this process
+        if (worker_pool_start(config, sockfd, config->workers) != 0) {
+            fprintf(stderr, "Failed to start worker pool\n");
+            return 1;
+        }
+        start_handler = start_pool_channel;
+        stop_handler = stop_pool_channel;
+        dispatcher.forward = worker_pool_submit;
+    } else if (pipe(child_exit_pipe) == 0) {
+        fcntl(child_exit_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(child_exit_pipe[1], F_SETFL, O_NONBLOCK);
+        signal(SIGCHLD, note_child_exit);
+        children.keep_spare = 1;
+    }
+    // Start a handler for every configured channel, then join them all at once
+    sync_channel_handlers(&handlers, start_handler, stop_handler, &children);
+    send_join_burst(sockfd, config->join_batch);
+    children.announce = 1;
+    fork_spare(&children);
+    buffered = snprintf(buffer, sizeof(buffer), "%s", leftover);
+    dispatch_lines(&dispatcher, buffer, &buffered);
+
+    // Log startup
+    log_message("[INFO] Bot started and configuration loaded.");
+
+    // Dispatcher deadlines: state snapshots, admin sessions, announcements
+    tw_init(&dispatcher_timers, bot_clock_ms());
+    Timer state_timer;
+    timer_init(&state_timer, sync_state, config);
+    if (config->state_file[0] && shard_index() == 0) {
+        tw_add(&dispatcher_timers, &state_timer, bot_clock_ms() + config->state_sync * 1000LL);
+    }
+    set_admin_session_timers(&dispatcher_timers, sockfd);
+    pacing_start_probes(&dispatcher_timers, sockfd);
+    dispatch_set_nick(&dispatcher, &dispatcher_timers, nick);
+    ScheduleSet schedules;
+    schedule_set_init(&schedules, &dispatcher_timers, config, sockfd);
+    sync_schedules(&schedules);
+
+    // Main process: dispatcher loop
+    struct pollfd *fds = NULL;
+    int *fd_channel = NULL; // channel of each child pipe polled for room
+    int fds_cap = 0;
+    while (!terminate_flag) {
+        int timeout = tw_next_timeout(&dispatcher_timers, bot_clock_ms());
+        // Slow children with queued lines are polled for room in their pipe
+        if (fds_cap < 4 + children.capacity) {
+            fds_cap = 4 + children.capacity;
+            fds = realloc(fds, fds_cap * sizeof(*fds));
+            fd_channel = realloc(fd_channel, fds_cap * sizeof(*fd_channel));
+            if (!fds || !fd_channel) break;
+        }
+        int nfds = 4;
+        fds[0] = (struct pollfd){ sockfd, POLLIN, 0 };
+        fds[1] = (struct pollfd){ control, POLLIN, 0 };
+        fds[2] = (struct pollfd){ outbound, POLLIN, 0 };
+        fds[3] = (struct pollfd){ child_exit_pipe[0], POLLIN, 0 }; // -1 (ignored) in pool mode
+        for (int i = 0; i < children.capacity; ++i) {
+            if (children.queues[i].count > 0 && children.write_fds[i] >= 0) {
+                fd_channel[nfds] = i;
+                fds[nfds++] = (struct pollfd){ children.write_fds[i], POLLOUT, 0 };
+            }
+        }
+        if (poll(fds, nfds, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        tw_advance(&dispatcher_timers, bot_clock_ms());
+        int lost = 0;
+        if (fds[3].revents & POLLIN) {
+            reap_children(&children);
+        }
+        for (int i = 4; i < nfds; ++i) {
+            if (fds[i].revents && children.write_fds[fd_channel[i]] >= 0) flush_child_queue(&children, fd_channel[i]);
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(control, drain, sizeof(drain)) > 0) {}
+            sync_channel_handlers(&handlers, start_handler, stop_handler, &children);
+            sync_schedules(&schedules);
+            rehash_check();
+        }
+        if (fds[2].revents & POLLIN) {
+            lost = flush_outbound(outbound, sockfd, 1) != 0;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // Read from IRC socket
+            int n = recv(sockfd, buffer + buffered, sizeof(buffer) - 1 - buffered, 0);
+            if (n <= 0) {
+                lost = 1;
+            } else {
+                buffered += n;
+                dispatch_lines(&dispatcher, buffer, &buffered);
+            }
+        }
+        if (lost) {
+            printf("[MAIN] Connection to server lost\n");
+            log_message("[WARN] Connection to server lost");
+            dispatch_reset(&dispatcher); // its batches end with the connection
+            if (config->reconnect_max <= 0) break;
+            // Handlers and shared state stay up; only the socket is replaced
+            if (reconnect(config, sockfd, outbound, nick, leftover, sizeof(leftover)) != 0) break;
+            send_join_burst(sockfd, config->join_batch);
+            pacing_start_probes(&dispatcher_timers, sockfd); // the old connection's probe is void
+            dispatch_set_nick(&dispatcher, &dispatcher_timers, nick); // our ghost may hold the old one
+            log_message("[INFO] Reconnected and rejoined channels");
+            buffered = snprintf(buffer, sizeof(buffer), "%s", leftover);
+            dispatch_lines(&dispatcher, buffer, &buffered);
+        }
+        reap_children(&children);
+    }
+    if (config->workers > 0) {
+        worker_pool_stop();
+        send_irc_message(sockfd, "QUIT :Bot logging off\r\n");
+    }
+    // On termination, signal all children to stop; the spare sees EOF
+    signal(SIGCHLD, SIG_DFL);
+    if (children.spare_pid > 0) {
+        close(children.spare_write);
+        close(children.spare_read);
+        waitpid(children.spare_pid, NULL, 0);
+    }
+    for (int i = 0; i < children.capacity; ++i) {
+        if (children.pids[i] > 0) {
+            kill(children.pids[i], SIGTERM);
+        }
+    }
+    // Wait for all children to exit
+    for (int i = 0; i < children.capacity; ++i) {
+        if (children.pids[i] > 0) {
+            waitpid(children.pids[i], NULL, 0);
+        }
+    }
+    // Pass on what the children said on their way out (their QUIT)
+    flush_outbound(outbound, sockfd, 1);
+    free_handler_set(&handlers);
+    free_schedule_set(&schedules);
+    for (int i = 0; i < children.capacity; ++i) {
+        fq_clear(&children.queues[i]);
+        if (children.read_fds[i] >= 0) close(children.read_fds[i]);
+    }
+    free(children.write_fds);
+    free(children.read_fds);
+    free(children.pids);
+    free(children.queues);
+    free(children.respawned_ms);
+    free(children.rapid_crashes);
+    free(fds);
+    free(fd_channel);
+    dispatch_reset(&dispatcher);
+    log_message("[INFO] Bot shutting down.");
+    return 0;
+}
+
+static void wake_supervisor(int sig) {
+    (void)sig;
+}
+
+// Runs connections > 1: one dispatcher process per connection, each with its
+// own nick, socket, PING handling, outbound pipe and handlers for its share
+// of the channels. Waits until they all exit, or stops them on shutdown.
+static int run_shards(BotConfig *config) {
+    pid_t pids[MAX_SHARDS] = {0};
+    int running = 0;
+    char base[MAX_STR];
+    snprintf(base, sizeof(base), "%s", config->nickname);
+    // Signals stay blocked outside sigsuspend, so none is lost between checks
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGQUIT);
+    sigaddset(&block, SIGHUP);
+    signal(SIGCHLD, wake_supervisor);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    fflush(stdout);
+    for (int i = 0; i < shard_count(); ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            shard_select(i);
+            shard_nick(base, i, config->nickname, sizeof(config->nickname));
+            printf("[MAIN] Connection %d as %s\n", i, config->nickname);
+            fflush(stdout);
+            exit(run_connection(config));
+        } else if (pid > 0) {
+            pids[i] = pid;
+            running++;
+        } else {
+            perror("fork");
+        }
+    }
+    int failed = 0;
+    while (running > 0) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < shard_count(); ++i) {
+                if (pids[i] != pid) continue;
+                pids[i] = 0;
+                running--;
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+                if (!terminate_flag) {
+                    log_message("[WARN] Connection %d exited; its channels are not served", i);
+                }
+            }
+        }
+        if (running == 0) break;
+        if (terminate_flag) {
+            for (int i = 0; i < shard_count(); ++i) {
+                if (pids[i] > 0) kill(pids[i], SIGTERM);
+            }
+        }
+        sigsuspend(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return failed;
+}
+
 int main(int argc, char *argv[]) {
     // Register signal handlers for graceful shutdown
     signal(SIGINT, handle_termination);   // Ctrl+C
@@ -37,14 +814,36 @@ int main(int argc, char *argv[]) {
 #ifdef SIGTSTP
     signal(SIGTSTP, handle_termination);  // Ctrl+Z (if available)
 #endif
+    signal(SIGPIPE, SIG_IGN);             // a dropped connection is handled, not fatal
+    // Parse command line: optional -c <config path>, -r <traffic> -o <output> for replay
+    const char *config_path = "config/bot.conf";
+    const char *replay_path = NULL;
+    const char *replay_out = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            config_path = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            replay_out = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [-c config] [-r traffic -o output]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (replay_out && !replay_path) {
+        fprintf(stderr, "-o requires -r\n");
+        return 1;
+    }
     // Load configuration
     BotConfig config;
-    if (load_config("config/bot.conf", &config) != 0) {
+    if (load_config(config_path, &config) != 0) {
         fprintf(stderr, "Failed to load config\n");
         return 1;
     }
     // Set log file path from config
     set_logfile_path(config.logfile);
+    set_log_level(config.log_level);
 
     // Load narratives
     trim_whitespace(config.narratives_path);
@@ -53,218 +852,73 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Setup shared memory, semaphores, etc.
+    // Setup shared memory, semaphores, etc. A replay always starts from empty state.
+    if (!replay_path) {
+        set_shared_state_path(config.state_file);
+        // Before the shared memory, which may prefer the dispatcher's NUMA node
+        if (placement_init(&config) != 0) {
+            fprintf(stderr, "Failed to set up CPU placement\n");
+            return 1;
+        }
+    }
     if (init_shared_resources() != 0) {
         fprintf(stderr, "Failed to initialize shared resources\n");
         return 1;
     }
+    // Configured channels seed the shared channel table; !join/!part edit it later.
+    // Channels restored from a snapshot are kept, so runtime joins survive restarts.
+    for (int i = 0; i < config.channel_count; ++i) {
+        if (shared_channel_add(config.channels[i]) < 0) {
+            fprintf(stderr, "Failed to add channel %s\n", config.channels[i]);
+            return 1;
+        }
+    }
     // After initializing shared resources in main.c:
     set_shared_admin_auth_ptr(&shared_data->authed_admins);
-
-    // Main process: connect to IRC server first
-    int sockfd;
-    struct sockaddr_in serv_addr;
-    char buffer[512];
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("ERROR opening socket");
+    if (history_init(config.history_lines) != 0) {
+        fprintf(stderr, "Failed to set up message history\n");
         return 1;
     }
-    memset((char *)&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    trim_whitespace(config.server);
-    char server_addr[256];
-    strncpy(server_addr, config.server, sizeof(server_addr)-1);
-    server_addr[sizeof(server_addr)-1] = '\0';
-    char *start = server_addr;
-    while (*start == ' ' || *start == '\t' || *start == '\n' || *start == '\r') ++start;
-    char *end = start + strlen(start) - 1;
-    while (end > start && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) {
-        *end = '\0';
-        --end;
-    }
-    if (inet_aton(start, &serv_addr.sin_addr)) {
-        // Parsed as IP
-    } else {
-        struct hostent *server = gethostbyname(start);
-        if (server == NULL) {
-            fprintf(stderr, "ERROR, no such host: %s\n", start);
-            return 1;
-        }
-        memcpy((char *)&serv_addr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
+    if (seen_init(config.seen_capacity) != 0) {
+        fprintf(stderr, "Failed to set up the seen table\n");
+        return 1;
     }
-    serv_addr.sin_port = htons(config.port);
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("ERROR connecting");
+    trim_whitespace(config.plugin_dir);
+    if (plugin_init(config.plugin_dir, config.plugin_budget_ms) != 0) {
+        fprintf(stderr, "Failed to set up plugins\n");
         return 1;
     }
-    // IRC handshake (main process only)
-    snprintf(buffer, sizeof(buffer), "NICK %s\r\n", config.nickname);
-    send(sockfd, buffer, strlen(buffer), 0);
-    snprintf(buffer, sizeof(buffer), "USER %s 0 * :%s\r\n", config.nickname, config.nickname);
-    send(sockfd, buffer, strlen(buffer), 0);
-    // Create pipes for communication with each child
-    int pipes[MAX_CHANNELS][2];
-    pid_t child_pids[MAX_CHANNELS] = {0};
-    for (int i = 0; i < config.channel_count; ++i) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            return 1;
-        }
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Child: close write end, pass read end to irc_channel_loop
-            close(pipes[i][1]);
-            // In each child process after mapping shared memory:
-            set_shared_admin_auth_ptr(&shared_data->authed_admins);
-            irc_channel_loop(&config, i, sockfd, pipes[i][0]);
-            exit(0);
-        } else if (pid > 0) {
-            // Parent: close read end
-            close(pipes[i][0]);
-            child_pids[i] = pid;
-        }
+    if (rehash_init(&config, config_path) != 0) {
+        fprintf(stderr, "Failed to set up !rehash\n");
+        return 1;
     }
 
-    // Log startup
-    log_message("[INFO] Bot started and configuration loaded.");
-
-    // Main process: dispatcher loop
-    while (!terminate_flag) {
-        // Read from IRC socket
-        int n = recv(sockfd, buffer, sizeof(buffer)-1, 0);
-        if (n <= 0) break;
-        buffer[n] = 0;
-        // Print all server messages for debug
-        printf("[IRC] %s", buffer);
-        log_message("[IRC] %s", buffer); // Log all IRC server messages
-        fflush(stdout);
-        // Respond to PING
-        if (strncmp(buffer, "PING", 4) == 0) {
-            char pong[512];
-            snprintf(pong, sizeof(pong), "PONG%s\r\n", buffer+4);
-            send_irc_message(sockfd, pong);
-            printf("[MAIN] %s\n", pong);
-            log_message("[MAIN] PONG %s\n", pong);
-            continue;
-        }
-        // Parse PRIVMSG and forward to correct child
-        char *line = buffer;
-        while (line && *line) {
-            char *next = strstr(line, "\r\n");
-            if (next) { *next = 0; next += 2; }
-            char *privmsg = strstr(line, "PRIVMSG ");
-            if (privmsg) {
-                // Extract sender nick (from prefix)
-                char sender[64] = "";
-                if (line[0] == ':') {
-                    const char *bang = strchr(line, '!');
-                    size_t len = bang ? (size_t)(bang - line - 1) : strlen(line+1);
-                    if (len >= sizeof(sender)) len = sizeof(sender)-1;
-                    strncpy(sender, line+1, len);
-                    sender[len] = 0;
-                }
-                // Prevent bot-to-bot loops: ignore nicks starting with 'b' and 9 alphanum
-                if (strlen(sender) == 9 && sender[0] == 'b') {
-                    int botnick = 1;
-                    for (int i = 0; i < 9; ++i) {
-                        if (!isalnum(sender[i])) { botnick = 0; break; }
-                    }
-                    if (botnick) {
-                        printf("[MAIN] Ignoring bot nick: %s\n", sender);
-                        log_message("[MAIN] Ignoring bot nick: %s", sender);
-                        fflush(stdout);
-                        line = next;
-                        continue;
-                    }
-                }
-                // Ignore messages from self
-                if (strcasecmp(sender, config.nickname) == 0) {
-                    printf("[MAIN] Ignoring self message from: %s\n", sender);
-                    log_message("[MAIN] Ignoring self message from: %s", sender);
-                    fflush(stdout);
-                    line = next;
-                    continue;
-                }
-                char *target = privmsg + 8;
-                char *space = strchr(target, ' ');
-                if (!space) { line = next; continue; }
-                // Use a temporary buffer for the channel name
-                char chan_name[256];
-                size_t chan_len = space - target;
-                if (chan_len >= sizeof(chan_name)) chan_len = sizeof(chan_name) - 1;
-                strncpy(chan_name, target, chan_len);
-                chan_name[chan_len] = '\0';
-                // Only forward if there is a colon (:) after the channel (i.e., a message)
-                char *msg_colon = strchr(space+1, ':');
-                if (!msg_colon) { line = next; continue; }
-                char *msg = msg_colon + 1;
-                // Normalize channel name to lowercase for comparison
-                char target_lc[256], chan_lc[256];
-                snprintf(target_lc, sizeof(target_lc), "%s", chan_name);
-                for (char *p = target_lc; *p; ++p) *p = tolower(*p);
-
-                // Handle private messages to the bot, currently just for auth
-                if (strcasecmp(target_lc, config.nickname) == 0 && strncmp(msg, "!auth ", 6) == 0) {
-                    try_admin_auth(sender, msg+6, &config, sockfd);
-                    line = next; continue;
-                }
-                // Forward all other PRIVMSGs to the correct child
-                for (int i = 0; i < config.channel_count; ++i) {
-                    snprintf(chan_lc, sizeof(chan_lc), "%s", config.channels[i]);
-                    for (char *p = chan_lc; *p; ++p) *p = tolower(*p);
-                    if (strcmp(target_lc, chan_lc) == 0) {
-                        // Forward the full IRC line to the child, ensure \r\n ending
-                        log_message("[FORWARD] Forwarding message from '%s' to channel '%s'", sender, chan_lc);
-                        write(pipes[i][1], line, strlen(line));
-                        write(pipes[i][1], "\r\n", 2);
-                        break;
-                    }
-                }
-            }
-            line = next;
-        }
-        // Parse NAMES reply (353) and forward to correct child
-        if (strstr(buffer, " 353 ")) {
-            char *chan_start = strchr(buffer, '#');
-            if (chan_start) {
-                char chan_name[256];
-                int i = 0;
-                while (chan_start[i] && chan_start[i] != ' ' && chan_start[i] != '\r' && chan_start[i] != '\n' && i < 255) {
-                    chan_name[i] = chan_start[i];
-                    i++;
-                }
-                chan_name[i] = 0;
-                // Find which channel index this is
-                int chan_idx = -1;
-                for (int c = 0; c < config.channel_count; ++c) {
-                    if (strcasecmp(chan_name, config.channels[c]) == 0) {
-                        chan_idx = c;
-                        break;
-                    }
-                }
-                if (chan_idx != -1) {
-                    // Forward the full NAMES reply to the correct child
-                    write(pipes[chan_idx][1], buffer, strlen(buffer));
-                    write(pipes[chan_idx][1], "\r\n", 2);
-                }
-            }
-        }
+    // Offline replay: run dispatcher and handlers in-process on a virtual clock
+    if (replay_path) {
+        int rc = run_replay(&config, replay_path, replay_out);
+        plugin_cleanup();
+        seen_cleanup();
+        history_cleanup();
+        cleanup_shared_resources();
+        free_config(&config);
+        return rc;
     }
-    // On termination, signal all children to stop
-    for (int i = 0; i < config.channel_count; ++i) {
-        if (child_pids[i] > 0) {
-            kill(child_pids[i], SIGTERM);
-        }
+
+    trim_whitespace(config.server);
+    if (pacing_init(config.target_lag) != 0) {
+        fprintf(stderr, "Failed to set up send pacing\n");
+        return 1;
     }
-    // Wait for all children to exit
-    for (int i = 0; i < config.channel_count; ++i) {
-        if (child_pids[i] > 0) {
-            waitpid(child_pids[i], NULL, 0);
-        }
+    if (shard_setup(config.connections) != 0) {
+        fprintf(stderr, "Failed to set up connections\n");
+        return 1;
     }
-    log_message("[INFO] Bot shutting down.");
+    int rc = config.connections > 1 ? run_shards(&config) : run_connection(&config);
+    pacing_cleanup();
+    plugin_cleanup();
+    seen_cleanup();
+    history_cleanup();
     cleanup_shared_resources();
-    return 0;
+    free_config(&config);
+    return rc;
 }
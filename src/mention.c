@@ -5,12 +5,27 @@
 #include <time.h>
 #include "irc_client.h"
 #include "utils.h"
+#include "shared_mem.h"
+#include "seen.h"
+#include "trace.h"
+#include "ircv3.h"
 
-static char last_requested_user[9] = "";
-static time_t last_request_time = 0;
-static char last_request_sender[64] = "";
+static void expire_mention(Timer *timer, void *arg) {
+    struct MentionRequest *pending = arg;
+    pending->user[0] = 0;
+    pending->sender[0] = 0;
+}
+
+void mention_request_init(struct MentionRequest *pending) {
+    memset(pending, 0, sizeof(*pending));
+    timer_init(&pending->expiry, expire_mention, pending);
+}
 
-void handle_user_mentions(const BotConfig *config, int channel_index, int sockfd, const char *msg, const char *sender) {
+void handle_user_mentions(const BotConfig *config, int channel_index, int sockfd, const char *msg, const char *sender, struct MentionRequest *pending, TimerWheel *timers) {
+    SharedChannel *slot = shared_channel(channel_index);
+    if (!slot) return;
+    char channel[MAX_STR];
+    snprintf(channel, sizeof(channel), "%s", slot->name);
     for (const char *p = msg; *p; ++p) {
         if (strlen(p) < 8) break;
         int is_user = 1;
@@ -26,32 +41,48 @@ void handle_user_mentions(const BotConfig *config, int channel_index, int sockfd
             char user[9];
             strncpy(user, p, 8); user[8] = 0;
             if (strcasecmp(sender, user) == 0) continue;
-            printf("[DEBUG] Username mention detected: '%s' by '%s' in %s\n", user, sender, config->channels[channel_index]);
+            printf("[DEBUG] Username mention detected: '%s' by '%s' in %s\n", user, sender, channel);
+            TRACE(mention, channel_index, 0, trace_now_ns());
+            // Last seen talking in or joining this channel: present, no need to ask the server
+            SeenInfo seen;
+            if (seen_lookup(user, &seen) && (seen.kind == SEEN_MESSAGE || seen.kind == SEEN_JOIN) && strcasecmp(seen.where, channel) == 0) {
+                printf("[DEBUG] %s is known to be in %s, skipping NAMES\n", user, channel);
+                continue;
+            }
             char names_cmd[256];
-            snprintf(names_cmd, sizeof(names_cmd), "NAMES %s\r\n", config->channels[channel_index]);
+            snprintf(names_cmd, sizeof(names_cmd), "NAMES %s\r\n", channel);
             send_irc_message(sockfd, names_cmd);
-            strncpy(last_requested_user, user, 9);
-            last_requested_user[8] = 0;
-            last_request_time = time(NULL);
-            strncpy(last_request_sender, sender, sizeof(last_request_sender)-1);
-            last_request_sender[sizeof(last_request_sender)-1] = 0;
-            printf("[DEBUG] Requested NAMES for %s to check if %s is present\n", config->channels[channel_index], user);
+            strncpy(pending->user, user, 9);
+            pending->user[8] = 0;
+            pending->request_time = bot_time();
+            strncpy(pending->sender, sender, sizeof(pending->sender)-1);
+            pending->sender[sizeof(pending->sender)-1] = 0;
+            snprintf(pending->channel, sizeof(pending->channel), "%s", channel);
+            tw_add(timers, &pending->expiry, bot_clock_ms() + MENTION_TIMEOUT_MS);
+            printf("[DEBUG] Requested NAMES for %s to check if %s is present\n", channel, user);
         }
     }
 }
 
 void handle_channel_mentions(const BotConfig *config, int channel_index, int sockfd, const char *msg, const char *sender) {
-    for (int i = 0; i < config->channel_count; ++i) {
+    SharedChannel *own = shared_channel(channel_index);
+    if (!own) return;
+    const char *own_name = own->name;
+    int count = shared_channel_count();
+    for (int i = 0; i < count; ++i) {
         if (i == channel_index) continue;
-        const char *chan_name = config->channels[i];
+        SharedChannel *slot = shared_channel(i);
+        if (!slot || !slot->active) continue;
+        const char *chan_name = slot->name;
         size_t chan_len = strlen(chan_name);
         const char *p = msg;
         while ((p = strcasestr(p, chan_name)) != NULL) {
             int start_ok = (p == msg) || !isalnum((unsigned char)*(p-1));
             int end_ok = !isalnum((unsigned char)*(p+chan_len));
             if (start_ok && end_ok) {
+                TRACE(mention, channel_index, 1, trace_now_ns());
                 char alert[512];
-                snprintf(alert, sizeof(alert), "PRIVMSG %s :[ALERT] %s mentioned this channel (%s) in %s\r\n", chan_name, sender, chan_name, config->channels[channel_index]);
+                snprintf(alert, sizeof(alert), "PRIVMSG %s :[ALERT] %s mentioned this channel (%s) in %s\r\n", chan_name, sender, chan_name, own_name);
                 send_irc_message(sockfd, alert);
                 break; // Only alert once per channel per message
             }
@@ -60,28 +91,29 @@ void handle_channel_mentions(const BotConfig *config, int channel_index, int soc
     }
 }
 
-void handle_names_reply(const char *line, int channel_index, int sockfd) {
+void handle_names_reply(const char *line, int channel_index, int sockfd, struct MentionRequest *pending, TimerWheel *timers) {
     char *last_chan_start = strchr(line, '#');
     char *last_colon = strrchr(line, ':');
     if (last_chan_start && last_colon && last_colon > last_chan_start) {
         char users[512];
         strncpy(users, last_colon + 1, sizeof(users) - 1);
         users[sizeof(users) - 1] = 0;
-        char *tok = strtok(users, " ");
+        char *save = NULL;
+        char *tok = strtok_r(users, " ", &save);
         char last_found_user[16];
         int user_found = 0;
         // Check if the last requested user is in the NAMES reply
         while (tok) {
-            if (strcasecmp(tok, last_requested_user) == 0) {
+            if (strcasecmp(names_entry_nick(tok), pending->user) == 0) {
                 user_found = 1;
                 strncpy(last_found_user, tok, sizeof(last_found_user)-1);
                 last_found_user[sizeof(last_found_user)-1] = 0;
                 break;
             }
-            tok = strtok(NULL, " ");
+            tok = strtok_r(NULL, " ", &save);
         }
-        // If user not found and request is recent, send alert
-        if (!user_found && last_requested_user[0] && (time(NULL) - last_request_time) < 5) {
+        // If user not found and the request has not expired, send alert
+        if (!user_found && pending->user[0]) {
             // Extract only the channel name (up to first space or end)
             char channel_name[128] = "";
             size_t i = 0;
@@ -91,11 +123,12 @@ void handle_names_reply(const char *line, int channel_index, int sockfd) {
             }
             channel_name[i] = 0;
             char privmsg[512];
-            snprintf(privmsg, sizeof(privmsg), "PRIVMSG %s :[ALERT] %s mentioned you in %s.\r\n", last_requested_user, last_request_sender, channel_name);
+            snprintf(privmsg, sizeof(privmsg), "PRIVMSG %s :[ALERT] %s mentioned you in %s.\r\n", pending->user, pending->sender, channel_name);
             send_irc_message(sockfd, privmsg);
-            printf("[CHILD %d] Sent alert to %s (not present in %s)\n", channel_index, last_requested_user, channel_name);
-            last_requested_user[0] = 0;
-            last_request_sender[0] = 0;
+            printf("[CHILD %d] Sent alert to %s (not present in %s)\n", channel_index, pending->user, channel_name);
+            pending->user[0] = 0;
+            pending->sender[0] = 0;
+            tw_cancel(timers, &pending->expiry);
         }
     }
 }
@@ -2,24 +2,32 @@
 #define MENTION_H
 
 #include <time.h>
-#include "irc_client.h"
+#include "config.h"
+#include "timer_wheel.h"
 
 #define MAX_PENDING_MENTIONS 8
+#define MENTION_TIMEOUT_MS 5000 // how long a NAMES reply may take to count
 
 struct MentionRequest {
     char user[9];      // username in ABCD1234 format
     char sender[64];   // who mentioned
     char channel[128]; // channel name
     time_t request_time;
+    Timer expiry;      // clears the request once the NAMES reply is too late
 };
 
-// Called to check and handle user mentions in a message
-void handle_user_mentions(const BotConfig *config, int channel_index, int sockfd, const char *msg, const char *sender);
+// Prepares pending for use with handle_user_mentions
+void mention_request_init(struct MentionRequest *pending);
+
+
+// Called to check and handle user mentions in a message; the latest mention is
+// kept in pending until its NAMES reply arrives or its timer on timers expires
+void handle_user_mentions(const BotConfig *config, int channel_index, int sockfd, const char *msg, const char *sender, struct MentionRequest *pending, TimerWheel *timers);
 
 // Called to check and handle channel mentions in a message
 void handle_channel_mentions(const BotConfig *config, int channel_index, int sockfd, const char *msg, const char *sender);
 
 // Called to handle NAMES reply for user mention alerts
-void handle_names_reply(const char *line, int channel_index, int sockfd);
+void handle_names_reply(const char *line, int channel_index, int sockfd, struct MentionRequest *pending, TimerWheel *timers);
 
 #endif // MENTION_H
@@ -1,13 +1,128 @@
 // narrative.c - Stub for narrative catalogue
 #include "narrative.h"
 #include "utils.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NARRATIVE_REPLAY_SEED 0x6e61727261746976ull // alternative picks in replays
+
+static const struct {
+    const char *name;
+    size_t len;
+    unsigned char kind;
+} template_vars[] = {
+    { "$nick", 5, SEG_NICK },
+    { "$channel", 8, SEG_CHANNEL },
+    { "$topic", 6, SEG_TOPIC },
+    { "$time", 5, SEG_TIME },
+};
+
+static void add_segment(NarrativeEntry *e, unsigned char kind, size_t off, size_t len) {
+    if (kind == SEG_TEXT && len == 0) return;
+    // Merge adjacent text, e.g. around a $$ escape
+    TemplateSegment *last = e->segment_count ? &e->segments[e->segment_count - 1] : NULL;
+    if (kind == SEG_TEXT && last && last->kind == SEG_TEXT && last->off + last->len == off) {
+        last->len += len;
+        return;
+    }
+    e->segments[e->segment_count].kind = kind;
+    e->segments[e->segment_count].off = off;
+    e->segments[e->segment_count].len = len;
+    e->segment_count++;
+}
+
+// Splits the response into text and variable segments once, at load time.
+// "$$" becomes "$" (the escape is removed from the stored response).
+static void compile_template(NarrativeEntry *e) {
+    char *r = e->response;
+    size_t text_start = 0, i = 0;
+    e->segment_count = 0;
+    while (r[i]) {
+        // Keep one segment spare for the trailing text
+        if (r[i] != '$' || e->segment_count >= MAX_TEMPLATE_SEGMENTS - 2) { ++i; continue; }
+        if (r[i + 1] == '$') {
+            add_segment(e, SEG_TEXT, text_start, i + 1 - text_start);
+            memmove(r + i + 1, r + i + 2, strlen(r + i + 2) + 1);
+            text_start = ++i;
+            continue;
+        }
+        size_t v;
+        for (v = 0; v < sizeof(template_vars) / sizeof(template_vars[0]); ++v) {
+            const char *name = template_vars[v].name;
+            size_t len = template_vars[v].len;
+            if (strncmp(r + i, name, len) == 0 && !isalnum((unsigned char)r[i + len]) && r[i + len] != '_') break;
+        }
+        if (v == sizeof(template_vars) / sizeof(template_vars[0])) { ++i; continue; }
+        add_segment(e, SEG_TEXT, text_start, i - text_start);
+        add_segment(e, template_vars[v].kind, 0, 0);
+        i += template_vars[v].len;
+        text_start = i;
+    }
+    add_segment(e, SEG_TEXT, text_start, i - text_start);
+}
 
 NarrativeEntry narratives[MAX_NARRATIVES];
 int narrative_count = 0;
+// Bumped by every load, which voids every cached lookup
+static unsigned int narrative_generation = 1;
+
+static int same_trigger(const NarrativeEntry *a, const NarrativeEntry *b) {
+    return strcasecmp(a->channel, b->channel) == 0 && strcasecmp(a->trigger, b->trigger) == 0;
+}
+
+// Walker's alias method (Vose's construction): every column gets an equal
+// share of the total weight, made up of its own weight topped up from one
+// heavier alternative, so a pick is one random column and one comparison
+static void build_alias_table(NarrativeEntry *group, int n) {
+    double scaled[MAX_NARRATIVES], total = 0;
+    int small[MAX_NARRATIVES], large[MAX_NARRATIVES];
+    int small_count = 0, large_count = 0;
+    for (int i = 0; i < n; ++i) total += group[i].weight;
+    for (int i = 0; i < n; ++i) {
+        scaled[i] = group[i].weight * n / total;
+        group[i].alias = i;
+        group[i].alias_threshold = UINT32_MAX;
+        if (scaled[i] < 1.0) small[small_count++] = i;
+        else large[large_count++] = i;
+    }
+    while (small_count > 0 && large_count > 0) {
+        int s = small[--small_count], l = large[--large_count];
+        group[s].alias_threshold = (uint32_t)(scaled[s] * 4294967296.0);
+        group[s].alias = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) small[small_count++] = l;
+        else large[large_count++] = l;
+    }
+    // Whatever is left holds (up to rounding) exactly one share
+}
+
+// Moves the alternatives of each channel/trigger pair next to the first of
+// them, keeping the order triggers first appear in (which decides matching),
+// and builds each group's alias table
+static void group_alternatives(void) {
+    static NarrativeEntry sorted[MAX_NARRATIVES];
+    char taken[MAX_NARRATIVES] = {0};
+    int n = 0;
+    for (int i = 0; i < narrative_count; ++i) {
+        if (taken[i]) continue;
+        int first = n;
+        for (int j = i; j < narrative_count; ++j) {
+            if (taken[j] || !same_trigger(&narratives[i], &narratives[j])) continue;
+            taken[j] = 1;
+            sorted[n++] = narratives[j];
+        }
+        sorted[first].alternatives = n - first;
+        for (int j = first + 1; j < n; ++j) sorted[j].alternatives = 0;
+        build_alias_table(&sorted[first], n - first);
+    }
+    memcpy(narratives, sorted, narrative_count * sizeof(NarrativeEntry));
+}
 
 // Loads narratives from a text file: channel|trigger|response per line
 int load_narratives(const char *filename) {
@@ -30,7 +145,7 @@ int load_narratives(const char *filename) {
         perror("[ERROR] fopen");
         return -1;
     }
-    char line[1024];
+    char line[2048];
     narrative_count = 0;
     while (fgets(line, sizeof(line), f)) {
         if (narrative_count >= MAX_NARRATIVES) break;
@@ -40,35 +155,195 @@ int load_narratives(const char *filename) {
         // Skip blank lines and true comments (lines starting with # and no '|')
         if (line[0] == 0) continue;
         if (line[0] == '#' && strchr(line, '|') == NULL) continue;
-        // Parse: channel|trigger|response
+        // Parse: channel|trigger|response or channel|trigger|w=<weight>|response
         char *chan = strtok(line, "|");
         char *trigger = strtok(NULL, "|");
         char *response = strtok(NULL, ""); // rest of line
         if (!chan || !trigger || !response) continue;
-        strncpy(narratives[narrative_count].channel, chan, sizeof(narratives[narrative_count].channel)-1);
-        narratives[narrative_count].channel[sizeof(narratives[narrative_count].channel)-1] = 0;
-        strncpy(narratives[narrative_count].trigger, trigger, sizeof(narratives[narrative_count].trigger)-1);
-        narratives[narrative_count].trigger[sizeof(narratives[narrative_count].trigger)-1] = 0;
-        strncpy(narratives[narrative_count].response, response, sizeof(narratives[narrative_count].response)-1);
-        narratives[narrative_count].response[sizeof(narratives[narrative_count].response)-1] = 0;
+        NarrativeEntry *e = &narratives[narrative_count];
+        e->weight = 1;
+        // Only with the w= marker, so no plain response changes meaning
+        size_t digits = strncmp(response, "w=", 2) == 0 ? strspn(response + 2, "0123456789") : 0;
+        if (digits > 0 && digits < 10 && response[digits + 2] == '|' && response[digits + 3]) {
+            e->weight = strtoul(response + 2, NULL, 10);
+            if (e->weight == 0) continue; // weight 0 switches the alternative off
+            response += digits + 3;
+        }
+        strncpy(e->channel, chan, sizeof(e->channel)-1);
+        e->channel[sizeof(e->channel)-1] = 0;
+        strncpy(e->trigger, trigger, sizeof(e->trigger)-1);
+        e->trigger[sizeof(e->trigger)-1] = 0;
+        strncpy(e->response, response, sizeof(e->response)-1);
+        e->response[sizeof(e->response)-1] = 0;
+        compile_template(e);
         narrative_count++;
     }
     fclose(f);
+    group_alternatives();
+    narrative_generation++;
     return 0;
 }
 
-// Looks up a response for a given channel and message
-const char* get_narrative_response(const char* channel, const char* msg) {
-    for (int i = 0; i < narrative_count; ++i) {
+const NarrativeEntry *find_narrative(const char *channel, const char *msg) {
+    for (int i = 0; i < narrative_count; i += narratives[i].alternatives) {
         if (strcasecmp(channel, narratives[i].channel) == 0) {
             if (strcmp(narratives[i].trigger, "*") == 0) {
                 // wildcard, always match
-                return narratives[i].response;
+                TRACE(narrative, 1, trace_now_ns());
+                return &narratives[i];
             }
             if (strcasestr(msg, narratives[i].trigger) != NULL) {
-                return narratives[i].response;
+                TRACE(narrative, 1, trace_now_ns());
+                return &narratives[i];
             }
         }
     }
+    TRACE(narrative, 0, trace_now_ns());
     return NULL;
 }
+
+void narrative_cache_init(NarrativeCache *cache, int size) {
+    if (size > NARRATIVE_CACHE_MAX) size = NARRATIVE_CACHE_MAX;
+    cache->size = 0;
+    if (size > 0) {
+        cache->size = 1;
+        while (cache->size * 2 <= size) cache->size *= 2;
+    }
+    cache->generation = narrative_generation;
+    for (int i = 0; i < NARRATIVE_CACHE_MAX; ++i) cache->slots[i].text[0] = 0;
+}
+
+int find_narrative_cached(NarrativeCache *cache, const char *channel, const char *msg, const NarrativeEntry **match) {
+    // Matching is case-insensitive, so the folded message decides the result
+    char folded[NARRATIVE_CACHE_TEXT];
+    uint32_t h = 2166136261u;
+    size_t len = 0;
+    for (; msg[len] && len < sizeof(folded) - 1; ++len) {
+        folded[len] = tolower((unsigned char)msg[len]);
+        h = (h ^ (unsigned char)folded[len]) * 16777619u;
+    }
+    if (cache->size == 0 || msg[len] || len == 0) {
+        *match = find_narrative(channel, msg);
+        return 0;
+    }
+    folded[len] = 0;
+    if (cache->generation != narrative_generation) narrative_cache_init(cache, cache->size);
+    NarrativeCacheSlot *slot = &cache->slots[h & (cache->size - 1)];
+    if (strcmp(slot->text, folded) == 0) {
+        TRACE(narrative, slot->entry >= 0, trace_now_ns());
+        *match = slot->entry >= 0 ? &narratives[slot->entry] : NULL;
+        return 1;
+    }
+    *match = find_narrative(channel, msg);
+    memcpy(slot->text, folded, len + 1);
+    slot->entry = *match ? *match - narratives : -1;
+    return 0;
+}
+
+// Looks up a response for a given channel and message
+const char* get_narrative_response(const char* channel, const char* msg) {
+    const NarrativeEntry *entry = find_narrative(channel, msg);
+    return entry ? pick_narrative(entry, NULL)->response : NULL;
+}
+
+// First state of stream's xorshift64*: a splitmix64 of the stream and a seed
+// that is fixed under the virtual clock (replays) and differs per run otherwise
+static uint64_t stream_seed(int stream) {
+    uint64_t seed = virtual_clock_enabled() ? NARRATIVE_REPLAY_SEED : ((uint64_t)monotonic_ms() << 20) ^ (uint64_t)getpid();
+    uint64_t z = seed + (uint64_t)(stream + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+static const NarrativeEntry *draw(const NarrativeEntry *first, int n, uint64_t *state) {
+    uint64_t r = next_random(state);
+    uint32_t column = (uint32_t)(((r >> 32) * (uint64_t)n) >> 32);
+    const NarrativeEntry *e = &first[column];
+    return (uint32_t)r < e->alias_threshold ? e : &first[e->alias];
+}
+
+static int given_recently(const NarrativeRecent *recent, int window, int index) {
+    for (int k = 1; k <= window; ++k) {
+        if (recent->recent[(recent->next - k + MAX_NO_REPEAT) % MAX_NO_REPEAT] == index) return 1;
+    }
+    return 0;
+}
+
+const NarrativeEntry *pick_narrative(const NarrativeEntry *match, NarrativeRecent *recent) {
+    int n = match->alternatives;
+    if (n <= 1) return match;
+    // Without a channel's state, one stream per thread
+    static __thread uint64_t unowned = 0;
+    if (!recent && unowned == 0) unowned = stream_seed(-1);
+    uint64_t *state = recent ? &recent->random : &unowned;
+    const NarrativeEntry *pick = draw(match, n, state);
+    if (recent && recent->window > 0) {
+        // The window can only hold back all but one alternative
+        int window = recent->window < n - 1 ? recent->window : n - 1;
+        // Redraw a few times, which keeps the weights among what is left;
+        // if that keeps failing take the first alternative not given lately
+        for (int tries = 0; given_recently(recent, window, pick - narratives) && tries < 8; ++tries) {
+            pick = draw(match, n, state);
+        }
+        for (int i = 0; i < n && given_recently(recent, window, pick - narratives); ++i) pick = &match[i];
+        recent->recent[recent->next] = pick - narratives;
+        recent->next = (recent->next + 1) % MAX_NO_REPEAT;
+    }
+    return pick;
+}
+
+void narrative_recent_init(NarrativeRecent *recent, int window, int channel_index) {
+    recent->window = window < MAX_NO_REPEAT ? window : MAX_NO_REPEAT;
+    recent->next = 0;
+    recent->random = stream_seed(channel_index);
+    for (int i = 0; i < MAX_NO_REPEAT; ++i) recent->recent[i] = -1;
+}
+
+static size_t append(char *out, size_t pos, size_t cap, const char *src, size_t len) {
+    if (pos + len > cap - 1) len = cap - 1 - pos;
+    memcpy(out + pos, src, len);
+    return pos + len;
+}
+
+size_t render_response(const NarrativeEntry *entry, const TemplateVars *vars, char *out, size_t cap) {
+    size_t pos = 0;
+    if (cap == 0) return 0;
+    for (int i = 0; i < entry->segment_count && pos < cap - 1; ++i) {
+        const TemplateSegment *seg = &entry->segments[i];
+        const char *value = NULL;
+        switch (seg->kind) {
+        case SEG_TEXT:
+            pos = append(out, pos, cap, entry->response + seg->off, seg->len);
+            continue;
+        case SEG_NICK: value = vars->nick; break;
+        case SEG_CHANNEL: value = vars->channel; break;
+        case SEG_TOPIC: value = vars->topic; break;
+        case SEG_TIME: {
+            // Formatted once a minute per thread; localtime_r is the slow part
+            static __thread time_t clock_minute = -1;
+            static __thread char clock[8];
+            time_t now = bot_time();
+            if (now / 60 != clock_minute) {
+                struct tm tm;
+                localtime_r(&now, &tm);
+                strftime(clock, sizeof(clock), "%H:%M", &tm);
+                clock_minute = now / 60;
+            }
+            value = clock;
+            break;
+        }
+        }
+        if (value) pos = append(out, pos, cap, value, strlen(value));
+    }
+    out[pos] = 0;
+    return pos;
+}
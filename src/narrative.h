@@ -2,21 +2,94 @@
 #ifndef NARRATIVE_H
 #define NARRATIVE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define MAX_NARRATIVES 256
+#define MAX_TEMPLATE_SEGMENTS 24
+#define MAX_NO_REPEAT 16
+#define NARRATIVE_CACHE_MAX 256 // slots per channel
+#define NARRATIVE_CACHE_TEXT 48 // longer messages bypass the cache
+
+// Pieces of a compiled response: literal text is a slice of the response,
+// the others are filled in per reply
+enum { SEG_TEXT, SEG_NICK, SEG_CHANNEL, SEG_TOPIC, SEG_TIME };
+
+typedef struct {
+    unsigned char kind;
+    unsigned short off, len; // slice of response for SEG_TEXT
+} TemplateSegment;
 
 typedef struct {
     char channel[64];
     char trigger[128];
-    char response[512];
+    char response[1024];
+    TemplateSegment segments[MAX_TEMPLATE_SEGMENTS];
+    int segment_count;
+    // Lines with the same channel and trigger are alternatives of one
+    // response, stored next to each other in the order they were loaded
+    unsigned int weight;
+    int alternatives;          // on the first of them: how many there are
+    uint32_t alias_threshold;  // Walker alias table column for this entry:
+    unsigned short alias;      // keep it below the threshold, else take first + alias
 } NarrativeEntry;
 
+// The responses a channel gave last, so alternatives are not repeated
+typedef struct {
+    int window;                  // 0 = repeats allowed
+    short recent[MAX_NO_REPEAT]; // narratives[] indexes, newest at next - 1
+    int next;
+    uint64_t random;             // this channel's stream of picks
+} NarrativeRecent;
+
+// Lookups of one channel's recent messages: the case-folded message and the
+// trigger it matched, or that it matched none. Direct-mapped; a colliding
+// message replaces the older one. Emptied when the catalogue is reloaded.
+typedef struct {
+    char text[NARRATIVE_CACHE_TEXT]; // "" = empty slot
+    short entry;                     // narratives[] index, -1 = no trigger matches
+} NarrativeCacheSlot;
+
+typedef struct {
+    int size;                  // slots in use, a power of two; 0 = off
+    unsigned int generation;   // catalogue the slots were filled from
+    NarrativeCacheSlot slots[NARRATIVE_CACHE_MAX];
+} NarrativeCache;
+
+// Values substituted for $nick, $channel, $topic and $time ($$ is a literal $)
+typedef struct {
+    const char *nick;
+    const char *channel;
+    const char *topic;
+} TemplateVars;
+
 extern NarrativeEntry narratives[MAX_NARRATIVES];
 extern int narrative_count;
 
-// Loads narratives from a JSON file
+// Loads narratives from a text file: channel|trigger|response per line, or
+// channel|trigger|w=<weight>|response to make one alternative more likely
 int load_narratives(const char *filename);
 
-// Looks up a response for a given channel and message
+// Looks up a response for a given channel and message, picking among the
+// trigger's alternatives at random
 const char* get_narrative_response(const char* channel, const char* msg);
+// Returns the first entry of the trigger that matches, NULL if none
+const NarrativeEntry *find_narrative(const char *channel, const char *msg);
+// Sets up a cache of size slots (rounded down to a power of two, at most
+// NARRATIVE_CACHE_MAX; 0 turns it off)
+void narrative_cache_init(NarrativeCache *cache, int size);
+// find_narrative for a channel whose messages all go through cache. Stores
+// the result in *match and returns 1 if it came from the cache.
+int find_narrative_cached(NarrativeCache *cache, const char *channel, const char *msg, const NarrativeEntry **match);
+// Picks one of match's alternatives by weight in O(1). With recent, avoids
+// the responses given within its window (as far as the trigger has enough
+// alternatives) and records the pick.
+const NarrativeEntry *pick_narrative(const NarrativeEntry *match, NarrativeRecent *recent);
+// Starts recent with its own random stream, one per channel index: fixed
+// under the virtual clock, so a replay picks the same alternatives every run
+void narrative_recent_init(NarrativeRecent *recent, int window, int channel_index);
+// Renders the entry's template into out (at most cap-1 bytes, NUL-terminated);
+// returns the rendered length
+size_t render_response(const NarrativeEntry *entry, const TemplateVars *vars, char *out, size_t cap);
 
 #endif // NARRATIVE_H
@@ -0,0 +1,96 @@
+// outbound.c - Splitting logical replies into protocol-sized lines
+#include "outbound.h"
+#include "irc_client.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+
+// The server prepends ":nick!user@host " to what we send. We don't know our
+// user@host, so reserve the usual limits: 10 for the ident, 63 for the host.
+#define USERHOST_RESERVE (1 + 10 + 1 + 63)
+
+void batch_init(LineBatch *b) {
+    b->count = 0;
+    b->used = 0;
+    b->truncated = 0;
+}
+
+size_t irc_max_text(const char *bot_nick, size_t prefix_len) {
+    size_t overhead = 1 + strlen(bot_nick) + USERHOST_RESERVE + 1 + prefix_len + 2;
+    return overhead < IRC_LINE_MAX - 16 ? IRC_LINE_MAX - overhead : 16;
+}
+
+// Length of the next piece of text (at most max bytes) and, via skip, where
+// the piece after it starts
+static size_t next_piece(const char *text, size_t len, size_t max, size_t *skip) {
+    const char *nl = memchr(text, '\n', len < max + 1 ? len : max + 1);
+    if (nl) {
+        size_t n = nl - text;
+        *skip = n + 1;
+        if (n > 0 && text[n - 1] == '\r') --n;
+        return n;
+    }
+    if (len <= max) {
+        *skip = len;
+        return len;
+    }
+    // Break after the last space that fits, unless that leaves a tiny piece
+    size_t cut = max;
+    while (cut > max / 2 && text[cut] != ' ') --cut;
+    if (text[cut] == ' ') {
+        size_t end = cut;
+        while (end > 0 && text[end - 1] == ' ') --end;
+        while (cut < len && text[cut] == ' ') ++cut;
+        *skip = cut;
+        return end;
+    }
+    // No space: cut before a UTF-8 continuation byte never splits a character
+    cut = max;
+    while (cut > 0 && ((unsigned char)text[cut] & 0xC0) == 0x80) --cut;
+    if (cut == 0) cut = max;
+    *skip = cut;
+    return cut;
+}
+
+int batch_add_text(LineBatch *b, const char *bot_nick, const char *prefix, size_t prefix_len, const char *text, size_t text_len) {
+    size_t max = irc_max_text(bot_nick, prefix_len);
+    int added = 0;
+    while (text_len > 0) {
+        if (b->count == MAX_BATCH_LINES || b->used + prefix_len + max + 2 > sizeof(b->buf)) {
+            b->truncated = 1;
+            break;
+        }
+        size_t skip;
+        size_t n = next_piece(text, text_len, max, &skip);
+        char *line = b->buf + b->used;
+        memcpy(line, prefix, prefix_len);
+        memcpy(line + prefix_len, text, n);
+        memcpy(line + prefix_len + n, "\r\n", 2);
+        size_t line_len = prefix_len + n + 2;
+        // A stray \r would end the line early on the server
+        for (size_t i = prefix_len; i < prefix_len + n; ++i) {
+            if (line[i] == '\r') line[i] = ' ';
+        }
+        b->iov[b->count].iov_base = line;
+        b->iov[b->count].iov_len = line_len;
+        b->count++;
+        b->used += line_len;
+        added++;
+        text += skip;
+        text_len -= skip;
+        // Blank lines can't be sent; skip the separators between pieces
+        while (text_len > 0 && (*text == '\n' || *text == '\r')) { ++text; --text_len; }
+    }
+    return added;
+}
+
+void send_privmsg(int sockfd, const char *bot_nick, const char *target, const char *text) {
+    static __thread LineBatch batch;
+    char prefix[IRC_LINE_MAX];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "PRIVMSG %s :", target);
+    if (prefix_len <= 0 || prefix_len >= IRC_LINE_MAX / 2) return;
+    batch_init(&batch);
+    batch_add_text(&batch, bot_nick, prefix, prefix_len, text, strlen(text));
+    if (batch.truncated) log_message("[WARN] Reply to %s was too long and got cut after %d lines", target, batch.count);
+    send_irc_lines(sockfd, batch.iov, batch.count);
+}
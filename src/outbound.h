@@ -0,0 +1,34 @@
+// outbound.h - Splitting logical replies into protocol-sized lines
+#ifndef OUTBOUND_H
+#define OUTBOUND_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define IRC_LINE_MAX 512
+#define MAX_BATCH_LINES 8 // 8 full lines fit PIPE_BUF, so a batch stays atomic
+
+// Lines of one logical reply, sent together
+typedef struct {
+    char buf[MAX_BATCH_LINES * IRC_LINE_MAX];
+    struct iovec iov[MAX_BATCH_LINES];
+    int count;
+    size_t used;
+    int truncated; // text did not fit in MAX_BATCH_LINES lines
+} LineBatch;
+
+void batch_init(LineBatch *b);
+
+// Longest message text that still fits in 512 bytes once the server relays
+// it as ":nick!user@host <prefix><text>\r\n"
+size_t irc_max_text(const char *bot_nick, size_t prefix_len);
+
+// Appends text as one or more "<prefix><piece>\r\n" lines. Pieces break at
+// newlines, else at the last space that fits, else at a UTF-8 character
+// boundary; no piece is longer than irc_max_text. Returns lines added.
+int batch_add_text(LineBatch *b, const char *bot_nick, const char *prefix, size_t prefix_len, const char *text, size_t text_len);
+
+// Splits and sends one PRIVMSG to target as a single batch
+void send_privmsg(int sockfd, const char *bot_nick, const char *target, const char *text);
+
+#endif
@@ -0,0 +1,226 @@
+// pacing.c - Outbound rate of each connection, adapted to the server's lag
+//
+// Every sender of a connection (channel children, pool threads, the
+// dispatcher) books its lines in one shared schedule, a GCRA: lines are
+// spaced interval_us apart, with up to PACING_BURST sent back to back after
+// a quiet spell. The dispatcher PINGs the server every LAG_PROBE_MS and
+// times the PONG. Lag over target doubles the interval; lag under half the
+// target shortens it by a quarter. Server flood warnings double it too, so
+// the rate backs off before the server resorts to "Excess Flood".
+//
+// With IRCv3 server-time, every tagged line also tells how long it took to
+// reach us. Clocks differ, so only the delay over the smallest one seen counts
+// ("inbound" in !stats); it shows a backlog on the way in, which PINGs queued
+// behind our own lines cannot, and is reported rather than steering the rate.
+#define _GNU_SOURCE
+#include "pacing.h"
+#include "shard.h"
+#include "shared_mem.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+
+typedef struct {
+    long long tat_us;        // when the schedule is free again (monotonic us)
+    int interval_us;         // current spacing between lines
+    int lag_ms;              // last round trip of a probe, -1 = none yet
+    int lag_avg_ms;          // smoothed over the last few probes
+    long long probe_sent_ms; // probe awaiting its PONG, 0 = none
+    unsigned int penalties;
+    long long delay_base_ms; // smallest wall clock minus server-time seen, 0 = none
+    int inbound_ms;          // smoothed delay of tagged lines over the base
+    unsigned long unsent;    // lines handlers gave up on (see pacing_note_unsent)
+} ConnPacing;
+
+static ConnPacing *conns = NULL;
+static int target_lag = 1000;
+static TimerWheel *probe_wheel = NULL;
+static int probe_sockfd = -1;
+static Timer probe_timer;
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int pacing_init(int target_lag_ms) {
+    void *p = mmap(NULL, MAX_SHARDS * sizeof(ConnPacing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap pacing");
+        return -1;
+    }
+    conns = p;
+    target_lag = target_lag_ms;
+    for (int i = 0; i < MAX_SHARDS; ++i) {
+        conns[i].interval_us = PACING_START_US;
+        conns[i].lag_ms = -1;
+    }
+    return 0;
+}
+
+void pacing_set_target(int target_lag_ms) {
+    target_lag = target_lag_ms;
+}
+
+void pacing_cleanup(void) {
+    if (conns) munmap(conns, MAX_SHARDS * sizeof(ConnPacing));
+    conns = NULL;
+}
+
+void pacing_after_send(int lines) {
+    if (!conns) {
+        bot_sleep_us(100000UL * lines);
+        return;
+    }
+    ConnPacing *c = &conns[shard_index()];
+    long long now = now_us();
+    long long spacing = (long long)__atomic_load_n(&c->interval_us, __ATOMIC_RELAXED);
+    long long tat = __atomic_load_n(&c->tat_us, __ATOMIC_RELAXED), next;
+    do {
+        next = (tat > now ? tat : now) + spacing * lines;
+    } while (!__atomic_compare_exchange_n(&c->tat_us, &tat, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    // Wait until the schedule could take another line. The dispatcher only
+    // books its lines (PONGs, JOINs, auth replies): it has to keep reading
+    // the socket, and the handlers wait out the room it took instead.
+    long long wait = next - now - spacing * PACING_BURST;
+    if (wait > 0 && !on_dispatcher_thread()) bot_sleep_us((unsigned long)wait);
+}
+
+static void set_interval(ConnPacing *c, long long interval) {
+    if (interval < PACING_MIN_US) interval = PACING_MIN_US;
+    if (interval > PACING_MAX_US) interval = PACING_MAX_US;
+    __atomic_store_n(&c->interval_us, (int)interval, __ATOMIC_RELAXED);
+}
+
+static void record_lag(ConnPacing *c, int lag) {
+    c->lag_ms = lag;
+    c->lag_avg_ms = c->lag_avg_ms ? (c->lag_avg_ms * 3 + lag) / 4 : lag;
+    int interval = c->interval_us;
+    if (lag > target_lag) {
+        set_interval(c, interval * 2LL);
+        log_message("[PACING] Lag %d ms over target, %d ms between lines", lag, c->interval_us / 1000);
+    } else if (lag < target_lag / 2) {
+        set_interval(c, interval - interval / 4);
+    }
+}
+
+static void send_probe(Timer *timer, void *arg) {
+    ConnPacing *c = &conns[shard_index()];
+    long long now = monotonic_ms();
+    // An unanswered probe means the lag is at least its age
+    if (c->probe_sent_ms && now - c->probe_sent_ms > target_lag) record_lag(c, (int)(now - c->probe_sent_ms));
+    if (!c->probe_sent_ms || now - c->probe_sent_ms > LAG_PROBE_MS * 4) {
+        char ping[64];
+        int n = snprintf(ping, sizeof(ping), "PING :lag%lld\r\n", now);
+        // Straight to the socket: a probe queued behind our own lines would time them, not the server
+        sem_lock();
+        send(probe_sockfd, ping, n, MSG_NOSIGNAL);
+        sem_unlock();
+        c->probe_sent_ms = now;
+    }
+    tw_add(probe_wheel, timer, timer->deadline + LAG_PROBE_MS);
+}
+
+void pacing_start_probes(TimerWheel *timers, int sockfd) {
+    if (!conns) return;
+    if (probe_wheel) tw_cancel(probe_wheel, &probe_timer);
+    probe_wheel = timers;
+    probe_sockfd = sockfd;
+    conns[shard_index()].probe_sent_ms = 0;
+    conns[shard_index()].delay_base_ms = 0; // a new server may keep another clock
+    conns[shard_index()].inbound_ms = 0;
+    timer_init(&probe_timer, send_probe, NULL);
+    tw_add(timers, &probe_timer, bot_clock_ms() + 1000); // a first sample soon after connecting
+}
+
+// 1 if line is a numeric or server notice that means we are sending too fast
+static int is_penalty(const char *line, const char *cmd) {
+    // Users (nick!user@host) cannot slow us down with a NOTICE saying "flood"
+    if (line[0] == ':' && memchr(line, '!', cmd - line)) return 0;
+    if (strncmp(cmd, "263 ", 4) == 0 || strncmp(cmd, "439 ", 4) == 0) return 1;
+    if (strncmp(cmd, "NOTICE ", 7) == 0 || strncmp(line, "ERROR ", 6) == 0) {
+        return strcasestr(line, "flood") != NULL || strcasestr(line, "throttl") != NULL;
+    }
+    return 0;
+}
+
+int pacing_server_line(const char *line) {
+    if (!conns) return 0;
+    ConnPacing *c = &conns[shard_index()];
+    const char *cmd = line;
+    if (*cmd == ':') {
+        cmd = strchr(cmd, ' ');
+        if (!cmd) return 0;
+        ++cmd;
+    }
+    if (strncmp(cmd, "PONG ", 5) == 0) {
+        const char *token = strstr(cmd, "lag");
+        if (!token) return 0;
+        long long sent = atoll(token + 3);
+        if (sent == c->probe_sent_ms) {
+            c->probe_sent_ms = 0;
+            record_lag(c, (int)(monotonic_ms() - sent));
+        }
+        return 1;
+    }
+    if (is_penalty(line, cmd)) {
+        c->penalties++;
+        set_interval(c, c->interval_us * 2LL);
+        printf("[PACING] Flood penalty from server, %d ms between lines\n", c->interval_us / 1000);
+        log_message("[PACING] Flood penalty from server (%s), %d ms between lines", line, c->interval_us / 1000);
+    }
+    return 0;
+}
+
+void pacing_server_time(long long server_ms) {
+    if (!conns || server_ms <= 0) return;
+    ConnPacing *c = &conns[shard_index()];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long delay = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 - server_ms;
+    // Offset so a base of 0 means none, whichever way the clocks are skewed
+    long long shifted = delay + (1LL << 40);
+    if (!c->delay_base_ms || shifted < c->delay_base_ms) c->delay_base_ms = shifted;
+    int over = (int)(shifted - c->delay_base_ms);
+    c->inbound_ms = (c->inbound_ms * 7 + over) / 8;
+}
+
+void pacing_note_unsent(int index, unsigned long lines) {
+    if (!conns || index < 0 || index >= MAX_SHARDS || lines == 0) return;
+    unsigned long total = __atomic_add_fetch(&conns[index].unsent, lines, __ATOMIC_RELAXED);
+    // The first time, then every 100 lines
+    if (total == lines || total / 100 != (total - lines) / 100) {
+        log_message("[WARN] Connection %d dropped outbound lines, %lu so far", index, total);
+    }
+}
+
+unsigned long pacing_unsent(int index) {
+    if (!conns || index < 0 || index >= MAX_SHARDS) return 0;
+    return __atomic_load_n(&conns[index].unsent, __ATOMIC_RELAXED);
+}
+
+void pacing_describe(int index, char *buf, size_t len) {
+    if (!conns || index < 0 || index >= MAX_SHARDS) {
+        snprintf(buf, len, "fixed 10 lines/s");
+        return;
+    }
+    const ConnPacing *c = &conns[index];
+    if (c->lag_ms < 0) {
+        snprintf(buf, len, "lag not measured yet, %.1f lines/s, %u penalties", 1e6 / c->interval_us, c->penalties);
+    } else {
+        snprintf(buf, len, "lag %d ms (avg %d ms), %.1f lines/s, %u penalties", c->lag_ms, c->lag_avg_ms, 1e6 / c->interval_us, c->penalties);
+    }
+    if (c->delay_base_ms) {
+        size_t used = strlen(buf);
+        snprintf(buf + used, len - used, ", inbound +%d ms", c->inbound_ms);
+    }
+    if (c->unsent) {
+        size_t used = strlen(buf);
+        snprintf(buf + used, len - used, ", %lu lines dropped", c->unsent);
+    }
+}
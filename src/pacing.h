@@ -0,0 +1,44 @@
+// pacing.h - Outbound rate of each connection, adapted to the server's lag
+#ifndef PACING_H
+#define PACING_H
+
+#include <stddef.h>
+#include "timer_wheel.h"
+
+#define PACING_START_US 100000 // spacing between lines before the first lag sample
+#define PACING_MIN_US 20000
+#define PACING_MAX_US 4000000
+#define PACING_BURST 5          // lines an idle connection may send back to back
+#define LAG_PROBE_MS 5000       // between our PINGs
+
+// Sets up shared pacing state for every connection (see shard.h), aiming to
+// keep the measured lag under target_lag_ms. Call before handlers are forked;
+// until then (and in replays) every line is followed by a fixed 100 ms pause.
+int pacing_init(int target_lag_ms);
+// Changes the lag aimed for from the next probe on (!rehash)
+void pacing_set_target(int target_lag_ms);
+void pacing_cleanup(void);
+// Called after lines were sent on this process's connection: reserves their
+// slots in the connection-wide schedule and sleeps while it is booked up,
+// except on the dispatcher thread, which never sleeps here
+void pacing_after_send(int lines);
+// Sends a timestamped PING on sockfd every LAG_PROBE_MS from the dispatcher's
+// timers; call again after a reconnect
+void pacing_start_probes(TimerWheel *timers, int sockfd);
+// Feeds one server line to the controller: PONGs to our probes give the lag,
+// flood notices and numerics (263, 439, Excess Flood) are penalties that
+// halve the rate. Returns 1 if the line was a reply to a probe.
+int pacing_server_line(const char *line);
+// Feeds the server-time of a received line (ms since the epoch); the delay
+// over the quickest line seen is averaged as the inbound backlog
+void pacing_server_time(long long server_ms);
+// Counts lines for connection index that never reached its socket: the
+// outbound pipe stayed full, or the connection was down. Logs a WARN the
+// first time and then every 100 lines.
+void pacing_note_unsent(int index, unsigned long lines);
+unsigned long pacing_unsent(int index);
+// "lag 12 ms (avg 10 ms), 9.5 lines/s, 0 penalties", plus ", inbound +3 ms" with server-time
+// and ", 4 lines dropped" once any were, for connection index
+void pacing_describe(int index, char *buf, size_t len);
+
+#endif
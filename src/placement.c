@@ -0,0 +1,238 @@
+// placement.c - CPU affinity, scheduling and NUMA placement of the bot
+//
+// The dispatcher answers PINGs and forwards every line, so jitter there is
+// felt by every channel. It can be pinned to its own CPUs and run under
+// SCHED_FIFO (with SCHED_RESET_ON_FORK, so handlers forked from it do not
+// inherit the policy) or with a lower nice value. Handlers, whether child
+// processes or pool threads, move to their own CPU set and drop back to
+// normal scheduling. Placement problems (no CAP_SYS_NICE, an offline CPU)
+// are logged and the bot runs on as placed.
+#define _GNU_SOURCE
+#include "placement.h"
+#include "utils.h"
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static cpu_set_t startup_cpus;    // where the bot was allowed to run
+static cpu_set_t dispatcher_cpus, handler_cpus;
+static int dispatcher_pinned = 0, handlers_pinned = 0, handler_spread = 0;
+static int fifo_priority = 0;
+static int dispatcher_nice = 0, startup_nice = 0;
+static int memory_node = -1;      // preferred for shared memory, -1 = none
+static const char *memory_note = "default placement";
+
+// "0-3,8,10-11" into set; -1 if malformed or out of range
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) return -1;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1) return -1;
+            p = end;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, set);
+        while (*p == ' ') ++p;
+        if (*p == ',') ++p;
+        else if (*p) return -1;
+        while (*p == ' ') ++p;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static void format_cpu_list(const cpu_set_t *set, char *buf, size_t len) {
+    size_t used = 0;
+    buf[0] = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && used < len; ++cpu) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) ++last;
+        if (last == cpu) used += snprintf(buf + used, len - used, "%s%d", used ? "," : "", cpu);
+        else used += snprintf(buf + used, len - used, "%s%d-%d", used ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+// Checks a configured CPU list against the CPUs the bot may use
+static int load_cpu_list(const char *name, const char *list, cpu_set_t *set) {
+    if (parse_cpu_list(list, set) != 0) {
+        fprintf(stderr, "Invalid %s: %s (expected e.g. 0-3,6)\n", name, list);
+        return -1;
+    }
+    cpu_set_t usable;
+    CPU_AND(&usable, set, &startup_cpus);
+    if (CPU_COUNT(&usable) == 0) {
+        fprintf(stderr, "None of %s (%s) is available to the bot\n", name, list);
+        return -1;
+    }
+    if (!CPU_EQUAL(&usable, set)) {
+        char kept[128];
+        format_cpu_list(&usable, kept, sizeof(kept));
+        log_message("[WARN] Some of %s (%s) are not available; using %s", name, list, kept);
+        *set = usable;
+    }
+    return 0;
+}
+
+// NUMA node of cpu from sysfs, -1 if unknown
+static int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && node < 0) {
+        if (strncmp(entry->d_name, "node", 4) == 0) node = atoi(entry->d_name + 4);
+    }
+    closedir(dir);
+    return node;
+}
+
+static int node_count(void) {
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir) return 1;
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') count++;
+    }
+    closedir(dir);
+    return count > 0 ? count : 1;
+}
+
+static long set_mempolicy_node(int mode, int node) {
+    unsigned long mask[16] = {0};
+    if (node >= 0) {
+        if (node >= (int)(sizeof(mask) * 8)) return -1;
+        mask[node / (8 * sizeof(mask[0]))] |= 1UL << (node % (8 * sizeof(mask[0])));
+    }
+    return syscall(SYS_set_mempolicy, mode, node >= 0 ? mask : NULL, node >= 0 ? sizeof(mask) * 8 : 0);
+}
+
+// Prefers the node of the dispatcher CPUs for memory set up from now on
+static void place_memory(void) {
+    int node = -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &dispatcher_cpus)) continue;
+        int n = cpu_node(cpu);
+        if (n < 0 || (node >= 0 && n != node)) {
+            memory_note = "default placement (dispatcher CPUs span NUMA nodes)";
+            return;
+        }
+        node = n;
+    }
+    if (node_count() < 2) {
+        memory_note = "default placement (one NUMA node)";
+        return;
+    }
+    if (set_mempolicy_node(MPOL_PREFERRED, node) != 0) {
+        log_message("[WARN] Cannot prefer NUMA node %d for shared memory: %s", node, strerror(errno));
+        return;
+    }
+    memory_node = node;
+}
+
+int placement_init(const BotConfig *config) {
+    if (sched_getaffinity(0, sizeof(startup_cpus), &startup_cpus) != 0) {
+        CPU_ZERO(&startup_cpus);
+        for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; ++cpu) CPU_SET(cpu, &startup_cpus);
+    }
+    errno = 0;
+    startup_nice = getpriority(PRIO_PROCESS, 0);
+    if (errno) startup_nice = 0;
+    fifo_priority = config->dispatcher_fifo;
+    dispatcher_nice = config->dispatcher_nice;
+    handler_spread = config->handler_spread;
+    if (config->dispatcher_cpus[0]) {
+        if (load_cpu_list("dispatcher_cpus", config->dispatcher_cpus, &dispatcher_cpus) != 0) return -1;
+        dispatcher_pinned = 1;
+        place_memory();
+    }
+    if (config->handler_cpus[0]) {
+        if (load_cpu_list("handler_cpus", config->handler_cpus, &handler_cpus) != 0) return -1;
+        handlers_pinned = 1;
+    }
+    return 0;
+}
+
+static void report(void) {
+    char cpus[128], policy[64], handler_list[128], handlers[160];
+    cpu_set_t now;
+    if (sched_getaffinity(0, sizeof(now), &now) == 0) format_cpu_list(&now, cpus, sizeof(cpus));
+    else snprintf(cpus, sizeof(cpus), "unknown");
+    int sched = sched_getscheduler(0) & ~SCHED_RESET_ON_FORK;
+    if (sched == SCHED_FIFO) {
+        struct sched_param sp;
+        sched_getparam(0, &sp);
+        snprintf(policy, sizeof(policy), "SCHED_FIFO %d", sp.sched_priority);
+    } else {
+        snprintf(policy, sizeof(policy), "nice %d", getpriority(PRIO_PROCESS, 0));
+    }
+    if (handlers_pinned) {
+        format_cpu_list(&handler_cpus, handler_list, sizeof(handler_list));
+        snprintf(handlers, sizeof(handlers), "CPUs %s%s", handler_list, handler_spread ? ", one each" : "");
+    } else {
+        snprintf(handlers, sizeof(handlers), "any CPU");
+    }
+    char memory[64];
+    if (memory_node >= 0) snprintf(memory, sizeof(memory), "NUMA node %d", memory_node);
+    else snprintf(memory, sizeof(memory), "%s", memory_note);
+    printf("[PLACEMENT] Dispatcher %d on CPUs %s, %s; handlers on %s; shared memory: %s\n", (int)getpid(), cpus, policy, handlers, memory);
+    log_message("[PLACEMENT] Dispatcher %d on CPUs %s, %s; handlers on %s; shared memory: %s", (int)getpid(), cpus, policy, handlers, memory);
+}
+
+void placement_enter_dispatcher(void) {
+    if (dispatcher_pinned && sched_setaffinity(0, sizeof(dispatcher_cpus), &dispatcher_cpus) != 0) {
+        log_message("[WARN] Cannot pin the dispatcher to dispatcher_cpus: %s", strerror(errno));
+    }
+    if (fifo_priority > 0) {
+        struct sched_param sp = { .sched_priority = fifo_priority };
+        if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &sp) != 0) {
+            log_message("[WARN] Cannot run the dispatcher under SCHED_FIFO %d: %s (needs CAP_SYS_NICE or RLIMIT_RTPRIO)",
+                        fifo_priority, strerror(errno));
+        }
+    } else if (dispatcher_nice != startup_nice && setpriority(PRIO_PROCESS, 0, dispatcher_nice) != 0) {
+        log_message("[WARN] Cannot set the dispatcher's nice value to %d: %s", dispatcher_nice, strerror(errno));
+    }
+    report();
+}
+
+void placement_enter_handler(int index) {
+    // A thread's affinity, policy and nice value are its own on Linux
+    if (handlers_pinned || dispatcher_pinned) {
+        cpu_set_t set = handlers_pinned ? handler_cpus : startup_cpus;
+        if (handlers_pinned && handler_spread && index >= 0) {
+            int pick = index % CPU_COUNT(&handler_cpus);
+            CPU_ZERO(&set);
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &handler_cpus) && pick-- == 0) {
+                    CPU_SET(cpu, &set);
+                    break;
+                }
+            }
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            log_message("[WARN] Cannot move handler %d to handler_cpus: %s", index, strerror(errno));
+        }
+    }
+    if (fifo_priority > 0) {
+        struct sched_param sp = { .sched_priority = 0 };
+        sched_setscheduler(0, SCHED_OTHER, &sp);
+    }
+    if (dispatcher_nice != startup_nice) setpriority(PRIO_PROCESS, syscall(SYS_gettid), startup_nice);
+    if (memory_node >= 0) set_mempolicy_node(MPOL_DEFAULT, -1);
+}
@@ -0,0 +1,20 @@
+// placement.h - CPU affinity, scheduling and NUMA placement of the bot
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "config.h"
+
+// Checks the CPU lists of config. When the dispatcher CPUs lie on one NUMA
+// node of several, memory set up from here on (the shared channel table,
+// history rings, seen table and counters) prefers that node. Call before the
+// shared memory is set up; returns -1 on an invalid setting.
+int placement_init(const BotConfig *config);
+// Pins the calling dispatcher to dispatcher_cpus, applies its scheduling
+// (SCHED_FIFO or nice) and logs the effective placement
+void placement_enter_dispatcher(void);
+// Moves the calling handler (a forked child or a pool thread) to
+// handler_cpus, with normal scheduling and memory local to where it runs.
+// With handler_spread, handler index gets one CPU of the set, round robin.
+void placement_enter_handler(int index);
+
+#endif
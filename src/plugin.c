@@ -0,0 +1,281 @@
+// plugin.c - Loading and dispatching response-handler plugins
+//
+// Every handler process (the pool's process, in pool mode) has its own
+// dlopen()ed copy of the plugins and a hash table from command to plugin.
+// A reload is requested through a generation count in shared memory:
+// handlers compare it before each dispatch and reload themselves, so a hot
+// swap never touches the dispatcher or the IRC connection. Call counters are
+// shared too, keyed by plugin name so they carry over a reload.
+#define _GNU_SOURCE
+#include "plugin.h"
+#include "plugin_api.h"
+#include "shared_mem.h"
+#include "trace.h"
+#include "utils.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+
+#define COMMAND_SLOTS (2 * MAX_PLUGIN_COMMANDS) // a power of two
+
+typedef struct {
+    char name[32];
+    unsigned long calls;
+    unsigned long overruns;     // calls that took longer than the budget
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+} PluginStats;
+
+typedef struct {
+    unsigned int generation;    // bumped by every reload request
+    int count;
+    PluginStats stats[MAX_PLUGINS];
+} SharedPlugins;
+
+typedef struct {
+    void *handle;
+    const BotPlugin *api;
+    PluginStats *stats;
+} LoadedPlugin;
+
+static SharedPlugins *shared = NULL;
+static char plugin_dir[512];
+static unsigned long long budget_ns;
+static LoadedPlugin loaded[MAX_PLUGINS];
+static int loaded_count = 0;
+static unsigned int loaded_generation = 0;
+// Command to loaded[] index, open addressing; rebuilt on every load
+static struct {
+    char command[32];
+    int plugin; // -1 = free
+} commands[COMMAND_SLOTS];
+// Pool threads dispatch concurrently; a reload waits until they are out
+static pthread_rwlock_t plugins_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint32_t hash_command(const char *command, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)tolower((unsigned char)command[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int find_command(const char *command, size_t len) {
+    uint32_t i = hash_command(command, len);
+    for (int probes = 0; probes < COMMAND_SLOTS; ++probes, ++i) {
+        int slot = i & (COMMAND_SLOTS - 1);
+        if (commands[slot].plugin < 0) return -1;
+        if (strncasecmp(commands[slot].command, command, len) == 0 && commands[slot].command[len] == 0) {
+            return commands[slot].plugin;
+        }
+    }
+    return -1;
+}
+
+static int add_command(const char *command, int plugin) {
+    size_t len = strlen(command);
+    if (len == 0 || len >= sizeof(commands[0].command) || command[0] != '!') return -1;
+    int owner = find_command(command, len);
+    if (owner >= 0) {
+        log_message("[WARN] Plugin %s: command %s is already taken by %s", loaded[plugin].api->name, command, loaded[owner].api->name);
+        return -1;
+    }
+    uint32_t i = hash_command(command, len);
+    for (int probes = 0; probes < COMMAND_SLOTS; ++probes, ++i) {
+        int slot = i & (COMMAND_SLOTS - 1);
+        if (commands[slot].plugin >= 0) continue;
+        memcpy(commands[slot].command, command, len + 1);
+        commands[slot].plugin = plugin;
+        return 0;
+    }
+    return -1;
+}
+
+// Counters for a plugin name, shared by every handler that loads it
+static PluginStats *stats_for(const char *name) {
+    PluginStats *found = NULL;
+    sem_lock();
+    for (int i = 0; i < shared->count && !found; ++i) {
+        if (strcmp(shared->stats[i].name, name) == 0) found = &shared->stats[i];
+    }
+    if (!found && shared->count < MAX_PLUGINS) {
+        found = &shared->stats[shared->count++];
+        snprintf(found->name, sizeof(found->name), "%s", name);
+    }
+    sem_unlock();
+    return found;
+}
+
+static int is_shared_object(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+    return entry->d_name[0] != '.' && len > 3 && strcmp(entry->d_name + len - 3, ".so") == 0;
+}
+
+static void load_plugin(const char *file) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", plugin_dir, file);
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        log_message("[ERROR] Plugin %s: %s", path, dlerror());
+        return;
+    }
+    const BotPlugin *api = dlsym(handle, "bot_plugin");
+    const char *problem = NULL;
+    if (!api) problem = "no bot_plugin symbol";
+    else if (api->abi_version != BOT_PLUGIN_ABI) problem = "built against another plugin ABI";
+    else if (!api->name || !api->commands || !api->handle) problem = "incomplete bot_plugin";
+    else if (loaded_count >= MAX_PLUGINS) problem = "too many plugins";
+    else if (api->init && api->init() != 0) problem = "init failed";
+    if (problem) {
+        log_message("[ERROR] Plugin %s: %s", path, problem);
+        dlclose(handle);
+        return;
+    }
+    LoadedPlugin *p = &loaded[loaded_count];
+    p->handle = handle;
+    p->api = api;
+    p->stats = stats_for(api->name);
+    int registered = 0;
+    for (const char *const *c = api->commands; *c; ++c) {
+        if (add_command(*c, loaded_count) == 0) registered++;
+    }
+    loaded_count++;
+    printf("[PLUGIN] Loaded %s from %s (%d commands)\n", api->name, path, registered);
+}
+
+static void unload_plugins(void) {
+    for (int i = 0; i < loaded_count; ++i) {
+        if (loaded[i].api->fini) loaded[i].api->fini();
+        dlclose(loaded[i].handle);
+    }
+    loaded_count = 0;
+    for (int i = 0; i < COMMAND_SLOTS; ++i) commands[i].plugin = -1;
+}
+
+// Loads the directory in name order, so the same plugin wins a command clash every time
+static void load_plugins(void) {
+    struct dirent **files;
+    int n = scandir(plugin_dir, &files, is_shared_object, alphasort);
+    if (n < 0) {
+        log_message("[ERROR] Cannot read plugin_dir %s", plugin_dir);
+        return;
+    }
+    for (int i = 0; i < n; ++i) {
+        load_plugin(files[i]->d_name);
+        free(files[i]);
+    }
+    free(files);
+}
+
+int plugin_init(const char *dir, int budget_ms) {
+    for (int i = 0; i < COMMAND_SLOTS; ++i) commands[i].plugin = -1;
+    if (!dir || !dir[0]) return 0;
+    void *p = mmap(NULL, sizeof(SharedPlugins), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap plugins");
+        return -1;
+    }
+    shared = p;
+    snprintf(plugin_dir, sizeof(plugin_dir), "%s", dir);
+    budget_ns = budget_ms * 1000000ULL;
+    load_plugins();
+    log_message("[INFO] Loaded %d plugins from %s", loaded_count, plugin_dir);
+    return 0;
+}
+
+void plugin_cleanup(void) {
+    if (!shared) return;
+    unload_plugins();
+    munmap(shared, sizeof(SharedPlugins));
+    shared = NULL;
+}
+
+static void reload_plugins(void) {
+    pthread_rwlock_wrlock(&plugins_lock);
+    unsigned int generation = __atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE);
+    if (generation != loaded_generation) {
+        unload_plugins();
+        load_plugins();
+        loaded_generation = generation;
+    }
+    pthread_rwlock_unlock(&plugins_lock);
+}
+
+typedef struct {
+    plugin_reply_fn reply;
+    void *arg;
+} ReplySink;
+
+static void reply_say(BotReply *reply, const char *text, size_t len) {
+    ReplySink *sink = reply->host;
+    if (text && len > 0) sink->reply(sink->arg, text, len);
+}
+
+static BotStr view(const char *s) {
+    return (BotStr){ s, strlen(s) };
+}
+
+int plugin_dispatch(const char *channel, const char *sender, const char *text, plugin_reply_fn reply, void *arg) {
+    if (!shared || text[0] != '!') return 0;
+    if (__atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE) != loaded_generation) reload_plugins();
+    size_t command_len = strcspn(text, " ");
+    pthread_rwlock_rdlock(&plugins_lock);
+    int index = find_command(text, command_len);
+    if (index < 0) {
+        pthread_rwlock_unlock(&plugins_lock);
+        return 0;
+    }
+    LoadedPlugin *p = &loaded[index];
+    const char *args = text + command_len;
+    while (*args == ' ') ++args;
+    BotMessage msg = { view(channel), view(sender), view(text), { text, command_len }, view(args) };
+    ReplySink sink = { reply, arg };
+    BotReply out = { reply_say, &sink };
+    unsigned long long start = trace_now_ns();
+    int handled = p->api->handle(&msg, &out);
+    unsigned long long took = trace_now_ns() - start;
+    if (p->stats) {
+        PluginStats *s = p->stats;
+        __atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->total_ns, took, __ATOMIC_RELAXED);
+        unsigned long long max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+        while (took > max && !__atomic_compare_exchange_n(&s->max_ns, &max, took, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+        if (took > budget_ns) {
+            unsigned long overruns = __atomic_add_fetch(&s->overruns, 1, __ATOMIC_RELAXED);
+            if (overruns == 1 || overruns % 100 == 0) {
+                log_message("[WARN] Plugin %s took %llu ms for %.*s (budget %llu ms), %lu times over budget so far",
+                            p->api->name, took / 1000000, (int)command_len, text, budget_ns / 1000000, overruns);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&plugins_lock);
+    return handled != 0;
+}
+
+int plugin_request_reload(void) {
+    if (!shared) return -1;
+    __atomic_add_fetch(&shared->generation, 1, __ATOMIC_RELEASE);
+    reload_plugins(); // this handler right away, the others on their next message
+    return loaded_count;
+}
+
+int plugin_stats_count(void) {
+    return shared ? shared->count : 0;
+}
+
+void plugin_describe(int index, char *buf, size_t len) {
+    PluginStats *s = &shared->stats[index];
+    unsigned long calls = __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+    unsigned long long total = __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+    snprintf(buf, len, "%s: %lu calls, avg %llu us, max %llu us, %lu over budget", s->name, calls,
+             calls ? total / calls / 1000 : 0, __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED) / 1000,
+             __atomic_load_n(&s->overruns, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,51 @@
+// plugin_api.h - The ABI between the bot and its response-handler plugins
+//
+// A plugin is a shared object in plugin_dir exporting one symbol:
+//
+//   const BotPlugin bot_plugin = { BOT_PLUGIN_ABI, "dice", commands, NULL, NULL, handle };
+//
+// The bot calls handle() for every channel message whose first word is one of
+// the plugin's commands. Plugins need nothing from the bot's symbol table:
+// everything they can do goes through the structures below. Fields are only
+// ever appended, with BOT_PLUGIN_ABI bumped when an existing one changes.
+#ifndef PLUGIN_API_H
+#define PLUGIN_API_H
+
+#include <stddef.h>
+
+#define BOT_PLUGIN_ABI 1
+
+// A view into the bot's own buffers: not NUL-terminated, valid during the call
+typedef struct {
+    const char *ptr;
+    size_t len;
+} BotStr;
+
+typedef struct {
+    BotStr channel; // where it was said
+    BotStr sender;  // nick
+    BotStr text;    // the whole message
+    BotStr command; // its first word, e.g. "!roll"
+    BotStr args;    // the rest, leading spaces skipped (may be empty)
+} BotMessage;
+
+typedef struct BotReply BotReply;
+struct BotReply {
+    // Queues text for the channel; it is split into IRC lines at word
+    // boundaries and sent when handle() returns (at most 8 lines per message)
+    void (*say)(BotReply *reply, const char *text, size_t len);
+    void *host; // the bot's, do not touch
+};
+
+typedef struct {
+    unsigned int abi_version;     // BOT_PLUGIN_ABI the plugin was built against
+    const char *name;
+    const char *const *commands;  // NULL-terminated, each with its '!'
+    int (*init)(void);            // optional, nonzero refuses the load
+    void (*fini)(void);           // optional, before unload or hot swap
+    // Returns nonzero if it handled the message, else narratives get it.
+    // Runs on the channel's handler: keep it well under plugin_budget_ms.
+    int (*handle)(const BotMessage *msg, BotReply *reply);
+} BotPlugin;
+
+#endif
@@ -0,0 +1,148 @@
+// rehash.c - Reloading bot.conf into the running bot (!rehash)
+//
+// Every process has its own copy of the config (forked from main's). The
+// handler running !rehash checks the file and does what only needs doing
+// once: joining and parting channels through the shared table and ending
+// sessions of dropped admins. It then bumps a generation count in shared
+// memory and wakes the dispatchers; each process reads the file again when it
+// notices, between two messages, and swaps in the settings that can change
+// live. Each also keeps the config as last read from the file (before shard
+// nicknames and the like), which the next rehash is compared against.
+#define _GNU_SOURCE
+#include "rehash.h"
+#include "admin.h"
+#include "narrative.h"
+#include "pacing.h"
+#include "shared_mem.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static BotConfig *running = NULL;
+static BotConfig baseline;          // as last read from the file
+static char config_path[512];
+static unsigned int *generation = NULL; // shared, bumped by every !rehash
+static unsigned int applied_generation = 0;
+static struct stat catalogue;       // narratives file as last loaded
+// Writers first: busy pool threads must not keep a rehash waiting
+static pthread_rwlock_t rehash_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+static void stat_catalogue(const char *path, struct stat *st) {
+    if (stat(path, st) != 0) memset(st, 0, sizeof(*st));
+}
+
+static int catalogue_changed(const BotConfig *next) {
+    struct stat now;
+    stat_catalogue(next->narratives_path, &now);
+    return strcmp(next->narratives_path, baseline.narratives_path) != 0 || now.st_ino != catalogue.st_ino ||
+           now.st_size != catalogue.st_size || now.st_mtime != catalogue.st_mtime;
+}
+
+int rehash_init(BotConfig *config, const char *path) {
+    void *p = mmap(NULL, sizeof(*generation), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap rehash");
+        return -1;
+    }
+    generation = p;
+    running = config;
+    snprintf(config_path, sizeof(config_path), "%s", path);
+    baseline = *config;
+    baseline.channels = NULL;
+    baseline.admins = NULL;
+    if (config_apply_live(&baseline, config) != 0) return -1;
+    stat_catalogue(config->narratives_path, &catalogue);
+    return 0;
+}
+
+const char *rehash_path(void) {
+    return config_path;
+}
+
+int rehash_request(char *report, size_t len, int *restart) {
+    BotConfig next;
+    *restart = 0;
+    if (!running) {
+        snprintf(report, len, "rehash is not set up");
+        return -1;
+    }
+    if (parse_config(config_path, &next, report, len) > 0) {
+        free_config(&next);
+        return -1;
+    }
+    int changes = config_diff(&baseline, &next, report, len, restart);
+    if (catalogue_changed(&next) && strcmp(next.narratives_path, baseline.narratives_path) == 0) {
+        size_t used = strlen(report);
+        snprintf(report + used, len - used, "%snarratives: %s changed, reloaded", used ? "\n" : "", next.narratives_path);
+        changes++;
+    }
+    for (int i = 0; i < next.channel_count; ++i) {
+        const char *name = next.channels[i];
+        if (!config_has_channel(&baseline, name) && shared_channel_find(name) == -1 && shared_channel_add(name) == -1) {
+            log_message("[WARN] Rehash could not join %s", name);
+        }
+    }
+    for (int i = 0; i < baseline.channel_count; ++i) {
+        const char *name = baseline.channels[i];
+        int slot = shared_channel_find(name);
+        if (!config_has_channel(&next, name) && slot != -1 && strcasecmp(name, "#admin") != 0) shared_channel_remove(slot);
+    }
+    for (int i = 0; i < baseline.admin_count; ++i) {
+        const AdminUser *now = config_find_admin(&next, baseline.admins[i].name);
+        if (!now || strcmp(now->password, baseline.admins[i].password) != 0) end_admin_session(baseline.admins[i].name);
+    }
+    free_config(&next);
+    __atomic_add_fetch(generation, 1, __ATOMIC_RELEASE);
+    wake_dispatchers();
+    return changes;
+}
+
+static void apply(unsigned int target) {
+    BotConfig next;
+    char errors[512];
+    applied_generation = target;
+    if (parse_config(config_path, &next, errors, sizeof(errors)) > 0) {
+        // Edited again since !rehash checked it; keep what we have
+        log_message("[WARN] Rehash not applied in process %d: %s", (int)getpid(), errors);
+        free_config(&next);
+        return;
+    }
+    if (catalogue_changed(&next)) {
+        char path[MAX_STR];
+        snprintf(path, sizeof(path), "%s", next.narratives_path);
+        if (load_narratives(path) == 0) stat_catalogue(next.narratives_path, &catalogue);
+        else log_message("[WARN] Rehash could not load narratives from %s", next.narratives_path);
+    }
+    if (config_apply_live(running, &next) != 0) {
+        log_message("[ERROR] Rehash ran out of memory in process %d", (int)getpid());
+        free_config(&next);
+        return;
+    }
+    set_log_level(running->log_level);
+    if (strcmp(next.logfile, baseline.logfile) != 0) set_logfile_path(running->logfile);
+    pacing_set_target(running->target_lag);
+    free_config(&baseline);
+    baseline = next;
+}
+
+void rehash_check(void) {
+    if (!generation) return;
+    unsigned int target = __atomic_load_n(generation, __ATOMIC_ACQUIRE);
+    if (target == applied_generation) return;
+    pthread_rwlock_wrlock(&rehash_lock);
+    apply(target);
+    pthread_rwlock_unlock(&rehash_lock);
+}
+
+void rehash_hold(void) {
+    pthread_rwlock_rdlock(&rehash_lock);
+}
+
+void rehash_release(void) {
+    pthread_rwlock_unlock(&rehash_lock);
+}
@@ -0,0 +1,29 @@
+// rehash.h - Reloading bot.conf into the running bot (!rehash)
+#ifndef REHASH_H
+#define REHASH_H
+
+#include <stddef.h>
+#include "config.h"
+
+// Remembers path and running, the config loaded from it at startup, which
+// !rehash updates in place. Call before handlers are forked.
+int rehash_init(BotConfig *running, const char *path);
+const char *rehash_path(void);
+// Reads the config file again. With any problem nothing changes, report gets
+// the problems one per line and -1 is returned. Otherwise report gets the
+// changes (see config_diff), channels added to or dropped from the file are
+// joined or parted, admins dropped or with a new password lose their
+// session, and every process is told to take the new settings; returns the
+// number of changes, *restart of which need a restart.
+int rehash_request(char *report, size_t len, int *restart);
+// Takes the new settings if a rehash happened since the last call. Called
+// between messages by every dispatcher and handler process; in pool mode
+// only by the dispatcher, which waits for the pool threads to be between
+// messages (see rehash_hold).
+void rehash_check(void);
+// Pool threads hold this while they handle a message, so settings are never
+// swapped under them
+void rehash_hold(void);
+void rehash_release(void);
+
+#endif
@@ -0,0 +1,207 @@
+// replay.c - Offline deterministic replay of recorded traffic
+#define _XOPEN_SOURCE 700
+#include "replay.h"
+#include "dispatch.h"
+#include "irc_client.h"
+#include "admin.h"
+#include "schedule.h"
+#include "rehash.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+
+extern volatile sig_atomic_t terminate_flag;
+
+typedef struct {
+    ChannelContext **channels; // indexed by shared channel slot; contexts never move
+    int *stopped;
+    int capacity;
+    const BotConfig *config;
+    HandlerSet handlers;
+    int announce;             // emit JOIN/PART for channels changed mid-replay
+} ReplayState;
+
+static FILE *replay_out = NULL;
+static unsigned long outbound_lines = 0;
+
+// Outbound lines go to the output file instead of the socket
+static void replay_send(int sockfd, const char *msg) {
+    fputs(msg, replay_out);
+    outbound_lines++;
+}
+
+// Runs the channel handler in-process, as the child would after reading its pipe
+static void replay_forward(int channel_index, const char *line, size_t len, const IrcPrivmsg *pm, void *arg) {
+    ReplayState *state = arg;
+    if (!handler_running(&state->handlers, channel_index) || state->stopped[channel_index]) return;
+    char chunk[512];
+    if (len > sizeof(chunk) - 3) len = sizeof(chunk) - 3;
+    memcpy(chunk, line, len);
+    memcpy(chunk + len, "\r\n", 3);
+    channel_handle_input(state->channels[channel_index], chunk);
+    // !shutdown only ends the handler that received it, like a child process exiting
+    if (terminate_flag) {
+        state->stopped[channel_index] = 1;
+        terminate_flag = 0;
+    }
+}
+
+// !join: set up a fresh context for the slot, as the forked child would
+static void replay_start_channel(int channel_index, const char *name, void *arg) {
+    ReplayState *state = arg;
+    if (channel_index >= state->capacity) {
+        int capacity = state->capacity ? state->capacity : 16;
+        while (capacity <= channel_index) capacity *= 2;
+        ChannelContext **channels = realloc(state->channels, capacity * sizeof(*channels));
+        if (!channels) return;
+        memset(channels + state->capacity, 0, (capacity - state->capacity) * sizeof(*channels));
+        state->channels = channels;
+        int *stopped = realloc(state->stopped, capacity * sizeof(*stopped));
+        if (!stopped) return;
+        state->stopped = stopped;
+        state->capacity = capacity;
+    }
+    if (!state->channels[channel_index]) {
+        state->channels[channel_index] = malloc(sizeof(ChannelContext));
+        if (!state->channels[channel_index]) return;
+    }
+    channel_init(state->channels[channel_index], state->config, channel_index, -1);
+    state->stopped[channel_index] = 0;
+    if (state->announce) {
+        char buffer[MAX_STR + 16];
+        snprintf(buffer, sizeof(buffer), "JOIN %s\r\n", name);
+        send_irc_message(-1, buffer);
+    }
+}
+
+static void replay_stop_channel(int channel_index, const char *name, void *arg) {
+    ReplayState *state = arg;
+    if (state->announce) {
+        char buffer[MAX_STR + 16];
+        snprintf(buffer, sizeof(buffer), "PART %s\r\n", name);
+        send_irc_message(-1, buffer);
+    }
+}
+
+// Parses "[YYYY-mm-dd HH:MM:SS] " as written by log_message; returns chars consumed or 0
+static size_t parse_log_timestamp(const char *line, long long *t_us) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (line[0] != '[') return 0;
+    const char *end = strptime(line + 1, "%Y-%m-%d %H:%M:%S", &tm);
+    if (!end || end[0] != ']' || end[1] != ' ') return 0;
+    tm.tm_isdst = -1;
+    *t_us = (long long)mktime(&tm) * 1000000LL;
+    return end + 2 - line;
+}
+
+// Parses a leading "<seconds>[.fraction] " timestamp; returns chars consumed or 0
+static size_t parse_raw_timestamp(const char *line, long long *t_us) {
+    if (!isdigit((unsigned char)line[0])) return 0;
+    char *end;
+    double secs = strtod(line, &end);
+    if (*end != ' ') return 0;
+    *t_us = (long long)(secs * 1000000.0);
+    return end + 1 - line;
+}
+
+int run_replay(const BotConfig *config, const char *input_path, const char *output_path) {
+    FILE *in = fopen(input_path, "r");
+    if (!in) {
+        perror("[REPLAY] input");
+        return 1;
+    }
+    replay_out = output_path ? fopen(output_path, "w") : stdout;
+    if (!replay_out) {
+        perror("[REPLAY] output");
+        fclose(in);
+        return 1;
+    }
+    // Never append to the log that may be the input being replayed
+    set_logfile_path("/dev/null");
+    set_irc_send_hook(replay_send);
+    // Timer wheels start at virtual 0; the first timestamp moves them forward
+    enable_virtual_clock(0);
+
+    static ReplayState state;
+    memset(&state, 0, sizeof(state));
+    state.config = config;
+    // The initial JOINs are not part of the recorded traffic, so stay quiet
+    sync_channel_handlers(&state.handlers, replay_start_channel, replay_stop_channel, &state);
+    state.announce = 1;
+    Dispatcher dispatcher = { config, -1, replay_forward, &state };
+    // Dispatcher timers: admin sessions and scheduled announcements
+    static TimerWheel timers;
+    static ScheduleSet schedules;
+    tw_init(&timers, bot_clock_ms());
+    schedule_set_init(&schedules, &timers, config, -1);
+    set_admin_session_timers(&timers, -1);
+
+    struct timespec wall_start;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    int clock_started = 0;
+    long long first_us = 0;
+    unsigned long records = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    char buffer[4096];
+    while ((len = getline(&line, &cap, in)) != -1) {
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = 0;
+        if (len == 0) continue;
+        long long t_us = -1;
+        const char *payload = line;
+        size_t skip = parse_log_timestamp(line, &t_us);
+        if (skip) {
+            // Only the raw server traffic of a bot.log is replayed
+            if (strncmp(line + skip, "[IRC] ", 6) != 0) continue;
+            payload = line + skip + 6;
+        } else if ((skip = parse_raw_timestamp(line, &t_us)) != 0) {
+            payload = line + skip;
+        }
+        if (t_us >= 0) {
+            if (!clock_started) {
+                enable_virtual_clock(t_us);
+                first_us = t_us;
+                clock_started = 1;
+            }
+            advance_virtual_clock(t_us);
+        } else if (!clock_started) {
+            enable_virtual_clock(0);
+            clock_started = 1;
+        }
+        if (!*payload) continue;
+        tw_advance(&timers, bot_clock_ms());
+        snprintf(buffer, sizeof(buffer), "%s\r\n", payload);
+        dispatch_buffer(&dispatcher, buffer);
+        // Apply any !join/!part, schedule and !rehash changes the handlers just made
+        sync_channel_handlers(&state.handlers, replay_start_channel, replay_stop_channel, &state);
+        sync_schedules(&schedules);
+        rehash_check();
+        records++;
+    }
+    free(line);
+    fclose(in);
+    dispatch_reset(&dispatcher);
+    set_admin_session_timers(NULL, -1);
+    free_schedule_set(&schedules);
+    free_handler_set(&state.handlers);
+    for (int i = 0; i < state.capacity; ++i) free(state.channels[i]);
+    free(state.channels);
+    free(state.stopped);
+    fflush(replay_out);
+    if (replay_out != stdout) fclose(replay_out);
+    set_irc_send_hook(NULL);
+
+    struct timespec wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+    double virt = (double)((long long)bot_time() * 1000000LL - first_us) / 1e6;
+    fprintf(stderr, "[REPLAY] %lu records, %lu outbound lines, %.1f s virtual time in %.3f s\n",
+            records, outbound_lines, virt < 0 ? 0 : virt, wall);
+    return 0;
+}
@@ -0,0 +1,13 @@
+// replay.h - Offline deterministic replay of recorded traffic
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "config.h"
+
+// Feeds a recorded traffic file through the dispatcher and channel handlers
+// in-process on a virtual clock, writing every outbound line to output_path.
+// Accepts raw IRC lines (optionally prefixed with "<unix time> ") or bot.log
+// files, from which the "[IRC]" records are replayed. Returns 0 on success.
+int run_replay(const BotConfig *config, const char *input_path, const char *output_path);
+
+#endif
@@ -0,0 +1,73 @@
+// schedule.c - Dispatcher side of !schedule/!every announcements
+#include "schedule.h"
+#include "outbound.h"
+#include "utils.h"
+#include "shard.h"
+#include <stdio.h>
+#include <string.h>
+
+static void fire_schedule(Timer *timer, void *arg) {
+    ScheduledJob *job = arg;
+    ScheduleSet *set = job->set;
+    int index = (int)(job - set->jobs);
+    SharedSchedule copy;
+    sem_lock();
+    copy = shared_data->schedules[index];
+    sem_unlock();
+    if (copy.id != job->id) return; // removed meanwhile; the next sync clears it
+    int i = shared_channel_find(copy.channel);
+    SharedChannel *slot = shared_channel(i);
+    if (slot && !slot->stop_talking) {
+        printf("[SCHEDULE] #%u to %s: %s\n", copy.id, copy.channel, copy.text);
+        fflush(stdout);
+        log_message("[SCHEDULE] Sent #%u to %s", copy.id, copy.channel);
+        send_privmsg(set->sockfd, set->config->nickname, copy.channel, copy.text);
+    } else {
+        log_message("[SCHEDULE] Skipped #%u: not talking in %s", copy.id, copy.channel);
+    }
+    if (copy.repeat) {
+        // From the old deadline, so the period does not drift with send delays
+        tw_add(set->timers, timer, timer->deadline + copy.interval * 1000LL);
+    } else {
+        shared_schedule_remove(copy.id);
+        job->id = 0;
+    }
+}
+
+void schedule_set_init(ScheduleSet *set, TimerWheel *timers, const BotConfig *config, int sockfd) {
+    memset(set, 0, sizeof(*set));
+    set->timers = timers;
+    set->config = config;
+    set->sockfd = sockfd;
+    for (int i = 0; i < MAX_SCHEDULES; ++i) {
+        timer_init(&set->jobs[i].timer, fire_schedule, &set->jobs[i]);
+        set->jobs[i].set = set;
+    }
+}
+
+void sync_schedules(ScheduleSet *set) {
+    if (!shared_data) return;
+    if (set->synced && set->generation == shared_data->schedule_generation) return;
+    long long now = bot_clock_ms();
+    sem_lock();
+    set->generation = shared_data->schedule_generation;
+    set->synced = 1;
+    for (int i = 0; i < MAX_SCHEDULES; ++i) {
+        const SharedSchedule *s = &shared_data->schedules[i];
+        ScheduledJob *job = &set->jobs[i];
+        // Sent by the connection that serves the channel
+        unsigned int id = s->id && shard_owns(s->channel) ? s->id : 0;
+        if (job->id == id) continue;
+        tw_cancel(set->timers, &job->timer);
+        job->id = id;
+        if (id) tw_add(set->timers, &job->timer, now + s->interval * 1000LL);
+    }
+    sem_unlock();
+}
+
+void free_schedule_set(ScheduleSet *set) {
+    for (int i = 0; i < MAX_SCHEDULES; ++i) {
+        tw_cancel(set->timers, &set->jobs[i].timer);
+        set->jobs[i].id = 0;
+    }
+}
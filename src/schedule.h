@@ -0,0 +1,32 @@
+// schedule.h - Dispatcher side of !schedule/!every announcements
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include "config.h"
+#include "shared_mem.h"
+#include "timer_wheel.h"
+
+struct ScheduleSet;
+
+typedef struct {
+    Timer timer;
+    unsigned int id;          // schedule armed for this table slot, 0 = none
+    struct ScheduleSet *set;
+} ScheduledJob;
+
+// Timers for the shared schedule table, one per slot
+typedef struct ScheduleSet {
+    ScheduledJob jobs[MAX_SCHEDULES];
+    TimerWheel *timers;
+    const BotConfig *config;
+    int sockfd;
+    unsigned int generation;  // shared schedule generation last synced
+    int synced;
+} ScheduleSet;
+
+void schedule_set_init(ScheduleSet *set, TimerWheel *timers, const BotConfig *config, int sockfd);
+// Arms timers for new schedules and cancels those of removed ones
+void sync_schedules(ScheduleSet *set);
+void free_schedule_set(ScheduleSet *set);
+
+#endif
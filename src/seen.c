@@ -0,0 +1,220 @@
+// seen.c - Last activity of every nick the bot has seen
+//
+// A fixed-size hash table in shared memory: buckets chain entries by index,
+// and the entries also form an LRU list (most recently active first) so a
+// full table recycles the nick that has been quiet longest. Dispatchers
+// write under the shared semaphore (one per connection); readers in children
+// and pool threads retry when the table's sequence count changed under them
+// (a seqlock).
+#define _GNU_SOURCE
+#include "seen.h"
+#include "shared_mem.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+typedef struct {
+    SeenInfo info;
+    char key[32];   // casemapped nick
+    uint32_t hash;
+    int32_t chain;  // next entry in the same bucket, -1 = end
+    int32_t prev, next; // LRU neighbours, -1 = end
+} SeenEntry;
+
+typedef struct {
+    uint32_t sequence; // odd while the dispatcher is changing the table
+    int capacity;
+    uint32_t bucket_mask;
+    int count;
+    int32_t lru_head, lru_tail;
+} SeenHeader;
+
+static SeenHeader *table = NULL;
+static size_t table_size = 0;
+
+static int32_t *table_buckets(void) {
+    return (int32_t *)(table + 1);
+}
+
+static SeenEntry *table_entries(void) {
+    return (SeenEntry *)(table_buckets() + table->bucket_mask + 1);
+}
+
+// RFC 1459 casemapping: []\~ are the uppercase of {}|^
+static void casefold(char *dst, const char *src, size_t len) {
+    size_t i = 0;
+    for (; src[i] && i < len - 1; ++i) {
+        char c = src[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        else if (c == '[') c = '{';
+        else if (c == ']') c = '}';
+        else if (c == '\\') c = '|';
+        else if (c == '~') c = '^';
+        dst[i] = c;
+    }
+    dst[i] = 0;
+}
+
+static uint32_t hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int seen_init(int capacity) {
+    if (capacity <= 0) return 0;
+    uint32_t buckets = 64;
+    while (buckets < 2u * (uint32_t)capacity) buckets *= 2;
+    table_size = sizeof(SeenHeader) + buckets * sizeof(int32_t) + (size_t)capacity * sizeof(SeenEntry);
+    void *p = mmap(NULL, table_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap seen");
+        return -1;
+    }
+    table = p;
+    table->capacity = capacity;
+    table->bucket_mask = buckets - 1;
+    table->lru_head = table->lru_tail = -1;
+    memset(table_buckets(), 0xff, buckets * sizeof(int32_t)); // all -1
+    return 0;
+}
+
+void seen_cleanup(void) {
+    if (table) munmap(table, table_size);
+    table = NULL;
+}
+
+static int32_t find_entry(const char *key, uint32_t hash) {
+    SeenEntry *entries = table_entries();
+    int32_t i = table_buckets()[hash & table->bucket_mask];
+    // Bounded: a reader racing the writer may see a half-updated chain
+    for (int steps = 0; i >= 0 && i < table->capacity && steps < table->capacity; ++steps) {
+        if (entries[i].hash == hash && strcmp(entries[i].key, key) == 0) return i;
+        i = entries[i].chain;
+    }
+    return -1;
+}
+
+static void lru_unlink(int32_t i) {
+    SeenEntry *entries = table_entries();
+    SeenEntry *e = &entries[i];
+    if (e->prev >= 0) entries[e->prev].next = e->next; else table->lru_head = e->next;
+    if (e->next >= 0) entries[e->next].prev = e->prev; else table->lru_tail = e->prev;
+}
+
+static void lru_push_front(int32_t i) {
+    SeenEntry *entries = table_entries();
+    entries[i].prev = -1;
+    entries[i].next = table->lru_head;
+    if (table->lru_head >= 0) entries[table->lru_head].prev = i;
+    table->lru_head = i;
+    if (table->lru_tail < 0) table->lru_tail = i;
+}
+
+static void bucket_unlink(int32_t i) {
+    SeenEntry *entries = table_entries();
+    int32_t *link = &table_buckets()[entries[i].hash & table->bucket_mask];
+    while (*link >= 0 && *link != i) link = &entries[*link].chain;
+    if (*link == i) *link = entries[i].chain;
+}
+
+// Caller holds the semaphore and has made the sequence odd
+static void update_entry(const char *nick, SeenKind kind, const char *where, time_t when) {
+    char key[32];
+    casefold(key, nick, sizeof(key));
+    uint32_t hash = hash_key(key);
+    SeenEntry *entries = table_entries();
+    int32_t i = find_entry(key, hash);
+    if (i >= 0) {
+        lru_unlink(i);
+    } else {
+        if (table->count < table->capacity) {
+            i = table->count++;
+        } else {
+            // Full: recycle the nick that has been quiet longest
+            i = table->lru_tail;
+            lru_unlink(i);
+            bucket_unlink(i);
+        }
+        SeenEntry *e = &entries[i];
+        memcpy(e->key, key, sizeof(key));
+        e->hash = hash;
+        e->info.where[0] = 0;
+        int32_t *bucket = &table_buckets()[hash & table->bucket_mask];
+        e->chain = *bucket;
+        *bucket = i;
+    }
+    SeenEntry *e = &entries[i];
+    snprintf(e->info.nick, sizeof(e->info.nick), "%s", nick);
+    // A quit names no channel; keep the last one known
+    if (where) snprintf(e->info.where, sizeof(e->info.where), "%s", where);
+    e->info.when = when;
+    e->info.kind = kind;
+    lru_push_front(i);
+}
+
+static void begin_write(void) {
+    sem_lock();
+    __atomic_store_n(&table->sequence, table->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_write(void) {
+    __atomic_store_n(&table->sequence, table->sequence + 1, __ATOMIC_RELEASE);
+    sem_unlock();
+}
+
+void seen_update(const char *nick, SeenKind kind, const char *where, time_t when) {
+    if (!table || !nick || !*nick) return;
+    begin_write();
+    update_entry(nick, kind, where, when);
+    end_write();
+}
+
+void seen_update_many(const SeenEvent *events, int count, time_t when) {
+    if (!table || count <= 0) return;
+    begin_write();
+    for (int i = 0; i < count; ++i) {
+        if (events[i].nick[0]) update_entry(events[i].nick, events[i].kind, events[i].where[0] ? events[i].where : NULL, when);
+    }
+    end_write();
+}
+
+int seen_lookup(const char *nick, SeenInfo *out) {
+    if (!table || !nick || !*nick) return 0;
+    char key[32];
+    casefold(key, nick, sizeof(key));
+    uint32_t hash = hash_key(key);
+    for (int attempt = 0; attempt < 16; ++attempt) {
+        uint32_t before = __atomic_load_n(&table->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+        int32_t i = find_entry(key, hash);
+        if (i >= 0) *out = table_entries()[i].info;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&table->sequence, __ATOMIC_RELAXED) == before) return i >= 0;
+    }
+    return 0;
+}
+
+void seen_describe(const SeenInfo *info, time_t now, char *buf, size_t len) {
+    long ago = now > info->when ? (long)(now - info->when) : 0;
+    char span[32];
+    if (ago < 60) snprintf(span, sizeof(span), "%lds", ago);
+    else if (ago < 3600) snprintf(span, sizeof(span), "%ldm %lds", ago / 60, ago % 60);
+    else if (ago < 86400) snprintf(span, sizeof(span), "%ldh %ldm", ago / 3600, ago % 3600 / 60);
+    else snprintf(span, sizeof(span), "%ldd %ldh", ago / 86400, ago % 86400 / 3600);
+    const char *doing = "";
+    switch (info->kind) {
+    case SEEN_MESSAGE: doing = "talking in "; break;
+    case SEEN_JOIN: doing = "joining "; break;
+    case SEEN_PART: doing = "leaving "; break;
+    case SEEN_KICK: doing = "being kicked from "; break;
+    case SEEN_QUIT: doing = info->where[0] ? "quitting IRC, last in " : "quitting IRC"; break;
+    case SEEN_NICK: doing = "changing nick to "; break;
+    }
+    snprintf(buf, len, "%s was last seen %s ago, %s%s.", info->nick, span, doing, info->where);
+}
@@ -0,0 +1,44 @@
+// seen.h - Last activity of every nick the bot has seen
+#ifndef SEEN_H
+#define SEEN_H
+
+#include <time.h>
+#include "config.h"
+
+typedef enum {
+    SEEN_MESSAGE,
+    SEEN_JOIN,
+    SEEN_PART,
+    SEEN_KICK,  // kicked from where
+    SEEN_QUIT,  // where is the last channel it was seen in, if any
+    SEEN_NICK,  // changed nick; where is the new nick
+} SeenKind;
+
+typedef struct {
+    char nick[32]; // as last seen, not casemapped
+    char where[MAX_STR];
+    time_t when;
+    SeenKind kind;
+} SeenInfo;
+
+// One presence change, for applying a batch of them at once
+typedef struct {
+    char nick[32];
+    SeenKind kind;
+    char where[MAX_STR]; // "" = none (a quit)
+} SeenEvent;
+
+// Creates the shared table for up to capacity nicks; the least recently
+// active nick is evicted when it is full. Call before handlers are forked.
+int seen_init(int capacity);
+void seen_cleanup(void);
+// Records activity; called by dispatchers, serialized on the shared semaphore
+void seen_update(const char *nick, SeenKind kind, const char *where, time_t when);
+// Records a netsplit or netjoin in one locked update (readers retry once, not per nick)
+void seen_update_many(const SeenEvent *events, int count, time_t when);
+// Returns 1 and fills out if nick (RFC 1459 casemapping) has been seen
+int seen_lookup(const char *nick, SeenInfo *out);
+// Writes "<nick> was last seen <ago> ago, <doing what>." to buf
+void seen_describe(const SeenInfo *info, time_t now, char *buf, size_t len);
+
+#endif
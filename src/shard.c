@@ -0,0 +1,116 @@
+// shard.c - Spreading channels over several server connections
+//
+// With connections = K the bot opens K connections, each run by its own
+// dispatcher process with its own handlers. A channel is joined and served
+// by exactly one of them, picked by hash, so the server's per-connection
+// flood limit applies to each share of the channels instead of all of them.
+// Shared memory (admin state, channel table, history, !seen) is common.
+#include "shard.h"
+#include "shared_mem.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    int control[2];  // channel table changes wake this dispatcher
+    int outbound[2]; // lines its handlers (and other connections' handlers) send
+} ShardPipes;
+
+static ShardPipes pipes[MAX_SHARDS];
+static int count = 1;
+static int current = 0;
+
+static int make_pipe(int fds[2]) {
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+int shard_setup(int shards) {
+    if (shards < 1) shards = 1;
+    if (shards > MAX_SHARDS) shards = MAX_SHARDS;
+    count = shards;
+    for (int i = 0; i < count; ++i) {
+        if (make_pipe(pipes[i].control) != 0 || make_pipe(pipes[i].outbound) != 0) return -1;
+        add_channel_notify_fd(pipes[i].control[1]);
+    }
+    return 0;
+}
+
+void shard_select(int index) {
+    current = index;
+    // Other connections' read ends belong to their dispatchers
+    for (int i = 0; i < count; ++i) {
+        if (i == index) continue;
+        close(pipes[i].control[0]);
+        close(pipes[i].outbound[0]);
+    }
+}
+
+int shard_count(void) {
+    return count;
+}
+
+int shard_index(void) {
+    return current;
+}
+
+int shard_of(const char *channel) {
+    if (count == 1) return 0;
+    uint32_t h = 2166136261u;
+    for (; *channel; ++channel) {
+        h ^= (unsigned char)tolower((unsigned char)*channel);
+        h *= 16777619u;
+    }
+    return (int)(h % (uint32_t)count);
+}
+
+int shard_owns(const char *channel) {
+    return shard_of(channel) == current;
+}
+
+void shard_nick(const char *base, int index, char *out, size_t len) {
+    if (index == 0) {
+        snprintf(out, len, "%s", base);
+        return;
+    }
+    char suffix[16];
+    int n = snprintf(suffix, sizeof(suffix), "_%d", index);
+    snprintf(out, len, "%.*s%s", NICKLEN - n, base, suffix);
+}
+
+int shard_control_fd(void) {
+    return pipes[current].control[0];
+}
+
+int shard_outbound_fd(void) {
+    return pipes[current].outbound[0];
+}
+
+int shard_route(const char *msg) {
+    int owner = current;
+    if (count > 1) {
+        // "<COMMAND> <target> ..."; only channel targets have an owner
+        const char *target = strchr(msg, ' ');
+        if (target && (target[1] == '#' || target[1] == '&')) {
+            char name[128];
+            size_t n = strcspn(target + 1, " ,\r\n"); // first of a JOIN list
+            if (n >= sizeof(name)) n = sizeof(name) - 1;
+            memcpy(name, target + 1, n);
+            name[n] = 0;
+            owner = shard_of(name);
+        }
+    }
+    return owner;
+}
+
+int shard_route_fd(const char *msg) {
+    return pipes[shard_route(msg)].outbound[1];
+}
@@ -0,0 +1,32 @@
+// shard.h - Spreading channels over several server connections
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+#define MAX_SHARDS 16
+#define NICKLEN 9 // RFC 2812; many servers allow more, none less
+
+// Creates the channel notify pipe and the outbound pipe of each of count
+// connections (1 = a single connection). Call once, before any fork.
+int shard_setup(int count);
+// Makes this process serve connection index: its pipes, its channels
+void shard_select(int index);
+int shard_count(void);
+int shard_index(void);
+// Connection serving channel: a hash of its lowercased name
+int shard_of(const char *channel);
+int shard_owns(const char *channel);
+// Nick of connection index: the configured nick for 0, "<nick>_<index>" after,
+// with the nick cut so the whole fits NICKLEN
+void shard_nick(const char *base, int index, char *out, size_t len);
+// Read ends polled by this connection's dispatcher
+int shard_control_fd(void);
+int shard_outbound_fd(void);
+// Connection to send msg on: the one serving the channel it is addressed to
+// (it is the one that joined it), else this one
+int shard_route(const char *msg);
+// Write end of the outbound pipe of shard_route(msg)
+int shard_route_fd(const char *msg);
+
+#endif
@@ -1,5 +1,7 @@
 // shared_mem.c - Stub for shared memory/semaphores
+#define _GNU_SOURCE
 #include "shared_mem.h"
+#include "utils.h"
 #include <stdio.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
@@ -10,16 +12,181 @@
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
+#include <strings.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define INITIAL_CHANNEL_SLOTS 16
+#define STATE_MAGIC "IRCSTATE"
+#define STATE_VERSION 4
+
+// Snapshot file layout: header, SharedData, then slot_count channel slots
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t data_size;   // sizeof(SharedData) when written
+    uint32_t slot_size;   // sizeof(SharedChannel) when written
+    uint32_t slot_count;
+    uint32_t checksum;    // FNV-1a over everything after the header
+    uint32_t reserved;
+    int64_t saved_at;
+} StateHeader;
 
 static int sem_id = -1;
+static int channel_fd = -1;                 // memfd backing the channel slots
+static SharedChannel *channel_slots = NULL; // this process' view of the slots
+static int mapped_capacity = 0;
+static pthread_mutex_t remap_lock = PTHREAD_MUTEX_INITIALIZER;
+static int notify_fds[16];
+static int notify_count = 0;
+static char state_path[MAX_STR] = "";
+static int state_fd = -1;
+static StateHeader *state_map = NULL; // dispatcher's mapping of the snapshot file
+static size_t state_mapped = 0;
+static int state_restored = 0;
 
 SharedData *shared_data = NULL;
 
+static uint32_t state_checksum(const unsigned char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Maps at least size bytes of the snapshot file, growing it if needed
+static int map_state_file(size_t size) {
+    if (state_map && state_mapped >= size) return 0;
+    if (state_map) munmap(state_map, state_mapped);
+    state_map = NULL;
+    struct stat st;
+    if (fstat(state_fd, &st) == -1) return -1;
+    if ((size_t)st.st_size < size && ftruncate(state_fd, size) == -1) {
+        perror("ftruncate state");
+        return -1;
+    }
+    if ((size_t)st.st_size > size) size = st.st_size;
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap state");
+        return -1;
+    }
+    state_map = p;
+    state_mapped = size;
+    return 0;
+}
+
+static int grow_channel_file(int capacity);
+static int sync_channel_mapping(void);
+
+// Adopts the snapshot if it is intact and from this layout version;
+// anything else is ignored and the bot starts with empty state
+static void restore_shared_state(void) {
+    state_fd = open(state_path, O_RDWR | O_CREAT, 0600);
+    if (state_fd == -1) {
+        perror("open state file");
+        return;
+    }
+    struct stat st;
+    if (fstat(state_fd, &st) == -1 || (size_t)st.st_size < sizeof(StateHeader) + sizeof(SharedData)) {
+        printf("[STATE] No previous state in %s\n", state_path);
+        fflush(stdout);
+        return;
+    }
+    if (map_state_file(st.st_size) != 0) return;
+    StateHeader *h = state_map;
+    const char *reason = NULL;
+    size_t body = (size_t)h->slot_count * sizeof(SharedChannel) + sizeof(SharedData);
+    if (memcmp(h->magic, STATE_MAGIC, 8) != 0) reason = "bad magic";
+    else if (h->version != STATE_VERSION || h->data_size != sizeof(SharedData) || h->slot_size != sizeof(SharedChannel)) reason = "layout version changed";
+    else if (sizeof(StateHeader) + body > state_mapped) reason = "truncated";
+    else if (state_checksum((unsigned char *)(h + 1), body) != h->checksum) reason = "checksum mismatch";
+    if (reason) {
+        printf("[STATE] Ignoring %s: %s\n", state_path, reason);
+        fflush(stdout);
+        log_message("[WARN] Ignoring state file %s: %s", state_path, reason);
+        return;
+    }
+    SharedData *saved = (SharedData *)(h + 1);
+    int capacity = INITIAL_CHANNEL_SLOTS;
+    while (capacity < (int)h->slot_count) capacity *= 2;
+    if ((int)h->slot_count != saved->channel_count || grow_channel_file(capacity) != 0) {
+        printf("[STATE] Ignoring %s: inconsistent channel table\n", state_path);
+        fflush(stdout);
+        return;
+    }
+    memcpy(shared_data, saved, sizeof(SharedData));
+    shared_data->channel_capacity = capacity;
+    if (h->slot_count > 0) {
+        SharedChannel *slots = mmap(NULL, capacity * sizeof(SharedChannel), PROT_READ | PROT_WRITE, MAP_SHARED, channel_fd, 0);
+        if (slots == MAP_FAILED) {
+            perror("mmap channels");
+            memset(shared_data, 0, sizeof(SharedData));
+            shared_data->channel_capacity = capacity;
+            return;
+        }
+        memcpy(slots, saved + 1, h->slot_count * sizeof(SharedChannel));
+        // Counters describe one run of the bot, not the saved state
+        for (unsigned int i = 0; i < h->slot_count; ++i) {
+            slots[i].forwarded = slots[i].dropped = slots[i].coalesced = 0;
+            slots[i].queue_peak = 0;
+            slots[i].crashes = 0;
+            slots[i].cache_hits = slots[i].cache_misses = 0;
+        }
+        munmap(slots, capacity * sizeof(SharedChannel));
+    }
+    state_restored = 1;
+    printf("[STATE] Restored %d channels, %d admins, %d ignores from %s\n",
+           shared_data->channel_count, shared_data->authed_count, shared_data->ignored_count, state_path);
+    fflush(stdout);
+    log_message("[INFO] Restored shared state from %s (saved at %lld)", state_path, (long long)h->saved_at);
+}
+
+void set_shared_state_path(const char *path) {
+    snprintf(state_path, sizeof(state_path), "%s", path ? path : "");
+}
+
+int shared_state_restored(void) {
+    return state_restored;
+}
+
+int shared_state_sync(void) {
+    if (state_fd == -1 || !shared_data) return 0;
+    sem_lock();
+    int rc = -1;
+    int count = shared_data->channel_count;
+    size_t body = sizeof(SharedData) + (size_t)count * sizeof(SharedChannel);
+    if (sync_channel_mapping() == 0 && map_state_file(sizeof(StateHeader) + body) == 0) {
+        // Invalidate first so a crash mid-copy can never look like a good snapshot
+        StateHeader *h = state_map;
+        memset(h->magic, 0, sizeof(h->magic));
+        SharedData *saved = (SharedData *)(h + 1);
+        memcpy(saved, shared_data, sizeof(SharedData));
+        memcpy(saved + 1, channel_slots, (size_t)count * sizeof(SharedChannel));
+        h->version = STATE_VERSION;
+        h->data_size = sizeof(SharedData);
+        h->slot_size = sizeof(SharedChannel);
+        h->slot_count = count;
+        h->checksum = state_checksum((unsigned char *)saved, body);
+        h->saved_at = time(NULL);
+        memcpy(h->magic, STATE_MAGIC, sizeof(h->magic));
+        rc = 0;
+    }
+    sem_unlock();
+    if (rc == 0 && msync(state_map, state_mapped, MS_SYNC) == -1) {
+        perror("msync state");
+        rc = -1;
+    }
+    return rc;
+}
+
 int init_shared_resources() {
     printf("Initializing shared resources\n");
-    key_t key = ftok("/tmp", 'B');
-    if (key == -1) { perror("ftok"); return -1; }
-    sem_id = semget(key, 1, IPC_CREAT | 0666);
+    // Private semaphore: inherited by the children, never shared with other bot instances
+    sem_id = semget(IPC_PRIVATE, 1, IPC_CREAT | 0600);
     if (sem_id == -1) { perror("semget"); return -1; }
     // Initialize to 1 (unlocked)
     semctl(sem_id, 0, SETVAL, 1);
@@ -32,6 +199,12 @@ int init_shared_resources() {
         return -1;
     }
     memset(shared_data, 0, sizeof(SharedData));
+    // Channel slots live in a memfd so any process can grow the table
+    channel_fd = memfd_create("irc_bot_channels", 0);
+    if (channel_fd == -1) { perror("memfd_create"); return -1; }
+    if (grow_channel_file(INITIAL_CHANNEL_SLOTS) != 0) return -1;
+    shared_data->channel_capacity = INITIAL_CHANNEL_SLOTS;
+    if (state_path[0]) restore_shared_state();
     // Set up ignore list pointers for shared memory
     extern void set_shared_ignore_ptrs(char (*nicks)[64], int *count);
     set_shared_ignore_ptrs(shared_data->ignored_nicks, &shared_data->ignored_count);
@@ -52,8 +225,16 @@ int sem_unlock() {
 
 void cleanup_shared_resources() {
     printf("Cleaning up shared resources\n");
+    if (state_fd != -1) {
+        shared_state_sync();
+        if (state_map) munmap(state_map, state_mapped);
+        close(state_fd);
+        state_fd = -1;
+        state_map = NULL;
+    }
     if (sem_id != -1) semctl(sem_id, 0, IPC_RMID);
     if (shared_data) munmap(shared_data, sizeof(SharedData));
+    if (channel_fd != -1) close(channel_fd);
 }
 
 // Helper to get pointer to shared authed admin struct
@@ -67,3 +248,149 @@ int *get_shared_authed_count_ptr() {
     if (!shared_data) return NULL;
     return &shared_data->authed_count;
 }
+
+// Maps the slots if the table grew since we last looked. Old mappings are
+// deliberately left in place: other threads of this process may still be
+// using them, and they stay coherent views of the same memfd pages.
+static int sync_channel_mapping(void) {
+    if (!shared_data || channel_fd == -1) return -1;
+    int capacity = shared_data->channel_capacity;
+    if (capacity == mapped_capacity && channel_slots) return 0;
+    pthread_mutex_lock(&remap_lock);
+    if (capacity != mapped_capacity || !channel_slots) {
+        void *p = mmap(NULL, capacity * sizeof(SharedChannel), PROT_READ | PROT_WRITE, MAP_SHARED, channel_fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap channels");
+            pthread_mutex_unlock(&remap_lock);
+            return -1;
+        }
+        channel_slots = p;
+        mapped_capacity = capacity;
+    }
+    pthread_mutex_unlock(&remap_lock);
+    return 0;
+}
+
+static int grow_channel_file(int capacity) {
+    if (ftruncate(channel_fd, (off_t)capacity * sizeof(SharedChannel)) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
+    return 0;
+}
+
+SharedChannel *shared_channel(int index) {
+    if (sync_channel_mapping() != 0) return NULL;
+    if (index < 0 || index >= shared_data->channel_count) return NULL;
+    return &channel_slots[index];
+}
+
+int shared_channel_count(void) {
+    return shared_data ? shared_data->channel_count : 0;
+}
+
+int shared_channel_find(const char *name) {
+    if (sync_channel_mapping() != 0) return -1;
+    for (int i = 0; i < shared_data->channel_count; ++i) {
+        if (channel_slots[i].active && strcasecmp(channel_slots[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+void add_channel_notify_fd(int fd) {
+    if (notify_count < (int)(sizeof(notify_fds) / sizeof(notify_fds[0]))) notify_fds[notify_count++] = fd;
+}
+
+void wake_dispatchers(void) {
+    char c = 'C';
+    for (int i = 0; i < notify_count; ++i) {
+        write(notify_fds[i], &c, 1); // non-blocking; a full pipe already means a wakeup is pending
+    }
+}
+
+static void notify_channel_change(void) {
+    shared_data->channel_generation++;
+    wake_dispatchers();
+}
+
+int shared_channel_add(const char *name) {
+    if (!shared_data || channel_fd == -1) return -1;
+    sem_lock();
+    int index = -1;
+    if (sync_channel_mapping() == 0) {
+        index = shared_channel_find(name);
+        if (index == -1) {
+            // Reuse a parted slot before growing the table
+            for (int i = 0; i < shared_data->channel_count; ++i) {
+                if (!channel_slots[i].active) { index = i; break; }
+            }
+            if (index == -1 && shared_data->channel_count == shared_data->channel_capacity) {
+                int capacity = shared_data->channel_capacity * 2;
+                if (grow_channel_file(capacity) == 0) {
+                    shared_data->channel_capacity = capacity;
+                    sync_channel_mapping();
+                }
+            }
+            if (index == -1 && shared_data->channel_count < shared_data->channel_capacity) {
+                index = shared_data->channel_count++;
+            }
+            if (index != -1) {
+                SharedChannel *slot = &channel_slots[index];
+                memset(slot, 0, sizeof(*slot));
+                snprintf(slot->name, sizeof(slot->name), "%s", name);
+                slot->epoch = ++shared_data->channel_epoch;
+                slot->active = 1;
+                notify_channel_change();
+            }
+        }
+    }
+    sem_unlock();
+    return index;
+}
+
+void shared_channel_remove(int index) {
+    sem_lock();
+    SharedChannel *slot = shared_channel(index);
+    if (slot && slot->active) {
+        slot->active = 0;
+        notify_channel_change();
+    }
+    sem_unlock();
+}
+
+unsigned int shared_schedule_add(int interval, int repeat, const char *channel, const char *text) {
+    if (!shared_data) return 0;
+    sem_lock();
+    unsigned int id = 0;
+    for (int i = 0; i < MAX_SCHEDULES; ++i) {
+        SharedSchedule *s = &shared_data->schedules[i];
+        if (s->id) continue;
+        s->interval = interval;
+        s->repeat = repeat;
+        snprintf(s->channel, sizeof(s->channel), "%s", channel);
+        snprintf(s->text, sizeof(s->text), "%s", text);
+        if (++shared_data->schedule_id == 0) shared_data->schedule_id = 1;
+        id = s->id = shared_data->schedule_id;
+        shared_data->schedule_generation++;
+        wake_dispatchers();
+        break;
+    }
+    sem_unlock();
+    return id;
+}
+
+int shared_schedule_remove(unsigned int id) {
+    if (!shared_data || id == 0) return -1;
+    int rc = -1;
+    sem_lock();
+    for (int i = 0; i < MAX_SCHEDULES; ++i) {
+        if (shared_data->schedules[i].id != id) continue;
+        shared_data->schedules[i].id = 0;
+        shared_data->schedule_generation++;
+        wake_dispatchers();
+        rc = 0;
+        break;
+    }
+    sem_unlock();
+    return rc;
+}
@@ -2,21 +2,66 @@
 #ifndef SHARED_MEM_H
 #define SHARED_MEM_H
 
+#include <time.h>
+#include "config.h"
+
 #define MAX_IGNORED 32
-#define MAX_CHANNELS 10
+#define MAX_SCHEDULES 16
 
 int init_shared_resources();
 void cleanup_shared_resources();
+// Persists shared state to path (set before init_shared_resources). On init a
+// valid snapshot there is adopted; cleanup writes a final one.
+void set_shared_state_path(const char *path);
+// 1 if init_shared_resources adopted a previous snapshot
+int shared_state_restored(void);
+// Writes a checksummed snapshot of the shared state and msyncs it
+int shared_state_sync(void);
 int sem_lock();
 int sem_unlock();
 
+// One slot of the shared channel table. Slot indexes are stable for the
+// lifetime of a channel; parted slots are reused by later joins.
+typedef struct {
+    char name[MAX_STR];
+    int active;                 // joined (or being joined)
+    unsigned int epoch;         // changes every time the slot is (re)assigned
+    int stop_talking;
+    char current_topic[256];
+    // Dispatcher-to-handler forwarding counters (written by the dispatcher only)
+    unsigned long forwarded;
+    unsigned long dropped;
+    unsigned long coalesced;
+    int queue_peak;             // most lines ever waiting for the handler
+    unsigned long crashes;      // handler deaths the dispatcher recovered from
+    // Catalogue lookups answered from the handler's cache or not (written by the handler)
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+} SharedChannel;
+
+// An announcement set up with !schedule or !every; the dispatcher sends it
+typedef struct {
+    unsigned int id;        // 0 = free
+    int interval;           // seconds until it is sent (between sends for !every)
+    int repeat;
+    char channel[MAX_STR];
+    char text[400];
+} SharedSchedule;
+
 typedef struct {
-    int stop_talking[MAX_CHANNELS];
-    char current_topic[MAX_CHANNELS][256];
     char authed_admins[10][64];
     int authed_count;
+    time_t authed_until[10];    // session end per admin, 0 = never
     char ignored_nicks[MAX_IGNORED][64];
     int ignored_count;
+    // Channel table bookkeeping; the slots live in a separate growable mapping
+    int channel_capacity;       // slots allocated
+    int channel_count;          // slots ever used (high-water mark)
+    unsigned int channel_epoch; // last epoch handed out
+    unsigned int channel_generation; // bumped on every join/part
+    SharedSchedule schedules[MAX_SCHEDULES];
+    unsigned int schedule_id;         // last id handed out
+    unsigned int schedule_generation; // bumped on every add/remove
 } SharedData;
 
 extern SharedData *shared_data;
@@ -25,4 +70,24 @@ extern SharedData *shared_data;
 void *get_shared_admin_auth_ptr();
 int *get_shared_authed_count_ptr();
 
+// Returns the slot at index (remapping if another process grew the table), or NULL
+SharedChannel *shared_channel(int index);
+// Number of slots in use, including parted ones (iterate and check ->active)
+int shared_channel_count(void);
+// Index of the active slot named name (case-insensitive), or -1
+int shared_channel_find(const char *name);
+// Adds a channel, growing the table as needed; returns its slot index or -1
+int shared_channel_add(const char *name);
+// Parts the channel in slot index; its handler is torn down by the dispatcher
+void shared_channel_remove(int index);
+// Adds an fd written to whenever the channel or schedule table changes, to
+// wake a dispatcher (one per connection)
+void add_channel_notify_fd(int fd);
+// Wakes every dispatcher through those fds, as a table change does
+void wake_dispatchers(void);
+// Adds an announcement for channel; returns its id, or 0 when the table is full
+unsigned int shared_schedule_add(int interval, int repeat, const char *channel, const char *text);
+// Removes the announcement with this id; returns 0, or -1 if there is none
+int shared_schedule_remove(unsigned int id);
+
 #endif
@@ -0,0 +1,128 @@
+// timer_wheel.c - Hierarchical timer wheel for deadlines in an event loop
+//
+// Level L has 64 slots of 64^L ticks each. A timer is filed at the level of
+// the highest bit where its deadline differs from the wheel's clock, so it
+// always sits ahead of the current position at that level. When the clock
+// reaches a slot of a higher level, its timers move down (cascade) until
+// they reach level 0 and fire. Adding and cancelling are O(1); advancing
+// jumps straight to the next occupied slot instead of walking every tick.
+#include "timer_wheel.h"
+#include <limits.h>
+#include <stddef.h>
+
+#define LEVEL_SHIFT(level) (TW_BITS * (level))
+
+static void unlink_timer(TimerWheel *w, Timer *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    if (!w->slots[t->level][t->slot]) w->occupied[t->level] &= ~(1ULL << t->slot);
+    t->next = NULL;
+    t->pprev = NULL;
+    w->count--;
+}
+
+// Files t so it fires when the clock reaches due (due >= w->now)
+static void place(TimerWheel *w, Timer *t, long long due) {
+    unsigned long long diff = (unsigned long long)(due ^ w->now);
+    int level = diff ? (63 - __builtin_clzll(diff)) / TW_BITS : 0;
+    int slot;
+    if (level < TW_LEVELS) {
+        slot = (int)((due >> LEVEL_SHIFT(level)) & (TW_SLOTS - 1));
+    } else {
+        // Too far ahead: park it in the current top slot, which comes round
+        // last, and re-file it from there
+        level = TW_LEVELS - 1;
+        slot = (int)((w->now >> LEVEL_SHIFT(level)) & (TW_SLOTS - 1));
+    }
+    t->level = level;
+    t->slot = slot;
+    t->next = w->slots[level][slot];
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = &w->slots[level][slot];
+    w->slots[level][slot] = t;
+    w->occupied[level] |= 1ULL << slot;
+    w->count++;
+}
+
+// Tick of the next slot that needs work (firing or cascading), or LLONG_MAX
+static long long next_event(const TimerWheel *w) {
+    long long best = LLONG_MAX;
+    for (int level = 0; level < TW_LEVELS; ++level) {
+        uint64_t occ = w->occupied[level];
+        if (!occ) continue;
+        long long pos = w->now >> LEVEL_SHIFT(level);
+        int shift = (int)((pos + 1) & (TW_SLOTS - 1));
+        // Rotate so bit 0 is the slot right after the current one
+        uint64_t ahead = shift ? (occ >> shift) | (occ << (64 - shift)) : occ;
+        long long tick = (pos + __builtin_ctzll(ahead) + 1) << LEVEL_SHIFT(level);
+        if (tick < best) best = tick;
+    }
+    return best;
+}
+
+void tw_init(TimerWheel *w, long long now_ms) {
+    for (int level = 0; level < TW_LEVELS; ++level) {
+        for (int slot = 0; slot < TW_SLOTS; ++slot) w->slots[level][slot] = NULL;
+        w->occupied[level] = 0;
+    }
+    w->now = now_ms;
+    w->count = 0;
+}
+
+void timer_init(Timer *t, timer_fn fire, void *arg) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->deadline = 0;
+    t->level = t->slot = 0;
+    t->fire = fire;
+    t->arg = arg;
+}
+
+void tw_add(TimerWheel *w, Timer *t, long long deadline_ms) {
+    if (t->pprev) unlink_timer(w, t);
+    t->deadline = deadline_ms;
+    // The current tick has already been processed
+    place(w, t, deadline_ms > w->now ? deadline_ms : w->now + 1);
+}
+
+void tw_cancel(TimerWheel *w, Timer *t) {
+    if (t->pprev) unlink_timer(w, t);
+}
+
+void tw_advance(TimerWheel *w, long long now_ms) {
+    while (w->count > 0) {
+        long long tick = next_event(w);
+        if (tick > now_ms) break;
+        w->now = tick;
+        // Move due higher-level slots down, top first so timers can fall
+        // through several levels into the slot firing now
+        for (int level = TW_LEVELS - 1; level > 0; --level) {
+            if (tick & ((1LL << LEVEL_SHIFT(level)) - 1)) continue;
+            int slot = (int)((tick >> LEVEL_SHIFT(level)) & (TW_SLOTS - 1));
+            Timer *t = w->slots[level][slot];
+            w->slots[level][slot] = NULL;
+            w->occupied[level] &= ~(1ULL << slot);
+            while (t) {
+                Timer *next = t->next;
+                w->count--;
+                place(w, t, t->deadline > tick ? t->deadline : tick);
+                t = next;
+            }
+        }
+        // Timers added by callbacks are always filed ahead of this slot
+        Timer **slot = &w->slots[0][tick & (TW_SLOTS - 1)];
+        while (*slot) {
+            Timer *t = *slot;
+            unlink_timer(w, t);
+            t->fire(t, t->arg);
+        }
+    }
+    if (now_ms > w->now) w->now = now_ms;
+}
+
+int tw_next_timeout(const TimerWheel *w, long long now_ms) {
+    if (w->count == 0) return -1;
+    long long wait = next_event(w) - now_ms;
+    if (wait <= 0) return 0;
+    return wait > INT_MAX ? INT_MAX : (int)wait;
+}
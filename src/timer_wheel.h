@@ -0,0 +1,44 @@
+// timer_wheel.h - Hierarchical timer wheel for deadlines in an event loop
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 5 // 1 ms ticks: level 4 reaches about 12 days, later deadlines re-cascade
+
+typedef struct Timer Timer;
+typedef void (*timer_fn)(Timer *timer, void *arg);
+
+// A pending deadline. Timers are embedded in their owner and must stay at the
+// same address while armed.
+struct Timer {
+    Timer *next;
+    Timer **pprev;      // NULL while not armed
+    long long deadline; // ms, on the wheel's clock
+    int level, slot;    // where the timer is filed while armed
+    timer_fn fire;
+    void *arg;
+};
+
+typedef struct {
+    long long now;                 // last tick processed
+    Timer *slots[TW_LEVELS][TW_SLOTS];
+    uint64_t occupied[TW_LEVELS];  // bit per non-empty slot
+    int count;
+} TimerWheel;
+
+void tw_init(TimerWheel *w, long long now_ms);
+void timer_init(Timer *t, timer_fn fire, void *arg);
+// Arms (or re-arms) t to fire at deadline_ms; past deadlines fire on the next advance
+void tw_add(TimerWheel *w, Timer *t, long long deadline_ms);
+void tw_cancel(TimerWheel *w, Timer *t);
+static inline int timer_armed(const Timer *t) { return t->pprev != 0; }
+// Fires every timer due by now_ms, in deadline order; callbacks may add or cancel timers
+void tw_advance(TimerWheel *w, long long now_ms);
+// Milliseconds until the wheel next needs advancing (may be early, never
+// late), or -1 when nothing is armed; suitable as a poll timeout
+int tw_next_timeout(const TimerWheel *w, long long now_ms);
+
+#endif
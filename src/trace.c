@@ -0,0 +1,24 @@
+// trace.c - Semaphores of the USDT probes declared in trace.h
+#include "trace.h"
+#include <time.h>
+
+#ifdef HAVE_USDT
+// Tracers find these in the .probes section and count attachments in them
+#define DEFINE_SEMAPHORE(name) \
+    volatile unsigned short TRACE_SEMAPHORE(name) __attribute__((section(".probes"))) = 0
+
+DEFINE_SEMAPHORE(line_received);
+DEFINE_SEMAPHORE(forward);
+DEFINE_SEMAPHORE(handler_entry);
+DEFINE_SEMAPHORE(handler_exit);
+DEFINE_SEMAPHORE(narrative);
+DEFINE_SEMAPHORE(mention);
+DEFINE_SEMAPHORE(send_enqueue);
+DEFINE_SEMAPHORE(socket_write);
+#endif
+
+long long trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,47 @@
+// trace.h - USDT probes on the message pipeline
+//
+// Each probe is a single nop until a tracer (bpftrace, perf, SystemTap)
+// attaches to it, and its arguments are only evaluated while one is
+// attached: every probe has a semaphore the tracer increments. Without
+// <sys/sdt.h> the probes compile to nothing. List them with
+// `readelf -n irc_bot`; bench/pipeline.bt turns them into per-stage latencies.
+//
+// Provider irc_bot; timestamps are CLOCK_MONOTONIC nanoseconds:
+//   line_received(len, ns)            dispatcher split one line off the socket
+//   forward(channel, len, ns)         dispatcher hands a line to a channel handler
+//   handler_entry(channel, len, ns)   handler starts on forwarded input
+//   handler_exit(channel, ns)         handler is done with it
+//   narrative(hit, ns)                catalogue lookup, hit = 1 or 0
+//   mention(channel, kind, ns)        kind 0 = user mention, 1 = channel mention
+//   send_enqueue(len, ns)             a handler or the dispatcher sends lines
+//   socket_write(len, ns)             bytes written to the server socket
+#ifndef TRACE_H
+#define TRACE_H
+
+#if defined(__has_include) && !defined(NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(name) irc_bot_##name##_semaphore
+extern volatile unsigned short TRACE_SEMAPHORE(line_received), TRACE_SEMAPHORE(forward),
+    TRACE_SEMAPHORE(handler_entry), TRACE_SEMAPHORE(handler_exit), TRACE_SEMAPHORE(narrative),
+    TRACE_SEMAPHORE(mention), TRACE_SEMAPHORE(send_enqueue), TRACE_SEMAPHORE(socket_write);
+
+#define TRACE(name, ...) do { \
+        if (__builtin_expect(TRACE_SEMAPHORE(name), 0)) STAP_PROBEV(irc_bot, name, __VA_ARGS__); \
+    } while (0)
+#else
+// Never called, but the arguments are still type-checked
+static inline void trace_discard(int unused, ...) { (void)unused; }
+#define TRACE(name, ...) do { if (0) trace_discard(0, __VA_ARGS__); } while (0)
+#endif
+
+long long trace_now_ns(void);
+
+#endif
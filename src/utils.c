@@ -5,10 +5,15 @@
 #include <stdarg.h>
 #include <time.h>
 #include <semaphore.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 static char logfile_path[256] = "bot.log";
+static int log_level = LOG_DEBUG;
 static sem_t log_sem;
 static int log_sem_initialized = 0;
+static long long virtual_now_us = -1; // -1 while running on the wall clock
+static long dispatcher_tid = -1;
 
 void trim_whitespace(char *str) {
     if (!str) return;
@@ -45,7 +50,19 @@ void set_logfile_path(const char *path) {
     }
 }
 
+void set_log_level(int level) {
+    log_level = level;
+}
+
+static int message_level(const char *fmt) {
+    if (strncmp(fmt, "[ERROR]", 7) == 0) return LOG_ERROR;
+    if (strncmp(fmt, "[WARN]", 6) == 0) return LOG_WARN;
+    if (strncmp(fmt, "[IRC]", 5) == 0 || strncmp(fmt, "[FORWARD]", 9) == 0) return LOG_DEBUG;
+    return LOG_INFO;
+}
+
 void log_message(const char *fmt, ...) {
+    if (message_level(fmt) > log_level) return;
     if (!log_sem_initialized) {
         sem_init(&log_sem, 1, 1);
         log_sem_initialized = 1;
@@ -57,7 +74,7 @@ void log_message(const char *fmt, ...) {
         return;
     }
     // Add timestamp
-    time_t now = time(NULL);
+    time_t now = bot_time();
     struct tm *tm_info = localtime(&now);
     char timebuf[32];
     strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", tm_info);
@@ -70,3 +87,48 @@ void log_message(const char *fmt, ...) {
     fclose(f);
     sem_post(&log_sem);
 }
+
+// By thread id: forked children and pool threads all have their own
+void mark_dispatcher_thread(void) {
+    dispatcher_tid = syscall(SYS_gettid);
+}
+
+int on_dispatcher_thread(void) {
+    return dispatcher_tid >= 0 && syscall(SYS_gettid) == dispatcher_tid;
+}
+
+time_t bot_time(void) {
+    if (virtual_now_us >= 0) return (time_t)(virtual_now_us / 1000000);
+    return time(NULL);
+}
+
+void bot_sleep_us(unsigned long usec) {
+    if (virtual_now_us >= 0) {
+        virtual_now_us += usec;
+        return;
+    }
+    usleep(usec);
+}
+
+void enable_virtual_clock(long long start_us) {
+    virtual_now_us = start_us < 0 ? 0 : start_us;
+}
+
+int virtual_clock_enabled(void) {
+    return virtual_now_us >= 0;
+}
+
+void advance_virtual_clock(long long t_us) {
+    if (virtual_now_us >= 0 && t_us > virtual_now_us) virtual_now_us = t_us;
+}
+
+long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long bot_clock_ms(void) {
+    if (virtual_now_us >= 0) return virtual_now_us / 1000;
+    return monotonic_ms();
+}
@@ -2,16 +2,47 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <time.h>
+
 // Trims leading and trailing whitespace in-place
 void trim_whitespace(char *str);
 
 // Case-insensitive string search
 char *strcasestr(const char *haystack, const char *needle);
 
+// Log levels, most important first
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
 // Log message with variable arguments
 void log_message(const char *fmt, ...);
 
 // Set the log file path for logging
 void set_logfile_path(const char *path);
+// Messages less important than level are not written. A message's level comes
+// from its tag: [ERROR] and [WARN] are what they say, per-line traffic ([IRC],
+// [FORWARD]) is debug, everything else info.
+void set_log_level(int level);
+
+// Marks the calling thread as its connection's dispatcher, which must never
+// block on the send rate (see pacing_after_send)
+void mark_dispatcher_thread(void);
+int on_dispatcher_thread(void);
+
+// Current time in seconds; follows the virtual clock once it is enabled
+time_t bot_time(void);
+// Sleeps, or advances the virtual clock instead when it is enabled
+void bot_sleep_us(unsigned long usec);
+// Switches to a virtual clock starting at start_us (microseconds since the epoch)
+void enable_virtual_clock(long long start_us);
+int virtual_clock_enabled(void);
+// Moves the virtual clock forward to t_us (never backwards)
+void advance_virtual_clock(long long t_us);
+// Real monotonic milliseconds, for network timeouts (ignores the virtual clock)
+long long monotonic_ms(void);
+// Milliseconds for timer wheels: the virtual clock once enabled, else monotonic
+long long bot_clock_ms(void);
 
 #endif // UTILS_H
@@ -0,0 +1,337 @@
+// worker_pool.c - Fixed pool of handler threads with channel sharding
+#include "worker_pool.h"
+#include "utils.h"
+#include "shared_mem.h"
+#include "placement.h"
+#include "rehash.h"
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define WORKER_BATCH 16 // messages run per turn before a hot channel is requeued
+
+typedef struct QueuedMessage {
+    struct QueuedMessage *next;
+    IrcPrivmsg pm;
+    int has_pm;
+    char line[];
+} QueuedMessage;
+
+typedef struct {
+    pthread_mutex_t lock;
+    QueuedMessage *head, *tail;
+    int queued;    // messages in the list, bounded by queue_limit
+    int scheduled; // sitting in a worker deque or being run
+    int removed;   // parted; freed by whoever releases it last
+    int home;
+    ChannelContext ctx;
+} PoolChannel;
+
+typedef struct {
+    pthread_mutex_t lock;
+    PoolChannel **deque; // ring of scheduled channels
+    int head, count, cap;
+    pthread_t thread;
+    int id;
+    unsigned long handled, stolen;
+} PoolWorker;
+
+static PoolChannel **channels = NULL; // indexed by shared channel slot
+static int channel_capacity = 0;
+static pthread_rwlock_t channels_lock = PTHREAD_RWLOCK_INITIALIZER;
+static const BotConfig *pool_config = NULL;
+static int pool_sockfd = -1;
+static PoolWorker *workers = NULL;
+static int worker_count = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int pending = 0;   // channels waiting in deques, guarded by idle_lock
+static int stopping = 0;
+
+// FNV-1a over the lowercased channel name
+static unsigned int channel_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for (const char *p = name; *p; ++p) {
+        h ^= (unsigned char)tolower((unsigned char)*p);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void deque_push_back(PoolWorker *w, PoolChannel *chan) {
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->cap) {
+        // Grow and unwrap the ring; a channel sits in at most one deque
+        int cap = w->cap * 2;
+        PoolChannel **deque = malloc(cap * sizeof(*deque));
+        if (!deque) {
+            pthread_mutex_unlock(&w->lock);
+            return;
+        }
+        for (int i = 0; i < w->count; ++i) deque[i] = w->deque[(w->head + i) % w->cap];
+        free(w->deque);
+        w->deque = deque;
+        w->head = 0;
+        w->cap = cap;
+    }
+    w->deque[(w->head + w->count) % w->cap] = chan;
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+    pthread_mutex_lock(&idle_lock);
+    pending++;
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// Owners take from the front, thieves from the back
+static PoolChannel *deque_pop(PoolWorker *w, int from_back) {
+    PoolChannel *chan = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0) {
+        if (from_back) {
+            chan = w->deque[(w->head + w->count - 1) % w->cap];
+        } else {
+            chan = w->deque[w->head];
+            w->head = (w->head + 1) % w->cap;
+        }
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (chan) {
+        pthread_mutex_lock(&idle_lock);
+        pending--;
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return chan;
+}
+
+static PoolChannel *find_work(PoolWorker *self) {
+    PoolChannel *chan = deque_pop(self, 0);
+    if (chan) return chan;
+    for (int i = 1; i < worker_count; ++i) {
+        PoolWorker *victim = &workers[(self->id + i) % worker_count];
+        chan = deque_pop(victim, 1);
+        if (chan) {
+            self->stolen++;
+            return chan;
+        }
+    }
+    return NULL;
+}
+
+static void free_channel(PoolChannel *ch) {
+    QueuedMessage *msg = ch->head;
+    while (msg) {
+        QueuedMessage *next = msg->next;
+        free(msg);
+        msg = next;
+    }
+    pthread_mutex_destroy(&ch->lock);
+    free(ch);
+}
+
+// Runs up to WORKER_BATCH messages of one channel, then releases or requeues it
+static void run_channel(PoolWorker *self, PoolChannel *ch) {
+    for (int n = 0; n < WORKER_BATCH; ++n) {
+        pthread_mutex_lock(&ch->lock);
+        QueuedMessage *msg = ch->head;
+        if (!msg || ch->removed) {
+            int removed = ch->removed;
+            ch->scheduled = 0;
+            pthread_mutex_unlock(&ch->lock);
+            if (removed) free_channel(ch);
+            return;
+        }
+        ch->head = msg->next;
+        if (!ch->head) ch->tail = NULL;
+        ch->queued--;
+        pthread_mutex_unlock(&ch->lock);
+        rehash_hold();
+        channel_handle_message(&ch->ctx, msg->line, msg->has_pm ? &msg->pm : NULL);
+        rehash_release();
+        self->handled++;
+        free(msg);
+    }
+    // Still busy: go to the back of our own deque so other channels get a turn
+    deque_push_back(self, ch);
+}
+
+static void *worker_main(void *arg) {
+    PoolWorker *self = arg;
+    placement_enter_handler(self->id);
+    for (;;) {
+        PoolChannel *chan = find_work(self);
+        if (chan) {
+            run_channel(self, chan);
+            continue;
+        }
+        pthread_mutex_lock(&idle_lock);
+        while (pending == 0 && !stopping) pthread_cond_wait(&idle_cond, &idle_lock);
+        int done = pending == 0 && stopping;
+        pthread_mutex_unlock(&idle_lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+int worker_pool_start(const BotConfig *config, int sockfd, int nworkers) {
+    if (nworkers < 1) nworkers = 1;
+    workers = calloc(nworkers, sizeof(PoolWorker));
+    if (!workers) return -1;
+    pool_config = config;
+    pool_sockfd = sockfd;
+    worker_count = nworkers;
+    stopping = 0;
+    pending = 0;
+    for (int w = 0; w < nworkers; ++w) {
+        workers[w].id = w;
+        workers[w].cap = 16;
+        workers[w].deque = calloc(workers[w].cap, sizeof(PoolChannel *));
+        pthread_mutex_init(&workers[w].lock, NULL);
+        if (!workers[w].deque || pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]) != 0) {
+            perror("worker_pool");
+            return -1;
+        }
+    }
+    log_message("[INFO] Worker pool started with %d workers", nworkers);
+    return 0;
+}
+
+int worker_pool_add_channel(int channel_index, const char *name) {
+    if (!workers || channel_index < 0) return -1;
+    PoolChannel *ch = calloc(1, sizeof(PoolChannel));
+    if (!ch) return -1;
+    pthread_mutex_init(&ch->lock, NULL);
+    ch->home = channel_hash(name) % worker_count;
+    channel_init(&ch->ctx, pool_config, channel_index, pool_sockfd);
+    pthread_rwlock_wrlock(&channels_lock);
+    if (channel_index >= channel_capacity) {
+        int capacity = channel_capacity ? channel_capacity : 16;
+        while (capacity <= channel_index) capacity *= 2;
+        PoolChannel **grown = realloc(channels, capacity * sizeof(*grown));
+        if (!grown) {
+            pthread_rwlock_unlock(&channels_lock);
+            free_channel(ch);
+            return -1;
+        }
+        memset(grown + channel_capacity, 0, (capacity - channel_capacity) * sizeof(*grown));
+        channels = grown;
+        channel_capacity = capacity;
+    }
+    channels[channel_index] = ch;
+    pthread_rwlock_unlock(&channels_lock);
+    printf("[POOL] Channel %s -> worker %d\n", name, ch->home);
+    return 0;
+}
+
+void worker_pool_remove_channel(int channel_index) {
+    PoolChannel *ch = NULL;
+    pthread_rwlock_wrlock(&channels_lock);
+    if (channel_index >= 0 && channel_index < channel_capacity) {
+        ch = channels[channel_index];
+        channels[channel_index] = NULL;
+    }
+    pthread_rwlock_unlock(&channels_lock);
+    if (!ch) return;
+    // A scheduled channel is freed by the worker that next picks it up
+    pthread_mutex_lock(&ch->lock);
+    ch->removed = 1;
+    int idle = !ch->scheduled;
+    pthread_mutex_unlock(&ch->lock);
+    if (idle) free_channel(ch);
+}
+
+void worker_pool_submit(int channel_index, const char *line, size_t len, const IrcPrivmsg *pm, void *arg) {
+    QueuedMessage *msg = malloc(sizeof(QueuedMessage) + len + 1);
+    if (!msg) return;
+    memcpy(msg->line, line, len);
+    msg->line[len] = 0;
+    msg->next = NULL;
+    msg->has_pm = pm != NULL;
+    if (pm) {
+        // Rebase the message text onto our own copy of the line
+        msg->pm = *pm;
+        size_t off = pm->text - line;
+        msg->pm.text = off <= len ? msg->line + off : msg->line + len;
+    }
+    pthread_rwlock_rdlock(&channels_lock);
+    PoolChannel *ch = channel_index >= 0 && channel_index < channel_capacity ? channels[channel_index] : NULL;
+    if (!ch) {
+        pthread_rwlock_unlock(&channels_lock);
+        free(msg);
+        return;
+    }
+    SharedChannel *slot = shared_channel(channel_index);
+    pthread_mutex_lock(&ch->lock);
+    // Same bounded-queue policy as the child pipes
+    if (ch->queued >= pool_config->queue_limit) {
+        QueuedMessage *victim = NULL, *prev = NULL;
+        int coalesced = 0;
+        QueuePolicy policy = pool_config->queue_policy;
+        if (policy == QUEUE_COALESCE && pm) {
+            for (QueuedMessage *m = ch->head, *p = NULL; m; p = m, m = m->next) {
+                if (m->has_pm && strcasecmp(m->pm.sender, pm->sender) == 0) {
+                    victim = m;
+                    prev = p;
+                    coalesced = 1;
+                }
+            }
+        }
+        if (policy == QUEUE_DROP_NEWEST) {
+            pthread_mutex_unlock(&ch->lock);
+            pthread_rwlock_unlock(&channels_lock);
+            free(msg);
+            if (slot) slot->dropped++;
+            return;
+        }
+        if (!victim) victim = ch->head; // drop oldest
+        if (prev) prev->next = victim->next;
+        else ch->head = victim->next;
+        if (ch->tail == victim) ch->tail = prev;
+        ch->queued--;
+        free(victim);
+        if (slot) {
+            if (coalesced) slot->coalesced++;
+            else slot->dropped++;
+        }
+    }
+    if (ch->tail) ch->tail->next = msg;
+    else ch->head = msg;
+    ch->tail = msg;
+    ch->queued++;
+    if (slot) {
+        slot->forwarded++;
+        if (ch->queued > slot->queue_peak) slot->queue_peak = ch->queued;
+    }
+    int wake = !ch->scheduled;
+    ch->scheduled = 1;
+    pthread_mutex_unlock(&ch->lock);
+    // Scheduled under the read lock so a concurrent remove can't free it first
+    if (wake) deque_push_back(&workers[ch->home], ch);
+    pthread_rwlock_unlock(&channels_lock);
+}
+
+void worker_pool_stop(void) {
+    if (!workers) return;
+    pthread_mutex_lock(&idle_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    for (int w = 0; w < worker_count; ++w) {
+        pthread_join(workers[w].thread, NULL);
+        log_message("[INFO] Worker %d handled %lu messages, stole %lu channel turns", w, workers[w].handled, workers[w].stolen);
+        free(workers[w].deque);
+        pthread_mutex_destroy(&workers[w].lock);
+    }
+    for (int i = 0; i < channel_capacity; ++i) {
+        if (channels[i]) free_channel(channels[i]);
+    }
+    free(workers);
+    free(channels);
+    workers = NULL;
+    channels = NULL;
+    worker_count = channel_capacity = 0;
+}
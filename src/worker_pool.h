@@ -0,0 +1,25 @@
+// worker_pool.h - Fixed pool of handler threads with channel sharding
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+#include "config.h"
+#include "irc_client.h"
+
+// Starts nworkers threads. Each channel is hash-sharded to a home worker;
+// idle workers steal queued channels from busy ones. A channel is only ever
+// run by one worker at a time, so its messages are handled in order.
+int worker_pool_start(const BotConfig *config, int sockfd, int nworkers);
+
+// Adds or drops the handler context for a shared channel slot (!join/!part).
+// Messages still queued for a removed channel are discarded.
+int worker_pool_add_channel(int channel_index, const char *name);
+void worker_pool_remove_channel(int channel_index);
+
+// Queues a dispatched line for its channel (matches forward_fn)
+void worker_pool_submit(int channel_index, const char *line, size_t len, const IrcPrivmsg *pm, void *arg);
+
+// Drains the queues, joins all workers and logs per-worker counters
+void worker_pool_stop(void);
+
+#endif